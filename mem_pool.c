@@ -3,9 +3,44 @@
 // Function declarations added by Vladislav Makarov on 3/6/16.
 // Last edit was made by Vladislav Makarov on 3/20/16.
 
+#define _POSIX_C_SOURCE 200809L // for clock_gettime() and pthreads under -std=c11
+#define _DEFAULT_SOURCE // for MAP_ANONYMOUS and syscall()
+
 #include <stdlib.h>
+#include <stdatomic.h>
+#include <limits.h> // for UINT_MAX
 #include <assert.h>
 #include <stdio.h> // for perror()
+#include <string.h> // for memset()
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h> // for write()
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h> // mbind() and getcpu(), without a libnuma dependency
+#endif
+#ifdef __GLIBC__
+#include <execinfo.h> // for backtrace() and backtrace_symbols_fd()
+#endif
+
+// AddressSanitizer is detected, memcheck client requests are opt-in
+#if defined(__SANITIZE_ADDRESS__)
+#define MEM_POOL_ASAN
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define MEM_POOL_ASAN
+#endif
+#endif
+
+#ifdef MEM_POOL_ASAN
+#include <sanitizer/asan_interface.h>
+#endif
+#ifdef MEM_POOL_VALGRIND
+#include <valgrind/memcheck.h>
+#endif
 
 #include "mem_pool.h"
 
@@ -29,6 +64,106 @@ static const unsigned   MEM_GAP_IX_INIT_CAPACITY        = 40;
 static const float      MEM_GAP_IX_FILL_FACTOR          = 0.75;
 static const unsigned   MEM_GAP_IX_EXPAND_FACTOR        = 2;
 
+static const unsigned   MEM_QUICK_LIST_CAPACITY         = 32;
+
+#define MEM_NODE_HEAP_MAX_CHUNKS 32 // the node heap doubles with every chunk, so this is never reached
+
+#define MEM_SNAPSHOT_BUFFER_SIZE 4096 // packed segments are written in blocks of this many bytes
+
+// file-backed pools: a header page, the pool memory, then the packed
+// segments, which are only written (and the header marked clean) on close
+static const size_t     MEM_FILE_HEADER_SIZE            = 4096; // keeps pool.mem page-aligned
+
+#define MEM_FILE_MAGIC 0x4c46504dU // "MPFL"
+#define MEM_FILE_VERSION 1
+
+// shared pools: a header page, the pool memory, then an arena for the
+// pool manager, node heap and gap index, all mapped at the same address
+// in every process so the pointers in them stay valid
+static const size_t     MEM_SHARED_HEADER_SIZE          = 4096;
+static const unsigned   MEM_SHARED_ATTACH_TIMEOUT_MS    = 1000; // for the creator to finish initializing
+
+#define MEM_SHARED_MAGIC 0x4853504dU // "MPSH"
+#define MEM_SHARED_VERSION 1
+#define MEM_SHARED_NAME_MAX 256
+
+static const size_t     MEM_ARENA_ALIGNMENT             = 16;
+
+// NUMA pools: the pool memory, then the metadata arena, in one anonymous
+// mapping whose pages are preferred on the node before anything touches them
+static const size_t     MEM_NUMA_PAGE_SIZE              = 4096;
+static const unsigned   MEM_NUMA_NODE_REFRESH           = 64; // allocations between getcpu() calls per thread
+static const int        MEM_MPOL_PREFERRED              = 1; // from <numaif.h>
+static const char      *MEM_NUMA_ONLINE_PATH            = "/sys/devices/system/node/online";
+
+// heap profiler: sampled allocations with the same stack share a bucket
+static const unsigned   MEM_PROFILE_HASH_SIZE           = 1024; // bucket chains
+static const char      *MEM_PROFILE_MAPS_PATH           = "/proc/self/maps";
+
+#define MEM_PROFILE_MAX_DEPTH 32 // stack frames kept per bucket
+#define MEM_PROFILE_MAX_SKIP 4 // frames inside the library, above the caller of mem_new_alloc
+
+// debug guard mode: every allocation sits between two redzones of canary
+// bytes and all free memory is poisoned, so stray writes can be caught
+static const unsigned   MEM_GUARD_SIZE                  = 16; // redzone bytes on either side
+static const unsigned   MEM_GUARD_QUARANTINE_CAPACITY   = 64; // freed blocks held back from reuse
+static const uint8_t    MEM_GUARD_CANARY                = 0xfd; // redzones
+static const uint8_t    MEM_GUARD_FRESH                 = 0xcd; // newly allocated, never written
+static const uint8_t    MEM_GUARD_POISON                = 0xdd; // free
+
+// pool cache: closed heap pools are kept, with their memory, first node
+// chunk and gap index, for the next open of the same size
+static const size_t     MEM_POOL_CACHE_MAX_SIZE         = 1 << 24; // bigger pools go back to malloc
+
+#define MEM_POOL_CACHE_CAPACITY 8 // closed pools kept at most
+
+
+
+/***********/
+/*         */
+/* Metrics */
+/*         */
+/***********/
+// with MEM_POOL_METRICS undefined these expand to nothing, so the hot
+// paths carry no counters, no clock reads and no histogram storage
+#ifdef MEM_POOL_METRICS
+#define METRICS_COUNT(mgr, counter, n)      ((mgr)->metrics.counter += (n))
+#define METRICS_START(start)                unsigned long long start = _mem_now_ns()
+#define METRICS_RECORD(mgr, hist, start)    _mem_hist_record(&(mgr)->metrics.hist, _mem_now_ns() - (start))
+#else
+#define METRICS_COUNT(mgr, counter, n)      ((void) 0)
+#define METRICS_START(start)                ((void) 0)
+#define METRICS_RECORD(mgr, hist, start)    ((void) 0)
+#endif
+
+// the return address in the caller of the function it is used in
+#if defined(__GNUC__)
+#define MEM_CALL_SITE()                     __builtin_return_address(0)
+#else
+#define MEM_CALL_SITE()                     NULL
+#endif
+
+// a single atomic load of trace_file when tracing is off
+#define TRACE(op, mgr, size, offset)        do { if (atomic_load(&trace_file) != NULL) _mem_trace(op, (mgr)->id, (mgr)->pool.policy, size, offset); } while (0)
+
+
+
+/**************/
+/*            */
+/* Sanitizers */
+/*            */
+/**************/
+// gaps in pool.mem are made inaccessible and allocations accessible, so
+// ASan (or memcheck, with MEM_POOL_VALGRIND) sees use-after-free and
+// overruns inside a pool; without either these expand to nothing
+#if defined(MEM_POOL_ASAN) || defined(MEM_POOL_VALGRIND)
+#define MEM_MARK(mgr, addr, size, state)    _mem_mark(mgr, addr, size, state)
+#define MEM_MARK_GAPS(mgr)                  _mem_mark_gaps(mgr)
+#else
+#define MEM_MARK(mgr, addr, size, state)    ((void) 0)
+#define MEM_MARK_GAPS(mgr)                  ((void) 0)
+#endif
+
 
 
 /*********************/
@@ -40,7 +175,14 @@ typedef struct _node {
     alloc_t alloc_record;
     unsigned used;
     unsigned allocated;
+    unsigned deferred; // 1-free but parked on a quick list, not in the gap index
+    unsigned pins; // >0 - the compactor must not move this allocation
+    unsigned guard; // redzone bytes on either side of alloc_record, 0 - unguarded
+    unsigned long long alloc_ns; // POOL_LEAK_TRACKING: when it was allocated, 0 - unknown
+    const void *alloc_site; // POOL_LEAK_TRACKING: return address in mem_new_alloc's caller
+    struct _mem_profile_bucket *profile_bucket; // sampled by the heap profiler, NULL otherwise
     struct _node *next, *prev; // doubly-linked list for gap deletion
+    struct _node *quick_next; // singly-linked quick list of same-size free blocks
 } node_t, *node_pt;
 
 typedef struct _gap {
@@ -48,14 +190,129 @@ typedef struct _gap {
     node_pt node;
 } gap_t, *gap_pt;
 
+// the node heap grows by adding chunks rather than by realloc, because
+// nodes double as alloc_pt handles and must never move
+typedef struct _node_chunk {
+    node_pt nodes;
+    unsigned count;
+} node_chunk_t, *node_chunk_pt;
+
+typedef struct _quick_list {
+    size_t size; // 0 - slot not yet claimed by any size
+    node_pt head;
+} quick_list_t, *quick_list_pt;
+
+typedef struct _compactor {
+    pthread_t thread;
+    pthread_cond_t wakeup; // signalled to stop the worker early
+    unsigned segments_per_step;
+    unsigned step_interval_us;
+    alloc_move_callback move_callback;
+    node_pt cursor; // where the next step resumes, NULL - start over at the list head
+    int stop;
+} compactor_t, *compactor_pt;
+
+// where pool.mem came from, so close knows how to give it back
+typedef enum _mem_backing {
+    MEM_BACKING_HEAP,  // malloc()
+    MEM_BACKING_FILE,  // mmap(MAP_SHARED) of a file, after its header page
+    MEM_BACKING_SHARED, // a POSIX shared memory segment, metadata included
+    MEM_BACKING_NUMA,  // an anonymous mapping bound to a NUMA node, metadata included
+    MEM_BACKING_BLOCK, // one malloc() for the initial metadata and the pool memory (POOL_SINGLE_BLOCK)
+    MEM_BACKING_USER   // the caller's buffer (mem_pool_open_in), never freed here
+} mem_backing;
+
+// bump allocator for pool metadata that must live in a given region;
+// nothing is freed before the whole region goes
+typedef struct _mem_arena {
+    char *base;
+    size_t size;
+    size_t used;
+    size_t top; // the gap index sits at [top, size) and grows down, in place
+    int spill; // 1 - when full, allocate from the C heap instead of failing
+} mem_arena_t, *mem_arena_pt;
+
+// live and total sampled allocations for one stack
+typedef struct _mem_profile_bucket {
+    struct _mem_profile_bucket *next; // hash chain
+    unsigned long long inuse_objs;
+    unsigned long long inuse_bytes;
+    unsigned long long alloc_objs;
+    unsigned long long alloc_bytes;
+    unsigned depth;
+    void *pcs[MEM_PROFILE_MAX_DEPTH];
+} mem_profile_bucket_t, *mem_profile_bucket_pt;
+
+// what the sanitizers are told about a range of pool.mem
+typedef enum _mem_shadow {
+    MEM_SHADOW_NOACCESS,  // a gap
+    MEM_SHADOW_UNDEFINED, // a new allocation, or memory handed back
+    MEM_SHADOW_DEFINED    // an allocation whose contents survived, e.g. in a pool file
+} mem_shadow;
+
+typedef enum _mem_file_state {
+    MEM_FILE_CLEAN = 1, // closed normally, the segment stream matches the data
+    MEM_FILE_DIRTY      // open, or the process died with it open
+} mem_file_state;
+
+// the first bytes of a pool file's header page
+typedef struct _mem_file_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t state;
+    uint32_t policy;
+    uint64_t total_size;
+    uint64_t stream_size; // packed segments after the pool memory
+    uint64_t num_segments;
+} mem_file_header_t;
+
+typedef struct _pool_mgr *pool_mgr_pt;
+
+// the first bytes of a shared pool's segment
+typedef struct _mem_shared_header {
+    uint32_t magic;
+    uint32_t version;
+    atomic_uint ready; // set last by the creating process
+    unsigned attached; // processes with the pool open, under the pool lock
+    char *base; // where every process maps the segment
+    size_t map_size;
+    pool_mgr_pt pool_mgr;
+    mem_arena_t arena;
+    char name[MEM_SHARED_NAME_MAX];
+} mem_shared_header_t;
+
 typedef struct _pool_mgr {
     pool_t pool;
-    node_pt node_heap;
+    node_pt node_heap; // the first chunk
+    node_chunk_t node_chunks[MEM_NODE_HEAP_MAX_CHUNKS];
+    unsigned num_node_chunks;
+    node_pt free_nodes; // unused nodes, chained through next
+    node_pt list_head; // first segment in address order (moves on compaction)
     unsigned total_nodes;
     unsigned used_nodes;
     gap_pt gap_ix;
     unsigned gap_ix_capacity;
-} pool_mgr_t, *pool_mgr_pt;
+    unsigned flags;
+    quick_list_pt quick_lists; // NULL unless POOL_DEFERRED_COALESCING
+    unsigned num_deferred; // gaps counted in pool.num_gaps but kept out of gap_ix
+    node_pt *quarantine; // NULL unless POOL_DEBUG_GUARDS, a ring of freed (deferred) blocks
+    unsigned quarantine_head;
+    unsigned quarantine_count;
+    pthread_mutex_t lock; // taken only with POOL_THREAD_SAFE
+    unsigned gap_hist[POOL_STATS_SIZE_CLASSES]; // gaps per size class, kept up to date with num_gaps
+    size_t gap_hist_bytes[POOL_STATS_SIZE_CLASSES];
+    compactor_pt compactor; // NULL unless a background compactor is running
+    unsigned id; // never reused, identifies the pool in traces
+    mem_backing backing;
+    mem_arena_pt arena; // NULL - metadata on the C heap
+    char *map; // MEM_BACKING_FILE/SHARED: the whole mapping, header page included; MEM_BACKING_BLOCK: the block
+    size_t map_size;
+    int fd; // MEM_BACKING_FILE only
+    unsigned slot; // index in pool_store (a shared pool's may be another process's)
+#ifdef MEM_POOL_METRICS
+    pool_metrics_t metrics;
+#endif
+} pool_mgr_t;
 
 
 
@@ -65,8 +322,22 @@ typedef struct _pool_mgr {
 /*                         */
 /***************************/
 static pool_mgr_pt *pool_store = NULL; // an array of pointers, only expand
-static unsigned pool_store_size = 0;
+static unsigned pool_store_size = 0; // slots ever handed out, NULL again once their pool is closed
 static unsigned pool_store_capacity = 0;
+static unsigned *pool_store_free_slots = NULL; // a stack of released slots, reused before pool_store_size grows
+static unsigned pool_store_num_free = 0;
+static pool_mgr_pt pool_cache[MEM_POOL_CACHE_CAPACITY]; // closed managers, reset and ready to be opened again
+static unsigned pool_cache_size = 0;
+static unsigned next_pool_id = 1;
+static _Atomic(FILE *) trace_file = NULL; // NULL - tracing off; set and cleared under trace_lock
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER; // held while a record is written, so stop cannot close the file under it
+static int leak_report_fd = -1; // -1 - no leak reports from mem_pool_close and mem_free
+static atomic_size_t profile_sample_bytes; // 0 - heap profiler off
+static mem_profile_bucket_pt *profile_table = NULL; // never freed, sampled nodes point into it
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+#ifdef MEM_POOL_METRICS
+static pool_metrics_t closed_pool_metrics; // folded in from every closed pool, plus failed opens
+#endif
 
 
 
@@ -76,11 +347,81 @@ static unsigned pool_store_capacity = 0;
 /*                                          */
 /********************************************/
 static alloc_status _mem_resize_pool_store();
+static void _mem_pool_store_add(pool_mgr_pt pool_mgr);
+static void _mem_pool_store_remove(pool_mgr_pt pool_mgr);
+static pool_mgr_pt _mem_pool_cache_take(size_t size);
+static void _mem_pool_cache_put(pool_mgr_pt pool_mgr);
+static void _mem_pool_cache_flush();
 static alloc_status _mem_resize_node_heap(pool_mgr_pt pool_mgr);
+static void _mem_push_free_nodes(pool_mgr_pt pool_mgr, node_pt nodes, unsigned count);
+static node_pt _mem_find_node(pool_mgr_pt pool_mgr, node_pt node);
 static alloc_status _mem_resize_gap_ix(pool_mgr_pt pool_mgr);
 static alloc_status _mem_add_to_gap_ix(pool_mgr_pt pool_mgr, size_t size, node_pt node);
 static alloc_status _mem_remove_from_gap_ix(pool_mgr_pt pool_mgr, size_t size, node_pt node);
 static alloc_status _mem_sort_gap_ix(pool_mgr_pt pool_mgr);
+static unsigned _mem_gap_ix_size(pool_mgr_pt pool_mgr);
+static node_pt _mem_find_gap(pool_mgr_pt pool_mgr, size_t size);
+static alloc_status _mem_coalesce_gap(pool_mgr_pt pool_mgr, node_pt node);
+static alloc_status _mem_push_quick_list(pool_mgr_pt pool_mgr, node_pt node);
+static node_pt _mem_pop_quick_list(pool_mgr_pt pool_mgr, size_t size);
+static char *_mem_segment_mem(const node_t *node);
+static size_t _mem_segment_size(const node_t *node);
+static alloc_pt _mem_guard_wrap(pool_mgr_pt pool_mgr, node_pt node, size_t size);
+static alloc_status _mem_guard_check(pool_mgr_pt pool_mgr, const char *mem, size_t len, uint8_t expected, const char *what);
+static alloc_status _mem_quarantine_push(pool_mgr_pt pool_mgr, node_pt node);
+static alloc_status _mem_quarantine_evict(pool_mgr_pt pool_mgr);
+static void _mem_lock(pool_mgr_pt pool_mgr);
+static void _mem_unlock(pool_mgr_pt pool_mgr);
+static alloc_pt _mem_new_alloc(pool_pt pool, size_t size);
+static alloc_status _mem_del_alloc(pool_pt pool, alloc_pt alloc);
+static alloc_status _mem_consolidate(pool_pt pool);
+static alloc_status _mem_compact(pool_pt pool, alloc_move_callback move_callback);
+static void _mem_inspect_pool(pool_pt pool, pool_segment_pt *segments, unsigned *num_segments);
+static unsigned _mem_inspect_pool_into(pool_mgr_pt pool_mgr, pool_segment_pt buf, unsigned cap);
+static unsigned _mem_pack_segment(uint8_t *out, size_t size, unsigned allocated);
+static alloc_status _mem_write_all(int fd, const void *buf, size_t len);
+static alloc_status _mem_leak_report(pool_mgr_pt pool_mgr, int fd);
+static node_pt _mem_compact_step(pool_mgr_pt pool_mgr, node_pt start, unsigned max_segments, alloc_move_callback move_callback);
+static void *_mem_compactor_main(void *arg);
+static unsigned _mem_size_class(size_t size);
+static void _mem_track_gap(pool_mgr_pt pool_mgr, size_t size, int delta);
+static pool_pt _mem_pool_open(size_t size, alloc_policy policy, unsigned flags, char *mem, mem_arena_pt arena);
+static pool_pt _mem_shared_create(int fd, const char *name, size_t size, alloc_policy policy);
+static pool_pt _mem_shared_attach(int fd, size_t size);
+static alloc_status _mem_shared_close(pool_mgr_pt pool_mgr);
+static int _mem_numa_num_nodes();
+static int _mem_numa_current_node();
+static void _mem_numa_bind(char *addr, size_t len, int node);
+static void *_mem_meta_calloc(mem_arena_pt arena, size_t count, size_t size);
+static void *_mem_meta_calloc_top(mem_arena_pt arena, size_t count, size_t size);
+static void *_mem_meta_realloc(mem_arena_pt arena, void *ptr, size_t old_size, size_t new_size);
+static void _mem_meta_free(mem_arena_pt arena, void *ptr);
+static size_t _mem_arena_round(size_t size);
+static size_t _mem_arena_size(size_t size, unsigned flags, int worst_case);
+static pool_pt _mem_pool_open_block(size_t size, alloc_policy policy, unsigned flags);
+static alloc_status _mem_pool_close(pool_pt pool);
+static void _mem_pool_destroy(pool_mgr_pt pool_mgr);
+static void _mem_release_mem(pool_mgr_pt pool_mgr);
+static alloc_status _mem_restore_segments(pool_mgr_pt pool_mgr, const uint8_t *stream, size_t len);
+static int _mem_compare_gaps(const void *a, const void *b);
+static size_t _mem_stream_size(pool_mgr_pt pool_mgr);
+static alloc_status _mem_write_segments(pool_mgr_pt pool_mgr, int fd);
+static void _mem_pack_segments(pool_mgr_pt pool_mgr, uint8_t *out);
+static alloc_status _mem_persist_file(pool_mgr_pt pool_mgr);
+static unsigned long long _mem_now_ns();
+static void _mem_trace(unsigned op, unsigned pool_id, alloc_policy policy, unsigned long long size, unsigned long long offset);
+static void _mem_profile_sample(node_pt node, size_t size, const void *site);
+static long long _mem_profile_interval(uint64_t *rng, size_t mean);
+static void _mem_profile_release(node_pt node);
+#if defined(MEM_POOL_ASAN) || defined(MEM_POOL_VALGRIND)
+static void _mem_mark(pool_mgr_pt pool_mgr, const char *addr, size_t size, mem_shadow state);
+static void _mem_mark_gaps(pool_mgr_pt pool_mgr);
+#endif
+#ifdef MEM_POOL_METRICS
+static unsigned _mem_hist_bucket(unsigned long long value);
+static void _mem_hist_record(latency_hist_pt hist, unsigned long long value);
+static void _mem_metrics_add(pool_metrics_pt sum, const pool_metrics_t *metrics);
+#endif
 
 
 
@@ -110,16 +451,22 @@ alloc_status mem_init()
     else if (pool_store == NULL)
     {
         pool_store = (pool_mgr_pt *) calloc(MEM_POOL_STORE_INIT_CAPACITY, sizeof(pool_mgr_t));
+        pool_store_free_slots = calloc(MEM_POOL_STORE_INIT_CAPACITY, sizeof(unsigned));
 
         // Now, check whether the allocation above succeeded
-        if (pool_store == NULL)                                                     // [1] if it DID NOT succeed, handle it appropriately
+        if (pool_store == NULL || pool_store_free_slots == NULL)                    // [1] if it DID NOT succeed, handle it appropriately
         {
+            free(pool_store);
+            free(pool_store_free_slots);
+            pool_store = NULL;
+            pool_store_free_slots = NULL;
             return ALLOC_FAIL;                                                      // do a return with the corresponding return argument
         }
 
         // [2] if it DID succeed, finish the memory pool store initialization
         pool_store_capacity = MEM_POOL_STORE_INIT_CAPACITY;                         // set pool store capacity to initial capacity
         pool_store_size = 0;                                                        // set pool store size to initial value (zero)
+        pool_store_num_free = 0;
 
         return ALLOC_OK;                                                            // do a return with the corresponding return argument
     }
@@ -158,6 +505,11 @@ alloc_status mem_free()
                 {
                     pool_alloc_status = 1;
                 }
+
+                if (leak_report_fd >= 0)                                        // say what is keeping it open
+                {
+                    mem_pool_leak_report((pool_pt) pool_store[i], leak_report_fd);
+                }
             }
         }
 
@@ -167,10 +519,14 @@ alloc_status mem_free()
         }
 
         // free the pool store and update the static variables
+        _mem_pool_cache_flush();                                                // the cached pools are not in it
         free(pool_store);
+        free(pool_store_free_slots);
         pool_store = NULL;
+        pool_store_free_slots = NULL;
         pool_store_capacity = 0;
         pool_store_size = 0;
+        pool_store_num_free = 0;
 
         return ALLOC_OK;                                                       // do a return with the corresponding return argument
     }
@@ -179,6 +535,50 @@ alloc_status mem_free()
 
 /*=================================================== pool_pt mem_pool_open function ===================================================*/
 pool_pt mem_pool_open(size_t size, alloc_policy policy)
+{
+    return mem_pool_open_ex(size, policy, POOL_DEFAULT);                        // a plain pool: eager coalescing, no extra features
+}
+
+
+/*================================================= pool_pt mem_pool_open_ex function ==================================================*/
+pool_pt mem_pool_open_ex(size_t size, alloc_policy policy, unsigned flags)
+{
+    METRICS_START(start);
+    pool_pt pool = (flags & POOL_SINGLE_BLOCK) ? _mem_pool_open_block(size, policy, flags)
+                                               : _mem_pool_open(size, policy, flags, NULL, NULL);
+
+    if (pool != NULL)
+    {
+        MEM_MARK_GAPS((pool_mgr_pt) pool);
+    }
+
+#ifdef MEM_POOL_METRICS
+    if (pool != NULL)
+    {
+        METRICS_COUNT((pool_mgr_pt) pool, open_calls, 1);
+        METRICS_RECORD((pool_mgr_pt) pool, open_latency, start);
+    }
+    else
+    {
+        closed_pool_metrics.open_calls += 1;
+        closed_pool_metrics.open_failures += 1;
+    }
+#endif
+
+    if (atomic_load(&trace_file) != NULL)                                       // pool id 0 - the open failed
+    {
+        _mem_trace(MEM_TRACE_OPEN, (pool != NULL) ? ((pool_mgr_pt) pool)->id : 0, policy, size,
+                   (pool != NULL) ? 0 : MEM_TRACE_NO_OFFSET);
+    }
+
+    return pool;
+}
+
+
+// body of mem_pool_open_ex; with mem != NULL the pool is laid over it instead
+// of a fresh malloc(), and mem is left to the caller if the open fails; with
+// arena != NULL the manager, node heap and gap index are carved out of it
+static pool_pt _mem_pool_open(size_t size, alloc_policy policy, unsigned flags, char *mem, mem_arena_pt arena)
 {
     //------------------------------------------------------------------
     // Instructor comments
@@ -215,20 +615,35 @@ pool_pt mem_pool_open(size_t size, alloc_policy policy)
     // if the pool store is already allocated
     if (pool_store != NULL)
     {
-        _mem_resize_pool_store();                                               // expand the pool store, if necessary
+        if (_mem_resize_pool_store() != ALLOC_OK)                               // expand the pool store, if necessary
+        {
+            return NULL;
+        }
 
-        pool_mgr_pt new_pool_mgr = calloc(1, sizeof(pool_mgr_t));               // allocate a new mem pool mgr
+        // a cached pool of the same size comes with its memory pool, node heap and gap index
+        pool_mgr_pt new_pool_mgr = (mem == NULL && arena == NULL) ? _mem_pool_cache_take(size) : NULL;
+        int cached = (new_pool_mgr != NULL);
+
+        if (!cached)
+        {
+            new_pool_mgr = _mem_meta_calloc(arena, 1, sizeof(pool_mgr_t));     // allocate a new mem pool mgr
+        }
         if (new_pool_mgr == NULL)                                               // check success, on error return null
         {
             return NULL;
         }
 
         // allocate a new memory pool
-        new_pool_mgr->pool.mem = malloc(size);
+        if (!cached)
+        {
+            new_pool_mgr->pool.mem = (mem != NULL) ? mem : malloc(size);
+        }
+        new_pool_mgr->backing = MEM_BACKING_HEAP;
+        new_pool_mgr->arena = arena;
 
         if (new_pool_mgr->pool.mem == NULL)                                     // check success, on error deallocate mgr and return null
         {
-            free(new_pool_mgr);                                                 // deallocate the pool mgr
+            _mem_meta_free(arena, new_pool_mgr);                                // deallocate the pool mgr
             return NULL;                                                        // return NULL
         }
 
@@ -240,39 +655,93 @@ pool_pt mem_pool_open(size_t size, alloc_policy policy)
         new_pool_mgr->pool.num_gaps = 1;
 
         // allocate a new node heap
-        new_pool_mgr->node_heap = calloc(MEM_NODE_HEAP_INIT_CAPACITY, sizeof(node_t));
+        if (!cached)
+        {
+            new_pool_mgr->node_heap = _mem_meta_calloc(arena, MEM_NODE_HEAP_INIT_CAPACITY, sizeof(node_t));
+        }
         new_pool_mgr->total_nodes = MEM_NODE_HEAP_INIT_CAPACITY;
 
         if (new_pool_mgr->node_heap == NULL)                                    // if the allocation of the new node heap has failed
         {
-            free(new_pool_mgr->pool.mem);                                       // deallocate the memory pool
-            free(new_pool_mgr);                                                 // deallocate the pool mgr
+            if (mem == NULL) free(new_pool_mgr->pool.mem);                      // deallocate the memory pool
+            _mem_meta_free(arena, new_pool_mgr);                                // deallocate the pool mgr
 
             return NULL;                                                        // return NULL
         }
 
-        // allocate a new gap index
-        new_pool_mgr->gap_ix = calloc(MEM_GAP_IX_INIT_CAPACITY, sizeof(gap_t));
-        new_pool_mgr->gap_ix_capacity = MEM_GAP_IX_INIT_CAPACITY;
+        // allocate a new gap index (a cached one keeps the capacity it grew to)
+        if (!cached)
+        {
+            new_pool_mgr->gap_ix = _mem_meta_calloc_top(arena, MEM_GAP_IX_INIT_CAPACITY, sizeof(gap_t));
+            new_pool_mgr->gap_ix_capacity = MEM_GAP_IX_INIT_CAPACITY;
+        }
 
         if (new_pool_mgr->gap_ix == NULL)                                       // if the allocation of the new gap index has failed
         {
-            free(new_pool_mgr->node_heap);                                      // deallocate the node heap
-            free(&new_pool_mgr->pool);                                          // deallocate the memory pool
-            free(new_pool_mgr);                                                 // deallocate the pool mgr
+            _mem_meta_free(arena, new_pool_mgr->node_heap);                     // deallocate the node heap
+            if (mem == NULL) free(new_pool_mgr->pool.mem);                      // deallocate the memory pool
+            _mem_meta_free(arena, new_pool_mgr);                                // deallocate the pool mgr
 
             return NULL;                                                        // return NULL
         }
 
+        // initialize the pool lock (only taken with POOL_THREAD_SAFE)
+        pthread_mutex_init(&new_pool_mgr->lock, NULL);
+
+        // allocate the quick lists, if deferred coalescing was requested
+        new_pool_mgr->flags = flags;
+        if (flags & POOL_DEFERRED_COALESCING)
+        {
+            new_pool_mgr->quick_lists = _mem_meta_calloc(arena, MEM_QUICK_LIST_CAPACITY, sizeof(quick_list_t));
+
+            if (new_pool_mgr->quick_lists == NULL)                              // if the allocation of the quick lists has failed
+            {
+                pthread_mutex_destroy(&new_pool_mgr->lock);                     // destroy the pool lock
+                _mem_meta_free(arena, new_pool_mgr->gap_ix);                    // deallocate the gap index
+                _mem_meta_free(arena, new_pool_mgr->node_heap);                 // deallocate the node heap
+                if (mem == NULL) free(new_pool_mgr->pool.mem);                  // deallocate the memory pool
+                _mem_meta_free(arena, new_pool_mgr);                            // deallocate the pool mgr
+
+                return NULL;                                                    // return NULL
+            }
+        }
+
+        // allocate the quarantine, if debug guards were requested
+        if (flags & POOL_DEBUG_GUARDS)
+        {
+            new_pool_mgr->quarantine = _mem_meta_calloc(arena, MEM_GUARD_QUARANTINE_CAPACITY, sizeof(node_pt));
+
+            if (new_pool_mgr->quarantine == NULL)                               // if the allocation of the quarantine has failed
+            {
+                pthread_mutex_destroy(&new_pool_mgr->lock);                     // destroy the pool lock
+                _mem_meta_free(arena, new_pool_mgr->quick_lists);               // deallocate the quick lists (NULL in eager mode)
+                _mem_meta_free(arena, new_pool_mgr->gap_ix);                    // deallocate the gap index
+                _mem_meta_free(arena, new_pool_mgr->node_heap);                 // deallocate the node heap
+                if (mem == NULL) free(new_pool_mgr->pool.mem);                  // deallocate the memory pool
+                _mem_meta_free(arena, new_pool_mgr);                            // deallocate the pool mgr
+
+                return NULL;                                                    // return NULL
+            }
+
+            memset(new_pool_mgr->pool.mem, MEM_GUARD_POISON, size);             // all of it is free
+        }
+
         // assign all the pointers and update meta data:
 
         // initialize top node of node heap
         new_pool_mgr->node_heap->prev = NULL;
         new_pool_mgr->node_heap->next = NULL;
-        new_pool_mgr->node_heap->used = 0;
+        new_pool_mgr->node_heap->used = 1;
         new_pool_mgr->node_heap->allocated = 0;
         new_pool_mgr->node_heap->alloc_record.mem = new_pool_mgr->pool.mem;
         new_pool_mgr->node_heap->alloc_record.size = size;
+        new_pool_mgr->list_head = new_pool_mgr->node_heap;
+
+        // the rest of the first chunk is unused
+        new_pool_mgr->node_chunks[0].nodes = new_pool_mgr->node_heap;
+        new_pool_mgr->node_chunks[0].count = MEM_NODE_HEAP_INIT_CAPACITY;
+        new_pool_mgr->num_node_chunks = 1;
+        _mem_push_free_nodes(new_pool_mgr, new_pool_mgr->node_heap + 1, MEM_NODE_HEAP_INIT_CAPACITY - 1);
 
         // initialize top node of gap index
         new_pool_mgr->gap_ix->node = new_pool_mgr->node_heap;
@@ -285,663 +754,3750 @@ pool_pt mem_pool_open(size_t size, alloc_policy policy)
         new_pool_mgr->pool.num_allocs = 0;
         new_pool_mgr->pool.num_gaps = 1;
         new_pool_mgr->used_nodes = 1;
+        _mem_track_gap(new_pool_mgr, size, +1);
 
-        // link pool mgr to pool store
-        pool_store[pool_store_size] = new_pool_mgr;
+        new_pool_mgr->id = next_pool_id++;
 
-        pool_store_size = 1;                                                    // set pool store size equal to 1
+        // link pool mgr to pool store
+        _mem_pool_store_add(new_pool_mgr);
 
         return (pool_pt) new_pool_mgr;                                          // return the address of the mgr, cast to (pool_pt)
     }
 }
 
 
-/*================================================ alloc_status mem_pool_close function ================================================*/
-alloc_status mem_pool_close(pool_pt pool)
+/*================================================= pool_pt mem_pool_open_in function ==================================================*/
+pool_pt mem_pool_open_in(void *buf, size_t size, alloc_policy policy)
 {
-    //--------------------------------------------------------------
-    // Instructor comments
-    //--------------------------------------------------------------
-    // get mgr from pool by casting the pointer to (pool_mgr_pt)
-    // check if this pool is allocated
-    // check if pool has only one gap
-    // check if it has zero allocations
-    // free memory pool
-    // free node heap
-    // free gap index
-    // find mgr in pool store and set to null
-    // note: don't decrement pool_store_size, because it only grows
-    // free mgr
-    //--------------------------------------------------------------
+    //----------------------------------------------------------------------
+    // like mem_pool_open, but the pool memory is the caller's: size bytes
+    // at buf (static, stack, mmap()ed, registered for DMA, ...) are handed
+    // out as they are, no malloc() is made for them and close leaves them
+    // to the caller; the manager and the rest of the metadata still come
+    // from the C heap
+    //----------------------------------------------------------------------
 
-    const pool_mgr_pt new_pool_mgr = (pool_mgr_pt) pool;                                // get mgr from pool by casting the pointer to (pool_mgr_pt)
-    if (new_pool_mgr != NULL)                                                           // if this pool is allocated, go on
+    if (buf == NULL || size == 0)
     {
-        if (pool->num_gaps != 1)                                                        // check if the pool has only one gap
-        {
-            return ALLOC_NOT_FREED;                                                     // if it doesn't, handle it appropriately
-        }
+        return NULL;
+    }
 
-        if (pool->num_allocs != 0)                                                      // check if the pool has zero allocations
-        {
-            return ALLOC_NOT_FREED;                                                     // if it doesn't, handle it appropriately
-        }
+    METRICS_START(start);
+    pool_mgr_pt new_pool_mgr = (pool_mgr_pt) _mem_pool_open(size, policy, POOL_DEFAULT, buf, NULL);
+    if (new_pool_mgr == NULL)
+    {
+#ifdef MEM_POOL_METRICS
+        closed_pool_metrics.open_calls += 1;
+        closed_pool_metrics.open_failures += 1;
+#endif
+        return NULL;
+    }
 
-        free(new_pool_mgr->pool.mem);                                                   // free memory pool
-        free(new_pool_mgr->node_heap);                                                  // free node heap
-        free(new_pool_mgr->gap_ix);                                                     // free gap index
+    new_pool_mgr->backing = MEM_BACKING_USER;
+    MEM_MARK_GAPS(new_pool_mgr);
 
-        // now, find mgr in pool store and set to null
-        int i;
-        for (i = 0; i < pool_store_size; i++)
-        {
-            if(pool_store[i] == new_pool_mgr)
-            {
-                pool_store[i] = NULL;                                                   // instance found -> set it equal to null
-                i = pool_store_size;                                                    // we're done, set i to pool_store_size (so we don't loop further)
-            }
-        }
-        free(new_pool_mgr);                                                             // final step: free mgr
+    METRICS_COUNT(new_pool_mgr, open_calls, 1);
+    METRICS_RECORD(new_pool_mgr, open_latency, start);
+    TRACE(MEM_TRACE_OPEN, new_pool_mgr, size, 0);
 
-        return ALLOC_OK;                                                                // all done with no errors, return ALLOC_OK
-    }
-    else if (new_pool_mgr == NULL)                                                      // if this pool is not allocated, return ALLOC_NOT_FREED
-    {
-        return ALLOC_NOT_FREED;
-    }
+    return (pool_pt) new_pool_mgr;
 }
 
 
-/*================================================== alloc_pt mem_new_alloc function ===================================================*/
-alloc_pt mem_new_alloc(pool_pt pool, size_t size)
+/*================================================ pool_pt mem_pool_open_file function =================================================*/
+pool_pt mem_pool_open_file(const char *path, size_t size, alloc_policy policy)
 {
-    //--------------------------------------------------------------------
-    // Instructor comments
-    //--------------------------------------------------------------------
-    // get mgr from pool by casting the pointer to (pool_mgr_pt)
-    // check if any gaps, return null if none
-    // expand heap node, if necessary, quit on error
-    // check used nodes fewer than total nodes, quit on error
-    // get a node for allocation:
-    // if FIRST_FIT, then find the first sufficient node in the node heap
-    // if BEST_FIT, then find the first sufficient node in the gap index
-    // check if node found
-    // update metadata (num_allocs, alloc_size)
-    // calculate the size of the remaining gap, if any
-    // remove node from gap index
-    // convert gap_node to an allocation node of given size
-    // adjust node heap:
-    //   if remaining gap, need a new node
-    //   find an unused one in the node heap
-    //   make sure one was found
-    //   initialize it to a gap node
-    //   update metadata (used_nodes)
-    //   update linked list (new node right after the node for allocation)
-    //   add to gap index
-    //   check if successful
-    // return allocation record by casting the node to (alloc_pt)
-    //--------------------------------------------------------------------
-
-    // get mgr from pool by casting the pointer to (pool_mgr_pt)
-    pool_mgr_pt new_pool_mgr = (pool_mgr_pt) pool;
+    //----------------------------------------------------------------------
+    // the pool memory is a MAP_SHARED mapping of path, after a header page;
+    // a new (empty) file is sized to hold size bytes, an existing one must
+    // have been closed with mem_pool_close and is reopened with the same
+    // allocations in the same places (size 0 - take the size from the file);
+    // the node list is rebuilt from the segment stream stored on close, the
+    // data itself is never copied
+    //----------------------------------------------------------------------
 
-    // check if any gaps, return null if none
-    if (new_pool_mgr->gap_ix == NULL)
+    if (path == NULL)
     {
         return NULL;
     }
 
-    // expand heap node, if necessary, quit on error
-    if (new_pool_mgr->used_nodes / new_pool_mgr->total_nodes > MEM_NODE_HEAP_FILL_FACTOR)
-    {
-        if (_mem_resize_node_heap(new_pool_mgr) != ALLOC_OK)
-        {
-            return NULL;
-        }
-    }
-
-    // check used nodes fewer than total nodes, quit on error
-    if (new_pool_mgr->total_nodes < new_pool_mgr->used_nodes)
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
     {
         return NULL;
     }
 
-    // get a node for allocation:
-    node_pt new_node;
-    int i = 0;
+    struct stat st;
+    mem_file_header_t stored;
+    uint8_t *stream = NULL;
+    int existing = (fstat(fd, &st) == 0 && st.st_size > 0);
 
-    // if FIRST_FIT, then find the first sufficient node in the node heap
-    if(new_pool_mgr->pool.policy == FIRST_FIT)
+    if (existing)
     {
-        node_pt heap = new_pool_mgr->node_heap;
-
-        while(new_pool_mgr->node_heap[i].alloc_record.size < size || (new_pool_mgr->node_heap[i].allocated != 0 && new_pool_mgr->node_heap[i].used !=0))
+        if (pread(fd, &stored, sizeof(stored), 0) != (ssize_t) sizeof(stored)
+            || stored.magic != MEM_FILE_MAGIC || stored.version != MEM_FILE_VERSION
+            || stored.state != MEM_FILE_CLEAN                                   // not closed cleanly: the stored layout is stale
+            || (size != 0 && size != stored.total_size)
+            || (off_t) (MEM_FILE_HEADER_SIZE + stored.total_size + stored.stream_size) > st.st_size)
         {
-            if(&new_pool_mgr->node_heap[i] == new_pool_mgr->gap_ix[0].node && new_pool_mgr->node_heap[i].alloc_record.size < size)
-            {
-                return NULL;
-            }
-
-            i += 1;
+            close(fd);
+            return NULL;
         }
+        size = stored.total_size;
 
-        if(heap == NULL)
+        stream = malloc(stored.stream_size > 0 ? stored.stream_size : 1);
+        if (stream == NULL
+            || pread(fd, stream, stored.stream_size, (off_t) (MEM_FILE_HEADER_SIZE + size)) != (ssize_t) stored.stream_size)
         {
+            free(stream);
+            close(fd);
             return NULL;
         }
-
-        new_node = &new_pool_mgr->node_heap[i];
     }
-
-        // if BEST_FIT, then find the first sufficient node in the gap index
-    else if(new_pool_mgr->pool.policy == BEST_FIT)
+    else if (size == 0 || ftruncate(fd, (off_t) (MEM_FILE_HEADER_SIZE + size)) != 0)
     {
-        if (new_pool_mgr->pool.num_gaps > 0) {
-            while (i < new_pool_mgr->pool.num_gaps && new_pool_mgr->gap_ix[i+1].size >= size)
-            {
-                i += 1;
-            }
-        }
-
-        else
-        {
-            return NULL;
-        }
-        new_node = new_pool_mgr->gap_ix[i].node;
+        close(fd);
+        return NULL;
     }
 
-    // check if node found
-    // if it's not found, handle appropriately
-    if(new_node == NULL)
+    size_t map_size = MEM_FILE_HEADER_SIZE + size;
+    char *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
     {
+        free(stream);
+        close(fd);
         return NULL;
     }
 
-    // if it was found
-    // update metadata (num_allocs, alloc_size)
-    new_pool_mgr->pool.alloc_size += size;
-    new_pool_mgr->pool.num_allocs += 1;
-
-    // calculate the size of the remaining gap, if any
-    size_t remainder = 0;
-    if (new_node->alloc_record.size - size > 0)
+    pool_mgr_pt new_pool_mgr = (pool_mgr_pt) _mem_pool_open(size, policy, POOL_DEFAULT, map + MEM_FILE_HEADER_SIZE, NULL);
+    if (new_pool_mgr == NULL)
     {
-        remainder = new_node->alloc_record.size - size;
+        free(stream);
+        munmap(map, map_size);
+        close(fd);
+        return NULL;
     }
 
-    // remove node from gap index
-    _mem_remove_from_gap_ix(new_pool_mgr, size, new_node);
-
-    // convert gap_node to an allocation node of given size
-    new_node->allocated = 1;
-    new_node->used = 1;
-    new_node->alloc_record.size = size;
+    new_pool_mgr->backing = MEM_BACKING_FILE;
+    new_pool_mgr->map = map;
+    new_pool_mgr->map_size = map_size;
+    new_pool_mgr->fd = fd;
 
-    // adjust node heap
-    if (remainder != 0)
+    if (existing && _mem_restore_segments(new_pool_mgr, stream, stored.stream_size) != ALLOC_OK)
     {
-        // if remaining gap, need a new node
-        // find an unused one in the node heap
-        int i = 0;
-        while (new_pool_mgr->node_heap[i].used != 0)
-        {
-            i += 1;
-        }
-        node_pt new_gap = &new_pool_mgr->node_heap[i];
+        free(stream);
+        _mem_pool_destroy(new_pool_mgr);
+        return NULL;
+    }
+    free(stream);
+    MEM_MARK_GAPS(new_pool_mgr);                                                // the allocations keep their (defined) contents
+
+    // mark the file dirty until the next clean close
+    mem_file_header_t *header = (mem_file_header_t *) map;
+    header->magic = MEM_FILE_MAGIC;
+    header->version = MEM_FILE_VERSION;
+    header->policy = policy;
+    header->total_size = size;
+    header->state = MEM_FILE_DIRTY;
+    if (msync(map, MEM_FILE_HEADER_SIZE, MS_SYNC) != 0)
+    {
+        _mem_pool_destroy(new_pool_mgr);
+        return NULL;
+    }
 
-        // initialize it to a gap node
-        new_gap->used = 1;
-        new_gap->allocated = 0;
-        new_gap->alloc_record.size = remainder;
+    METRICS_COUNT(new_pool_mgr, open_calls, 1);
+    TRACE(MEM_TRACE_OPEN, new_pool_mgr, size, 0);
 
-        // update metadata (used_nodes)
-        new_pool_mgr->used_nodes += 1;
+    return (pool_pt) new_pool_mgr;
+}
 
-        // update linked list (new node right after the node for allocation)
-        new_node->alloc_record.size = size;
 
-        if(new_node->next)
-        {
-            new_node->next->prev = new_gap;
-        }
+/*=============================================== pool_pt mem_pool_open_shared function ===============================================*/
+pool_pt mem_pool_open_shared(const char *name, size_t size, alloc_policy policy)
+{
+    //----------------------------------------------------------------------
+    // the first process to open name creates a POSIX shared memory segment
+    // holding the pool memory and all its metadata, the others attach to
+    // it (size 0 - whatever size it was created with); the segment is
+    // mapped at the same address everywhere, so alloc_pt handles and
+    // alloc->mem are valid in every process, and offsets from pool->mem
+    // are the natural thing to hand over; the pool is POOL_THREAD_SAFE
+    // with a process-shared lock, and goes away with its last close
+    //
+    // the lock is robust: if a process dies holding it, the next process
+    // to lock the pool takes it over (and says so on stderr); the count of
+    // attached processes is not recovered, though, so a process that dies
+    // without closing keeps the segment (and its name) around until it is
+    // removed with shm_unlink
+    //----------------------------------------------------------------------
 
-        new_gap->next = new_node->next;
-        new_node->next = new_gap;
-        new_gap->prev = new_node;
+    if (name == NULL || strlen(name) >= MEM_SHARED_NAME_MAX)
+    {
+        return NULL;
+    }
 
-        //add to gap index
-        _mem_add_to_gap_ix(new_pool_mgr, remainder, new_gap);
+    if ((pool_store == NULL && mem_init() == ALLOC_FAIL) || _mem_resize_pool_store() != ALLOC_OK)
+    {
+        return NULL;
     }
 
-    // return allocation record by casting the node to (alloc_pt)
-    return (alloc_pt) new_node;
-}
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0)
+    {
+        return _mem_shared_create(fd, name, size, policy);
+    }
+    if (errno != EEXIST)
+    {
+        return NULL;
+    }
 
+    return _mem_shared_attach(shm_open(name, O_RDWR, 0), size);
+}
 
 
-/*================================================ alloc_status mem_del_alloc function =================================================*/
-alloc_status mem_del_alloc(pool_pt pool, alloc_pt alloc)
+/*================================================ pool_pt mem_pool_open_numa function =================================================*/
+pool_pt mem_pool_open_numa(size_t size, alloc_policy policy, unsigned flags, int node)
 {
     //----------------------------------------------------------------------
-    // Instructor comments
+    // like mem_pool_open_ex, but the pool memory and its manager, node heap
+    // and gap index come from one mapping whose pages are placed on node
+    // (preferred, not strict: a full node spills over rather than failing),
+    // whichever thread touches them first; on a machine or kernel without
+    // NUMA support only node 0 exists and nothing is bound
     //----------------------------------------------------------------------
-    // get mgr from pool by casting the pointer to (pool_mgr_pt)
-    // get node from alloc by casting the pointer to (node_pt)
-    // find the node in the node heap
-    // this is node-to-delete
-    // make sure it's found
-    // convert to gap node
-    // update metadata (num_allocs, alloc_size)
-    // if the next node in the list is also a gap, merge into node-to-delete
-    //   remove the next node from gap index
-    //   check success
-    //   add the size to the node-to-delete
+
+    if (node < 0 || node >= _mem_numa_num_nodes() || size == 0)
+    {
+        return NULL;
+    }
+
+    // the arena cannot grow, so it is sized for the most fragmented pool;
+    // the pages of it that are never used are never backed
+    size_t mem_size = (size + MEM_NUMA_PAGE_SIZE - 1) / MEM_NUMA_PAGE_SIZE * MEM_NUMA_PAGE_SIZE;
+    size_t arena_size = _mem_arena_size(size, flags, 1);
+    size_t map_size = mem_size + arena_size;
+
+    char *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED)
+    {
+        return NULL;
+    }
+    _mem_numa_bind(map, map_size, node);
+
+    // the arena's own bookkeeping sits at its start
+    mem_arena_pt arena = (mem_arena_pt) (map + mem_size);
+    arena->base = map + mem_size;
+    arena->size = arena_size;
+    arena->used = sizeof(mem_arena_t);
+    arena->top = arena_size;
+    arena->spill = 0;                                                           // metadata must stay on the node
+
+    METRICS_START(start);
+    pool_mgr_pt new_pool_mgr = (pool_mgr_pt) _mem_pool_open(size, policy, flags, map, arena);
+    if (new_pool_mgr == NULL)
+    {
+        munmap(map, map_size);
+        return NULL;
+    }
+
+    new_pool_mgr->backing = MEM_BACKING_NUMA;
+    new_pool_mgr->map = map;
+    new_pool_mgr->map_size = map_size;
+    MEM_MARK_GAPS(new_pool_mgr);
+
+    METRICS_COUNT(new_pool_mgr, open_calls, 1);
+    METRICS_RECORD(new_pool_mgr, open_latency, start);
+    TRACE(MEM_TRACE_OPEN, new_pool_mgr, size, 0);
+
+    return (pool_pt) new_pool_mgr;
+}
+
+
+/*============================================== alloc_status mem_pool_set_open_numa function ==============================================*/
+alloc_status mem_pool_set_open_numa(pool_set_pt set, size_t size_per_node, alloc_policy policy, unsigned flags)
+{
+    //----------------------------------------------------------------------
+    // one pool per NUMA node, each POOL_THREAD_SAFE since every thread on
+    // a node shares that node's pool
+    //----------------------------------------------------------------------
+
+    if (set == NULL)
+    {
+        return ALLOC_FAIL;
+    }
+
+    int num_nodes = _mem_numa_num_nodes();
+    if (num_nodes > POOL_SET_MAX_POOLS)
+    {
+        num_nodes = POOL_SET_MAX_POOLS;
+    }
+
+    memset(set, 0, sizeof(*set));
+    int node;
+    for (node = 0; node < num_nodes; node++)
+    {
+        set->pools[node] = mem_pool_open_numa(size_per_node, policy, flags | POOL_THREAD_SAFE, node);
+        if (set->pools[node] == NULL)
+        {
+            mem_pool_set_close(set);
+            return ALLOC_FAIL;
+        }
+        set->num_pools += 1;
+    }
+
+    return ALLOC_OK;
+}
+
+
+/*================================================= alloc_pt mem_pool_set_alloc function ==================================================*/
+alloc_pt mem_pool_set_alloc(pool_set_pt set, size_t size)
+{
+    //----------------------------------------------------------------------
+    // from the calling thread's node, or the next node that has room
+    //----------------------------------------------------------------------
+
+    if (set == NULL || set->num_pools == 0)
+    {
+        return NULL;
+    }
+
+    unsigned local = (unsigned) _mem_numa_current_node() % set->num_pools;
+    unsigned i;
+    for (i = 0; i < set->num_pools; i++)
+    {
+        alloc_pt alloc = mem_new_alloc(set->pools[(local + i) % set->num_pools], size);
+        if (alloc != NULL)
+        {
+            return alloc;
+        }
+    }
+
+    return NULL;
+}
+
+
+/*=============================================== alloc_status mem_pool_set_del_alloc function ==============================================*/
+alloc_status mem_pool_set_del_alloc(pool_set_pt set, alloc_pt alloc)
+{
+    if (set == NULL || alloc == NULL)
+    {
+        return ALLOC_FAIL;
+    }
+
+    // whichever pool's memory it is in
+    unsigned i;
+    for (i = 0; i < set->num_pools; i++)
+    {
+        pool_pt pool = set->pools[i];
+        if (alloc->mem >= pool->mem && alloc->mem < pool->mem + pool->total_size)
+        {
+            return mem_del_alloc(pool, alloc);
+        }
+    }
+
+    return ALLOC_FAIL;
+}
+
+
+/*================================================ alloc_status mem_pool_set_close function ================================================*/
+alloc_status mem_pool_set_close(pool_set_pt set)
+{
+    if (set == NULL)
+    {
+        return ALLOC_FAIL;
+    }
+
+    alloc_status status = ALLOC_OK;
+    unsigned i;
+    for (i = 0; i < set->num_pools; i++)
+    {
+        if (set->pools[i] != NULL && mem_pool_close(set->pools[i]) == ALLOC_OK)
+        {
+            set->pools[i] = NULL;
+        }
+        else if (set->pools[i] != NULL)
+        {
+            status = ALLOC_NOT_FREED;                                           // left open, like mem_pool_close
+        }
+    }
+
+    return status;
+}
+
+
+/*=================================================== alloc_pt mem_find_alloc function ===================================================*/
+alloc_pt mem_find_alloc(pool_pt pool, const char *mem)
+{
+    //----------------------------------------------------------------------
+    // the allocation that starts at mem, or NULL; alloc_pt handles do not
+    // survive a reopen of a file pool, so this is how they are found again
+    //----------------------------------------------------------------------
+
+    pool_mgr_pt new_pool_mgr = (pool_mgr_pt) pool;
+    if (new_pool_mgr == NULL || mem == NULL)
+    {
+        return NULL;
+    }
+
+    _mem_lock(new_pool_mgr);
+
+    node_pt current_node = new_pool_mgr->list_head;
+    while (current_node != NULL && (current_node->alloc_record.mem != mem || !current_node->allocated))
+    {
+        current_node = current_node->next;
+    }
+
+    _mem_unlock(new_pool_mgr);
+
+    return (alloc_pt) current_node;
+}
+
+
+/*================================================ alloc_status mem_pool_close function ================================================*/
+alloc_status mem_pool_close(pool_pt pool)
+{
+#ifdef MEM_POOL_METRICS
+    // the manager is gone after a successful close, so work on a copy
+    pool_metrics_t metrics;
+    if (pool != NULL)
+    {
+        metrics = ((pool_mgr_pt) pool)->metrics;
+    }
+#endif
+
+    unsigned pool_id = (pool != NULL) ? ((pool_mgr_pt) pool)->id : 0;
+    alloc_policy policy = (pool != NULL) ? pool->policy : FIRST_FIT;
+
+    METRICS_START(start);
+    alloc_status status = _mem_pool_close(pool);
+
+    if (atomic_load(&trace_file) != NULL && status == ALLOC_OK)
+    {
+        _mem_trace(MEM_TRACE_CLOSE, pool_id, policy, 0, 0);
+    }
+
+    if (leak_report_fd >= 0 && status == ALLOC_NOT_FREED && pool != NULL)
+    {
+        mem_pool_leak_report(pool, leak_report_fd);
+    }
+
+#ifdef MEM_POOL_METRICS
+    if (pool != NULL)
+    {
+        if (status == ALLOC_OK)
+        {
+            metrics.close_calls += 1;
+            _mem_hist_record(&metrics.close_latency, _mem_now_ns() - start);
+            _mem_metrics_add(&closed_pool_metrics, &metrics);
+        }
+        else
+        {
+            METRICS_COUNT((pool_mgr_pt) pool, close_calls, 1);
+            METRICS_COUNT((pool_mgr_pt) pool, close_failures, 1);
+        }
+    }
+#endif
+
+    return status;
+}
+
+
+// body of mem_pool_close
+static alloc_status _mem_pool_close(pool_pt pool)
+{
+    //--------------------------------------------------------------
+    // Instructor comments
+    //--------------------------------------------------------------
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    // check if this pool is allocated
+    // check if pool has only one gap
+    // check if it has zero allocations
+    // free memory pool
+    // free node heap
+    // free gap index
+    // find mgr in pool store and set to null
+    // note: don't decrement pool_store_size, the slot goes on the free-slot stack
+    // free mgr
+    //--------------------------------------------------------------
+
+    const pool_mgr_pt new_pool_mgr = (pool_mgr_pt) pool;                                // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    if (new_pool_mgr != NULL)                                                           // if this pool is allocated, go on
+    {
+        if (new_pool_mgr->backing == MEM_BACKING_SHARED)                                // other processes may still be using it
+        {
+            return _mem_shared_close(new_pool_mgr);
+        }
+
+        if (new_pool_mgr->backing == MEM_BACKING_FILE)                                  // a file pool keeps its allocations across close
+        {
+            mem_pool_stop_compactor(pool);                                              // nothing may move while the layout is written
+            if (mem_pool_consolidate(pool) != ALLOC_OK || _mem_persist_file(new_pool_mgr) != ALLOC_OK)
+            {
+                return ALLOC_FAIL;                                                      // still open, the file is still marked dirty
+            }
+        }
+        else
+        {
+            if (pool->num_allocs != 0)                                                  // check if the pool has zero allocations
+            {
+                return ALLOC_NOT_FREED;                                                 // if it doesn't, handle it appropriately
+            }
+
+            alloc_status status = mem_pool_consolidate(pool);                           // merge any blocks still parked on quick lists
+            if (status != ALLOC_OK && status != ALLOC_CORRUPTED)                        // damage found in the quarantine has been reported
+            {
+                return ALLOC_NOT_FREED;
+            }
+
+            if (pool->num_gaps != 1)                                                    // check if the pool has only one gap
+            {
+                return ALLOC_NOT_FREED;                                                 // if it doesn't, handle it appropriately
+            }
+        }
+
+        _mem_pool_destroy(new_pool_mgr);
+
+        return ALLOC_OK;                                                                // all done with no errors, return ALLOC_OK
+    }
+    else if (new_pool_mgr == NULL)                                                      // if this pool is not allocated, return ALLOC_NOT_FREED
+    {
+        return ALLOC_NOT_FREED;
+    }
+}
+
+// frees everything a pool owns and takes it out of the pool store,
+// whatever is still allocated in it
+static void _mem_pool_destroy(pool_mgr_pt new_pool_mgr)
+{
+    mem_pool_stop_compactor((pool_pt) new_pool_mgr);                                // stop the background compactor, if any
+    pthread_mutex_destroy(&new_pool_mgr->lock);                                     // destroy the pool lock
+
+    // a plain heap pool may be kept for the next open of the same size, with its
+    // memory pool, first node chunk and gap index
+    int cache = (new_pool_mgr->backing == MEM_BACKING_HEAP && new_pool_mgr->arena == NULL
+                 && new_pool_mgr->pool.total_size <= MEM_POOL_CACHE_MAX_SIZE && pool_cache_size < MEM_POOL_CACHE_CAPACITY);
+
+    int i;
+    for (i = cache ? 1 : 0; i < new_pool_mgr->num_node_chunks; i++)                 // free node heap, chunk by chunk
+    {
+        _mem_meta_free(new_pool_mgr->arena, new_pool_mgr->node_chunks[i].nodes);
+    }
+    if (!cache)
+    {
+        _mem_meta_free(new_pool_mgr->arena, new_pool_mgr->gap_ix);                  // free gap index
+    }
+    _mem_meta_free(new_pool_mgr->arena, new_pool_mgr->quick_lists);                 // free quick lists (NULL in eager mode)
+    _mem_meta_free(new_pool_mgr->arena, new_pool_mgr->quarantine);                  // free the quarantine (NULL without guards)
+
+    // now, set mgr's slot in pool store to null, for the next open to reuse
+    _mem_pool_store_remove(new_pool_mgr);
+
+    if (cache)
+    {
+        _mem_pool_cache_put(new_pool_mgr);
+        return;
+    }
+
+    // free memory pool and mgr, in that order, as an arena-backed mgr lives in the memory pool's mapping
+    int mgr_on_heap = (new_pool_mgr->arena == NULL);
+    _mem_release_mem(new_pool_mgr);
+    if (mgr_on_heap)
+    {
+        free(new_pool_mgr);                                                         // final step: free mgr
+    }
+}
+
+
+// gives pool.mem back the way it was obtained
+static void _mem_release_mem(pool_mgr_pt pool_mgr)
+{
+    MEM_MARK(pool_mgr, pool_mgr->pool.mem, pool_mgr->pool.total_size, MEM_SHADOW_UNDEFINED);   // the gaps become usable again
+
+    switch (pool_mgr->backing)
+    {
+        case MEM_BACKING_HEAP:
+            free(pool_mgr->pool.mem);
+            break;
+        case MEM_BACKING_FILE:
+            munmap(pool_mgr->map, pool_mgr->map_size);
+            close(pool_mgr->fd);
+            break;
+        case MEM_BACKING_SHARED:
+            break;                                                              // the manager lives in the mapping, see _mem_shared_close
+        case MEM_BACKING_NUMA:
+            munmap(pool_mgr->map, pool_mgr->map_size);                          // the manager goes with it
+            break;
+        case MEM_BACKING_BLOCK:
+            free(pool_mgr->map);                                                // the manager goes with it
+            break;
+        case MEM_BACKING_USER:
+            break;                                                              // it goes back to the caller
+    }
+}
+
+
+// sets up a new shared segment on fd (just created by shm_open) and
+// opens the pool in it; other processes wait for header->ready
+static pool_pt _mem_shared_create(int fd, const char *name, size_t size, alloc_policy policy)
+{
+    // round the pool memory up to whole pages, so the arena starts aligned; the
+    // arena cannot grow, so it is sized for the most fragmented pool (the
+    // segment is sparse, pages of it that are never used cost nothing)
+    size_t mem_size = (size + MEM_SHARED_HEADER_SIZE - 1) / MEM_SHARED_HEADER_SIZE * MEM_SHARED_HEADER_SIZE;
+    size_t arena_size = _mem_arena_size(size, POOL_THREAD_SAFE, 1);
+    size_t map_size = MEM_SHARED_HEADER_SIZE + mem_size + arena_size;
+
+    char *map = MAP_FAILED;
+    if (size > 0 && ftruncate(fd, (off_t) map_size) == 0)
+    {
+        map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+
+    if (map == MAP_FAILED)
+    {
+        shm_unlink(name);
+        return NULL;
+    }
+
+    mem_shared_header_t *header = (mem_shared_header_t *) map;
+    header->magic = MEM_SHARED_MAGIC;
+    header->version = MEM_SHARED_VERSION;
+    header->base = map;
+    header->map_size = map_size;
+    header->arena.base = map + MEM_SHARED_HEADER_SIZE + mem_size;
+    header->arena.size = arena_size;
+    header->arena.used = 0;
+    header->arena.top = arena_size;
+    header->arena.spill = 0;                                                    // other processes cannot see the C heap
+    strcpy(header->name, name);
+
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) _mem_pool_open(size, policy, POOL_THREAD_SAFE,
+                                                        map + MEM_SHARED_HEADER_SIZE, &header->arena);
+    if (pool_mgr == NULL)
+    {
+        munmap(map, map_size);
+        shm_unlink(name);
+        return NULL;
+    }
+
+    pool_mgr->backing = MEM_BACKING_SHARED;
+    pool_mgr->map = map;
+    pool_mgr->map_size = map_size;
+
+    // the lock was set up for this process only, and must survive a process
+    // that dies holding it
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_destroy(&pool_mgr->lock);
+    pthread_mutex_init(&pool_mgr->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    header->pool_mgr = pool_mgr;
+    header->attached = 1;
+    atomic_store(&header->ready, 1);
+
+    METRICS_COUNT(pool_mgr, open_calls, 1);
+    TRACE(MEM_TRACE_OPEN, pool_mgr, size, 0);
+
+    return (pool_pt) pool_mgr;
+}
+
+
+// maps an existing shared segment at the address it was created at
+static pool_pt _mem_shared_attach(int fd, size_t size)
+{
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    // wait for the creator to size the segment and open the pool in it
+    mem_shared_header_t *header = MAP_FAILED;
+    struct stat st;
+    unsigned waited_ms = 0;
+    while (fstat(fd, &st) == 0 && waited_ms < MEM_SHARED_ATTACH_TIMEOUT_MS)
+    {
+        if (header == MAP_FAILED && (size_t) st.st_size >= MEM_SHARED_HEADER_SIZE)
+        {
+            header = mmap(NULL, MEM_SHARED_HEADER_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        if (header != MAP_FAILED && atomic_load(&header->ready))
+        {
+            break;
+        }
+
+        struct timespec delay = {0, 1000000};
+        nanosleep(&delay, NULL);
+        waited_ms += 1;
+    }
+
+    if (header == MAP_FAILED || !atomic_load(&header->ready)
+        || header->magic != MEM_SHARED_MAGIC || header->version != MEM_SHARED_VERSION)
+    {
+        if (header != MAP_FAILED) munmap(header, MEM_SHARED_HEADER_SIZE);
+        close(fd);
+        return NULL;
+    }
+
+    char *base = header->base;
+    size_t map_size = header->map_size;
+    munmap(header, MEM_SHARED_HEADER_SIZE);
+
+    // only a hint, so check it was taken (it is not, if this process
+    // already has something there, e.g. the same pool)
+    char *map = mmap(base, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return NULL;
+    }
+    if (map != base)
+    {
+        munmap(map, map_size);
+        return NULL;
+    }
+
+    header = (mem_shared_header_t *) map;
+    pool_mgr_pt pool_mgr = header->pool_mgr;
+
+    _mem_lock(pool_mgr);
+    int ok = atomic_load(&header->ready) && (size == 0 || size == pool_mgr->pool.total_size);
+    if (ok)
+    {
+        header->attached += 1;
+    }
+    _mem_unlock(pool_mgr);
+
+    if (!ok)                                                                                // the last process closed it meanwhile, or a size mismatch
+    {
+        munmap(map, map_size);
+        return NULL;
+    }
+
+    _mem_pool_store_add(pool_mgr);                                                          // made room for in mem_pool_open_shared
+
+    METRICS_COUNT(pool_mgr, open_calls, 1);
+    TRACE(MEM_TRACE_OPEN, pool_mgr, pool_mgr->pool.total_size, 0);
+
+    return (pool_pt) pool_mgr;
+}
+
+
+// detaches this process; the last process to close also removes the
+// name, and like any pool it must not hold allocations by then
+static alloc_status _mem_shared_close(pool_mgr_pt pool_mgr)
+{
+    mem_shared_header_t *header = (mem_shared_header_t *) pool_mgr->map;
+    char *map = pool_mgr->map;
+    size_t map_size = pool_mgr->map_size;
+
+    _mem_lock(pool_mgr);
+    if (header->attached == 1 && pool_mgr->pool.num_allocs != 0)
+    {
+        _mem_unlock(pool_mgr);
+        return ALLOC_NOT_FREED;
+    }
+
+    header->attached -= 1;
+    if (header->attached == 0)
+    {
+        atomic_store(&header->ready, 0);                                                    // late attachers back off
+        shm_unlink(header->name);
+    }
+    _mem_unlock(pool_mgr);                                                                  // not destroyed: a late attacher may still take it
+
+    _mem_pool_store_remove(pool_mgr);
+
+    munmap(map, map_size);                                                                  // the manager goes with the mapping
+
+    return ALLOC_OK;
+}
+
+
+// metadata allocation: the C heap, or a bump allocation in the arena
+static void *_mem_meta_calloc(mem_arena_pt arena, size_t count, size_t size)
+{
+    if (arena == NULL)
+    {
+        return calloc(count, size);
+    }
+
+    if (size != 0 && count > SIZE_MAX / size)
+    {
+        return NULL;
+    }
+
+    size_t bytes = count * size;
+    size_t start = _mem_arena_round(arena->used);
+    if (start > arena->top || bytes > arena->top - start)
+    {
+        return arena->spill ? calloc(count, size) : NULL;
+    }
+
+    arena->used = start + bytes;
+    memset(arena->base + start, 0, bytes);
+
+    return arena->base + start;
+}
+
+
+// like _mem_meta_calloc, but from the top of the arena down, for the one
+// block that keeps growing (the gap index): nothing is ever put below it,
+// so _mem_meta_realloc can always grow it in place
+static void *_mem_meta_calloc_top(mem_arena_pt arena, size_t count, size_t size)
+{
+    if (arena == NULL)
+    {
+        return calloc(count, size);
+    }
+
+    if (size != 0 && count > SIZE_MAX / size)
+    {
+        return NULL;
+    }
+
+    size_t bytes = count * size;
+    if (bytes > arena->top || ((arena->top - bytes) & ~(MEM_ARENA_ALIGNMENT - 1)) < arena->used)
+    {
+        return arena->spill ? calloc(count, size) : NULL;
+    }
+
+    arena->top = (arena->top - bytes) & ~(MEM_ARENA_ALIGNMENT - 1);
+    memset(arena->base + arena->top, 0, bytes);
+
+    return arena->base + arena->top;
+}
+
+
+// the last block in the arena grows in place, and so does the top one
+// (moving down over the free middle); any other is copied
+static void *_mem_meta_realloc(mem_arena_pt arena, void *ptr, size_t old_size, size_t new_size)
+{
+    if (arena == NULL || (ptr != NULL && ((char *) ptr < arena->base || (char *) ptr >= arena->base + arena->size)))
+    {
+        return realloc(ptr, new_size);                                                  // not in the arena: spilled over
+    }
+
+    if (ptr != NULL && (char *) ptr + old_size == arena->base + arena->used
+        && new_size >= old_size && new_size - old_size <= arena->top - arena->used)
+    {
+        arena->used += new_size - old_size;
+        return ptr;
+    }
+
+    if (ptr != NULL && (char *) ptr == arena->base + arena->top && new_size >= old_size)
+    {
+        size_t end = arena->top + old_size;
+        if (new_size <= end && ((end - new_size) & ~(MEM_ARENA_ALIGNMENT - 1)) >= arena->used)
+        {
+            arena->top = (end - new_size) & ~(MEM_ARENA_ALIGNMENT - 1);
+            memmove(arena->base + arena->top, ptr, old_size);
+            return arena->base + arena->top;
+        }
+    }
+
+    int top = (ptr != NULL && (char *) ptr >= arena->base + arena->top);
+    void *new_ptr = top ? _mem_meta_calloc_top(arena, 1, new_size) : _mem_meta_calloc(arena, 1, new_size);
+    if (new_ptr != NULL && ptr != NULL)
+    {
+        memcpy(new_ptr, ptr, old_size);
+    }
+
+    return new_ptr;
+}
+
+
+static void _mem_meta_free(mem_arena_pt arena, void *ptr)
+{
+    if (arena == NULL || (char *) ptr < arena->base || (char *) ptr >= arena->base + arena->size)
+    {
+        free(ptr);                                                                      // not in the arena: spilled over
+    }
+}
+
+
+// rounds a size or offset up to MEM_ARENA_ALIGNMENT
+static size_t _mem_arena_round(size_t size)
+{
+    return (size + MEM_ARENA_ALIGNMENT - 1) & ~(MEM_ARENA_ALIGNMENT - 1);
+}
+
+
+// arena bytes for the metadata of a pool of size bytes opened with flags:
+// the initial metadata only, or, with worst_case, all the node heap chunks
+// and the largest gap index the most fragmented pool (every byte a segment
+// of its own) can need
+static size_t _mem_arena_size(size_t size, unsigned flags, int worst_case)
+{
+    size_t total_nodes = MEM_NODE_HEAP_INIT_CAPACITY;
+    size_t node_bytes = _mem_arena_round(total_nodes * sizeof(node_t));
+    size_t gap_ix_capacity = MEM_GAP_IX_INIT_CAPACITY;
+
+    if (worst_case)
+    {
+        // the same growth steps as _mem_resize_node_heap and _mem_resize_gap_ix
+        unsigned num_node_chunks = 1;
+        while ((double) (size + 1) / total_nodes > MEM_NODE_HEAP_FILL_FACTOR && num_node_chunks < MEM_NODE_HEAP_MAX_CHUNKS)
+        {
+            node_bytes += _mem_arena_round(total_nodes * (MEM_NODE_HEAP_EXPAND_FACTOR - 1) * sizeof(node_t));
+            total_nodes *= MEM_NODE_HEAP_EXPAND_FACTOR;
+            num_node_chunks += 1;
+        }
+        while ((double) (size + 1) / gap_ix_capacity > MEM_GAP_IX_FILL_FACTOR)
+        {
+            gap_ix_capacity *= MEM_GAP_IX_EXPAND_FACTOR;
+        }
+    }
+
+    size_t arena_size = _mem_arena_round(sizeof(mem_arena_t))
+                        + _mem_arena_round(sizeof(pool_mgr_t))
+                        + node_bytes
+                        + _mem_arena_round(gap_ix_capacity * sizeof(gap_t));
+    if (flags & POOL_DEFERRED_COALESCING)
+    {
+        arena_size += _mem_arena_round(MEM_QUICK_LIST_CAPACITY * sizeof(quick_list_t));
+    }
+    if (flags & POOL_DEBUG_GUARDS)
+    {
+        arena_size += _mem_arena_round(MEM_GUARD_QUARANTINE_CAPACITY * sizeof(node_pt));
+    }
+
+    return arena_size;
+}
+
+
+// opens a POOL_SINGLE_BLOCK pool: one malloc() holds an arena just big
+// enough for the manager and its initial metadata, then the pool memory;
+// metadata that outgrows the arena spills over to the C heap
+static pool_pt _mem_pool_open_block(size_t size, alloc_policy policy, unsigned flags)
+{
+    size_t arena_size = _mem_arena_size(size, flags, 0);
+
+    if (size > SIZE_MAX - arena_size)
+    {
+        return NULL;
+    }
+
+    char *block = malloc(arena_size + size);
+    if (block == NULL)
+    {
+        return NULL;
+    }
+
+    // the arena's own bookkeeping sits at its start, the pool memory right after it
+    mem_arena_pt arena = (mem_arena_pt) block;
+    arena->base = block;
+    arena->size = arena_size;
+    arena->used = sizeof(mem_arena_t);
+    arena->top = arena_size;
+    arena->spill = 1;
+
+    pool_mgr_pt new_pool_mgr = (pool_mgr_pt) _mem_pool_open(size, policy, flags, block + arena_size, arena);
+    if (new_pool_mgr == NULL)
+    {
+        free(block);
+        return NULL;
+    }
+
+    new_pool_mgr->backing = MEM_BACKING_BLOCK;
+    new_pool_mgr->map = block;
+    new_pool_mgr->map_size = arena_size + size;
+
+    return (pool_pt) new_pool_mgr;
+}
+
+
+// number of NUMA nodes (highest online node + 1), 1 without NUMA support
+static int _mem_numa_num_nodes()
+{
+    static atomic_int num_nodes = 0;
+
+    int n = atomic_load(&num_nodes);
+    if (n > 0)
+    {
+        return n;
+    }
+
+    // the file lists ranges, e.g. "0-1,3"; the last number is the highest node
+    n = 1;
+    FILE *file = fopen(MEM_NUMA_ONLINE_PATH, "r");
+    if (file != NULL)
+    {
+        int value = 0;
+        int c;
+        while ((c = fgetc(file)) != EOF)
+        {
+            if (c >= '0' && c <= '9')
+            {
+                value = value * 10 + (c - '0');
+            }
+            else
+            {
+                n = (value + 1 > n) ? value + 1 : n;
+                value = 0;
+            }
+        }
+        n = (value + 1 > n) ? value + 1 : n;
+        fclose(file);
+    }
+
+    atomic_store(&num_nodes, n);
+
+    return n;
+}
+
+
+// the calling thread's NUMA node; threads seldom migrate, so it is only
+// asked for every MEM_NUMA_NODE_REFRESH calls
+static int _mem_numa_current_node()
+{
+    static _Thread_local int node = 0;
+    static _Thread_local unsigned calls = 0;
+
+#ifdef __linux__
+    if (calls++ % MEM_NUMA_NODE_REFRESH == 0)
+    {
+        unsigned cpu, current;
+        if (syscall(SYS_getcpu, &cpu, &current, NULL) == 0)
+        {
+            node = (int) current;
+        }
+    }
+#endif
+
+    return node;
+}
+
+
+// prefers node for the pages of [addr, addr + len); best effort, since the
+// kernel may lack NUMA support or the sandbox may forbid mbind()
+static void _mem_numa_bind(char *addr, size_t len, int node)
+{
+#ifdef __linux__
+    unsigned long nodemask[4] = {0};
+    const unsigned long bits = 8 * sizeof(unsigned long);
+
+    if (_mem_numa_num_nodes() > 1 && (unsigned) node < 4 * bits)
+    {
+        nodemask[node / bits] = 1UL << (node % bits);
+        syscall(SYS_mbind, addr, len, MEM_MPOL_PREFERRED, nodemask, 4 * bits + 1, 0);
+    }
+#else
+    (void) addr;
+    (void) len;
+    (void) node;
+#endif
+}
+
+
+
+/*================================================== alloc_pt mem_new_alloc function ===================================================*/
+alloc_pt mem_new_alloc(pool_pt pool, size_t size)
+{
+    METRICS_START(start);
+
+    _mem_lock((pool_mgr_pt) pool);
+    alloc_pt alloc = _mem_new_alloc(pool, size);
+    if (alloc != NULL)
+    {
+        MEM_MARK((pool_mgr_pt) pool, alloc->mem, alloc->size, MEM_SHADOW_UNDEFINED);
+
+        if (((pool_mgr_pt) pool)->flags & POOL_LEAK_TRACKING)
+        {
+            ((node_pt) alloc)->alloc_ns = _mem_now_ns();
+            ((node_pt) alloc)->alloc_site = MEM_CALL_SITE();
+        }
+
+        if (profile_sample_bytes != 0 && ((pool_mgr_pt) pool)->backing != MEM_BACKING_SHARED)     // buckets are per process
+        {
+            _mem_profile_sample((node_pt) alloc, size, MEM_CALL_SITE());
+        }
+    }
+
+    TRACE(MEM_TRACE_ALLOC, (pool_mgr_pt) pool, size,
+          (alloc != NULL) ? (unsigned long long) (alloc->mem - pool->mem) : MEM_TRACE_NO_OFFSET);
+
+    METRICS_COUNT((pool_mgr_pt) pool, alloc_calls, 1);
+    METRICS_COUNT((pool_mgr_pt) pool, alloc_failures, alloc == NULL);
+    METRICS_RECORD((pool_mgr_pt) pool, alloc_latency, start);
+    _mem_unlock((pool_mgr_pt) pool);
+
+    return alloc;
+}
+
+
+// unlocked body of mem_new_alloc
+static alloc_pt _mem_new_alloc(pool_pt pool, size_t size)
+{
+    //--------------------------------------------------------------------
+    // Instructor comments
+    //--------------------------------------------------------------------
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    // check if any gaps, return null if none
+    // expand heap node, if necessary, quit on error
+    // check used nodes fewer than total nodes, quit on error
+    // get a node for allocation:
+    // if FIRST_FIT, then find the first sufficient node in the node heap
+    // if BEST_FIT, then find the first sufficient node in the gap index
+    // check if node found
+    // update metadata (num_allocs, alloc_size)
+    // calculate the size of the remaining gap, if any
+    // remove node from gap index
+    // convert gap_node to an allocation node of given size
+    // adjust node heap:
+    //   if remaining gap, need a new node
+    //   find an unused one in the node heap
+    //   make sure one was found
+    //   initialize it to a gap node
+    //   update metadata (used_nodes)
+    //   update linked list (new node right after the node for allocation)
+    //   add to gap index
+    //   check if successful
+    // return allocation record by casting the node to (alloc_pt)
+    //--------------------------------------------------------------------
+
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt new_pool_mgr = (pool_mgr_pt) pool;
+
+    // check if any gaps, return null if none
+    if (new_pool_mgr->pool.num_gaps == 0)
+    {
+        return NULL;
+    }
+
+    // in debug guard mode, carve out the redzones along with the allocation
+    size_t user_size = size;
+    if (new_pool_mgr->flags & POOL_DEBUG_GUARDS)
+    {
+        if (size > (size_t) -1 - 2 * MEM_GUARD_SIZE)
+        {
+            return NULL;
+        }
+        size += 2 * MEM_GUARD_SIZE;
+    }
+
+    // in deferred coalescing mode, serve an exact-size request straight from its quick list
+    if (new_pool_mgr->quick_lists != NULL)
+    {
+        node_pt quick_node = _mem_pop_quick_list(new_pool_mgr, size);
+        if (quick_node != NULL)
+        {
+            METRICS_COUNT(new_pool_mgr, alloc_quick_hits, 1);
+            quick_node->allocated = 1;
+            new_pool_mgr->pool.alloc_size += size;
+            new_pool_mgr->pool.num_allocs += 1;
+
+            return _mem_guard_wrap(new_pool_mgr, quick_node, user_size);
+        }
+    }
+
+    // expand heap node, if necessary, quit on error
+    if (_mem_resize_node_heap(new_pool_mgr) != ALLOC_OK)
+    {
+        return NULL;
+    }
+
+    // check there is an unused node for a remainder gap, quit on error
+    if (new_pool_mgr->free_nodes == NULL)
+    {
+        return NULL;
+    }
+
+    // get a node for allocation:
+    // if FIRST_FIT, then find the first sufficient node in the node heap
+    // if BEST_FIT, then find the first sufficient node in the gap index
+    node_pt new_node = _mem_find_gap(new_pool_mgr, size);
+
+    // nothing fits, but the quick lists (or the quarantine) may hold neighbours that merge into a big enough gap
+    if (new_node == NULL && new_pool_mgr->num_deferred > 0)
+    {
+        if (_mem_consolidate(pool) == ALLOC_FAIL)
+        {
+            return NULL;
+        }
+        new_node = _mem_find_gap(new_pool_mgr, size);
+    }
+
+    // check if node found
+    // if it's not found, handle appropriately
+    if(new_node == NULL)
+    {
+        return NULL;
+    }
+
+    // if it was found
+    // update metadata (num_allocs, alloc_size)
+    new_pool_mgr->pool.alloc_size += size;
+    new_pool_mgr->pool.num_allocs += 1;
+
+    // calculate the size of the remaining gap, if any
+    size_t remainder = 0;
+    if (new_node->alloc_record.size - size > 0)
+    {
+        remainder = new_node->alloc_record.size - size;
+    }
+
+    // remove node from gap index
+    _mem_remove_from_gap_ix(new_pool_mgr, size, new_node);
+
+    // convert gap_node to an allocation node of given size
+    new_node->allocated = 1;
+    new_node->used = 1;
+    new_node->alloc_record.size = size;
+
+    // adjust node heap
+    if (remainder != 0)
+    {
+        // if remaining gap, need a new node
+        // take an unused one off the free list
+        node_pt new_gap = new_pool_mgr->free_nodes;
+        new_pool_mgr->free_nodes = new_gap->next;
+
+        // initialize it to a gap node
+        new_gap->used = 1;
+        new_gap->allocated = 0;
+        new_gap->deferred = 0;
+        new_gap->quick_next = NULL;
+        new_gap->alloc_record.size = remainder;
+        new_gap->alloc_record.mem = new_node->alloc_record.mem + size;
+
+        // update metadata (used_nodes)
+        new_pool_mgr->used_nodes += 1;
+
+        // update linked list (new node right after the node for allocation)
+        new_node->alloc_record.size = size;
+
+        if(new_node->next)
+        {
+            new_node->next->prev = new_gap;
+        }
+
+        new_gap->next = new_node->next;
+        new_node->next = new_gap;
+        new_gap->prev = new_node;
+
+        //add to gap index
+        _mem_add_to_gap_ix(new_pool_mgr, remainder, new_gap);
+    }
+
+    // return allocation record by casting the node to (alloc_pt)
+    return _mem_guard_wrap(new_pool_mgr, new_node, user_size);
+}
+
+
+
+/*================================================ alloc_status mem_del_alloc function =================================================*/
+alloc_status mem_del_alloc(pool_pt pool, alloc_pt alloc)
+{
+    METRICS_START(start);
+
+    _mem_lock((pool_mgr_pt) pool);
+    alloc_status status = _mem_del_alloc(pool, alloc);
+
+    METRICS_COUNT((pool_mgr_pt) pool, del_calls, 1);
+    METRICS_COUNT((pool_mgr_pt) pool, del_failures, status != ALLOC_OK);
+    METRICS_RECORD((pool_mgr_pt) pool, del_latency, start);
+    _mem_unlock((pool_mgr_pt) pool);
+
+    return status;
+}
+
+
+// unlocked body of mem_del_alloc
+static alloc_status _mem_del_alloc(pool_pt pool, alloc_pt alloc)
+{
+    //----------------------------------------------------------------------
+    // Instructor comments
+    //----------------------------------------------------------------------
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    // get node from alloc by casting the pointer to (node_pt)
+    // find the node in the node heap
+    // this is node-to-delete
+    // make sure it's found
+    // convert to gap node
+    // update metadata (num_allocs, alloc_size)
+    // if the next node in the list is also a gap, merge into node-to-delete
+    //   remove the next node from gap index
+    //   check success
+    //   add the size to the node-to-delete
     //   update node as unused
     //   update metadata (used nodes)
     //   update linked list:
     /*
-                    if (next->next) {
-                        next->next->prev = node_to_del;
-                        node_to_del->next = next->next;
-                    } else {
-                        node_to_del->next = NULL;
-                    }
-                    next->next = NULL;
-                    next->prev = NULL;
-     */
+                    if (next->next) {
+                        next->next->prev = node_to_del;
+                        node_to_del->next = next->next;
+                    } else {
+                        node_to_del->next = NULL;
+                    }
+                    next->next = NULL;
+                    next->prev = NULL;
+     */
+
+    // this merged node-to-delete might need to be added to the gap index
+    // but one more thing to check...
+    // if the previous node in the list is also a gap, merge into previous!
+    //   remove the previous node from gap index
+    //   check success
+    //   add the size of node-to-delete to the previous
+    //   update node-to-delete as unused
+    //   update metadata (used_nodes)
+    //   update linked list
+    /*
+                    if (node_to_del->next) {
+                        prev->next = node_to_del->next;
+                        node_to_del->next->prev = prev;
+                    } else {
+                        prev->next = NULL;
+                    }
+                    node_to_del->next = NULL;
+                    node_to_del->prev = NULL;
+     */
+    //   change the node to add to the previous node!
+    // add the resulting node to the gap index
+    // check success
+    //----------------------------------------------------------------------
+
+    pool_mgr_pt new_pool_mgr = (pool_mgr_pt) pool;                                     // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    node_pt node = (node_pt) alloc;                                                    // get node from alloc by casting the pointer to (node_pt)
+
+    node_pt to_delete = NULL;
+
+    // find the node in the node heap
+    to_delete = _mem_find_node(new_pool_mgr, node);
+
+    // this is node-to-delete
+    // make sure it's found
+    // if the node is not found (or is already a gap), handle it appropriately
+    if (to_delete == NULL || to_delete->allocated == 0)
+    {
+        return ALLOC_FAIL;
+    }
+
+    // if it was found
+    // update metadata (num_allocs, alloc_size)
+    TRACE(MEM_TRACE_FREE, new_pool_mgr, to_delete->alloc_record.size,
+          (unsigned long long) (to_delete->alloc_record.mem - new_pool_mgr->pool.mem));
+
+    if (to_delete->profile_bucket != NULL)
+    {
+        _mem_profile_release(to_delete);
+    }
+
+    to_delete->allocated = 0;
+    to_delete->pins = 0;
+    new_pool_mgr->pool.num_allocs -= 1;
+    new_pool_mgr->pool.alloc_size = new_pool_mgr->pool.alloc_size - _mem_segment_size(to_delete);
+    MEM_MARK(new_pool_mgr, to_delete->alloc_record.mem, to_delete->alloc_record.size, MEM_SHADOW_NOACCESS);
+
+    // in debug guard mode, check the redzones, poison the block and hold it back from reuse
+    if (to_delete->guard != 0)
+    {
+        return _mem_quarantine_push(new_pool_mgr, to_delete);
+    }
+
+    // in deferred coalescing mode, park the block on its quick list instead of merging it
+    if (new_pool_mgr->quick_lists != NULL && _mem_push_quick_list(new_pool_mgr, to_delete) == ALLOC_OK)
+    {
+        return ALLOC_OK;
+    }
+
+    // merge with neighbouring gaps and add the result to the gap index
+    return _mem_coalesce_gap(new_pool_mgr, to_delete);
+}
+
+
+/*=============================================== alloc_status mem_pool_consolidate function ===============================================*/
+alloc_status mem_pool_consolidate(pool_pt pool)
+{
+    if (pool == NULL)
+    {
+        return ALLOC_FAIL;
+    }
+
+    _mem_lock((pool_mgr_pt) pool);
+    alloc_status status = _mem_consolidate(pool);
+    _mem_unlock((pool_mgr_pt) pool);
+
+    return status;
+}
+
+
+// unlocked body of mem_pool_consolidate
+static alloc_status _mem_consolidate(pool_pt pool)
+{
+    //----------------------------------------------------------------------
+    // drain every quick list and coalesce its blocks the way an eager
+    // mem_del_alloc would have; blocks parked next to each other merge
+    // as the second one is drained, so order does not matter
+    //----------------------------------------------------------------------
+
+    pool_mgr_pt new_pool_mgr = (pool_mgr_pt) pool;                                     // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    if (new_pool_mgr == NULL)
+    {
+        return ALLOC_FAIL;
+    }
+
+    // empty the quarantine first, as its blocks may go to the quick lists
+    alloc_status status = ALLOC_OK;
+    while (new_pool_mgr->quarantine_count > 0)
+    {
+        alloc_status evict_status = _mem_quarantine_evict(new_pool_mgr);
+        if (evict_status == ALLOC_FAIL)
+        {
+            return ALLOC_FAIL;
+        }
+        if (evict_status == ALLOC_CORRUPTED)
+        {
+            status = ALLOC_CORRUPTED;
+        }
+    }
+
+    if (new_pool_mgr->quick_lists == NULL || new_pool_mgr->num_deferred == 0)         // eager pool, or nothing parked
+    {
+        return status;
+    }
+
+    int i;
+    for (i = 0; i < MEM_QUICK_LIST_CAPACITY; i++)
+    {
+        node_pt node = new_pool_mgr->quick_lists[i].head;
+
+        // release the slot, so that it can be claimed by a different size later
+        new_pool_mgr->quick_lists[i].head = NULL;
+        new_pool_mgr->quick_lists[i].size = 0;
+
+        while (node != NULL)
+        {
+            node_pt quick_next = node->quick_next;
+
+            // the block stops being a deferred gap; _mem_coalesce_gap counts it again
+            node->quick_next = NULL;
+            node->deferred = 0;
+            new_pool_mgr->num_deferred -= 1;
+            new_pool_mgr->pool.num_gaps -= 1;
+            _mem_track_gap(new_pool_mgr, node->alloc_record.size, -1);
+
+            if (_mem_coalesce_gap(new_pool_mgr, node) != ALLOC_OK)
+            {
+                return ALLOC_FAIL;
+            }
+
+            node = quick_next;
+        }
+    }
+
+    return status;
+}
+
+
+/*============================================== alloc_status mem_pool_check_guards function ==============================================*/
+alloc_status mem_pool_check_guards(pool_pt pool)
+{
+    //----------------------------------------------------------------------
+    // walk the whole pool: every allocation's redzones must still hold the
+    // canary and every free byte the poison; each damaged segment is
+    // reported on stderr; ALLOC_FAIL - not a POOL_DEBUG_GUARDS pool
+    //----------------------------------------------------------------------
+
+    pool_mgr_pt new_pool_mgr = (pool_mgr_pt) pool;                                     // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    if (new_pool_mgr == NULL || !(new_pool_mgr->flags & POOL_DEBUG_GUARDS))
+    {
+        return ALLOC_FAIL;
+    }
+
+    _mem_lock(new_pool_mgr);
+
+    alloc_status status = ALLOC_OK;
+    node_pt current_node;
+    for (current_node = new_pool_mgr->list_head; current_node != NULL; current_node = current_node->next)
+    {
+        alloc_status segment_status;
+        if (current_node->allocated)
+        {
+            segment_status = _mem_guard_check(new_pool_mgr, _mem_segment_mem(current_node), current_node->guard,
+                                              MEM_GUARD_CANARY, "redzone overwritten");
+            if (segment_status == ALLOC_OK)
+            {
+                segment_status = _mem_guard_check(new_pool_mgr, current_node->alloc_record.mem + current_node->alloc_record.size,
+                                                  current_node->guard, MEM_GUARD_CANARY, "redzone overwritten");
+            }
+        }
+        else
+        {
+            segment_status = _mem_guard_check(new_pool_mgr, current_node->alloc_record.mem, current_node->alloc_record.size,
+                                              MEM_GUARD_POISON, "free memory written");
+        }
+
+        if (segment_status != ALLOC_OK)
+        {
+            status = segment_status;
+        }
+    }
+
+    _mem_unlock(new_pool_mgr);
+
+    return status;
+}
+
+
+/*================================================= alloc_status mem_pool_compact function ================================================*/
+alloc_status mem_pool_compact(pool_pt pool, alloc_move_callback move_callback)
+{
+    //----------------------------------------------------------------------
+    // move_callback runs with the pool lock held, so it must not call
+    // mem_* on this pool
+    //----------------------------------------------------------------------
+
+    if (pool == NULL)
+    {
+        return ALLOC_FAIL;
+    }
+
+    _mem_lock((pool_mgr_pt) pool);
+    alloc_status status = _mem_compact(pool, move_callback);
+    _mem_unlock((pool_mgr_pt) pool);
+
+    return status;
+}
+
+
+// unlocked body of mem_pool_compact
+static alloc_status _mem_compact(pool_pt pool, alloc_move_callback move_callback)
+{
+    //----------------------------------------------------------------------
+    // slide every allocation down to the lowest free address, in address
+    // order, so all the free space ends up in one trailing gap
+    // allocation records are the user's handles, so the nodes stay put
+    // and only their alloc_record.mem changes; the owner is told about
+    // each move through move_callback (may be NULL)
+    // pinned allocations stay where they are, with a gap in front of them
+    //----------------------------------------------------------------------
+
+    pool_mgr_pt new_pool_mgr = (pool_mgr_pt) pool;                                     // get mgr from pool by casting the pointer to (pool_mgr_pt)
+
+    // blocks parked on quick lists (or in the quarantine) are gaps too
+    alloc_status status = _mem_consolidate(pool);
+    if (status == ALLOC_FAIL)
+    {
+        return ALLOC_FAIL;
+    }
+
+    // one unbounded pass from the head does the whole job
+    _mem_compact_step(new_pool_mgr, new_pool_mgr->list_head, UINT_MAX, move_callback);
+
+    return status;
+}
+
+
+/*============================================== alloc_status mem_pool_start_compactor function ==============================================*/
+alloc_status mem_pool_start_compactor(pool_pt pool, unsigned segments_per_step, unsigned step_interval_us,
+                                      alloc_move_callback move_callback)
+{
+    //----------------------------------------------------------------------
+    // the worker runs _mem_compact_step every step_interval_us, holding
+    // the pool lock for at most segments_per_step segments at a time
+    // the pool becomes POOL_THREAD_SAFE for good; call this (and stop)
+    // while no other thread is using the pool
+    // move_callback runs on the worker thread with the pool lock held, so
+    // it must not call mem_* on this pool
+    //----------------------------------------------------------------------
+
+    pool_mgr_pt new_pool_mgr = (pool_mgr_pt) pool;                                     // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    if (new_pool_mgr == NULL || new_pool_mgr->compactor != NULL || segments_per_step == 0
+        || new_pool_mgr->backing == MEM_BACKING_SHARED)                                // the worker thread would belong to one process only
+    {
+        return ALLOC_FAIL;
+    }
+
+    compactor_pt compactor = calloc(1, sizeof(compactor_t));
+    if (compactor == NULL)
+    {
+        return ALLOC_FAIL;
+    }
+
+    compactor->segments_per_step = segments_per_step;
+    compactor->step_interval_us = step_interval_us;
+    compactor->move_callback = move_callback;
+    compactor->cursor = NULL;
+    compactor->stop = 0;
+    pthread_cond_init(&compactor->wakeup, NULL);
+
+    new_pool_mgr->flags |= POOL_THREAD_SAFE;
+    new_pool_mgr->compactor = compactor;
+
+    if (pthread_create(&compactor->thread, NULL, _mem_compactor_main, new_pool_mgr) != 0)
+    {
+        new_pool_mgr->compactor = NULL;
+        pthread_cond_destroy(&compactor->wakeup);
+        free(compactor);
+
+        return ALLOC_FAIL;
+    }
+
+    return ALLOC_OK;
+}
+
+
+/*============================================== alloc_status mem_pool_stop_compactor function ===============================================*/
+alloc_status mem_pool_stop_compactor(pool_pt pool)
+{
+    pool_mgr_pt new_pool_mgr = (pool_mgr_pt) pool;                                     // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    if (new_pool_mgr == NULL || new_pool_mgr->compactor == NULL)
+    {
+        return ALLOC_FAIL;
+    }
+
+    compactor_pt compactor = new_pool_mgr->compactor;
+
+    // ask the worker to stop and wake it up if it is sleeping between steps
+    pthread_mutex_lock(&new_pool_mgr->lock);
+    compactor->stop = 1;
+    pthread_cond_signal(&compactor->wakeup);
+    pthread_mutex_unlock(&new_pool_mgr->lock);
+
+    pthread_join(compactor->thread, NULL);
+
+    new_pool_mgr->compactor = NULL;
+    pthread_cond_destroy(&compactor->wakeup);
+    free(compactor);
+
+    return ALLOC_OK;
+}
+
+
+/*=================================================== alloc_status mem_pin_alloc function ===================================================*/
+alloc_status mem_pin_alloc(pool_pt pool, alloc_pt alloc)
+{
+    node_pt node = (node_pt) alloc;                                                    // get node from alloc by casting the pointer to (node_pt)
+    if (pool == NULL || node == NULL)
+    {
+        return ALLOC_FAIL;
+    }
+
+    // checked under the lock, as a concurrent free may release the node
+    _mem_lock((pool_mgr_pt) pool);
+    alloc_status status = ALLOC_FAIL;
+    if (node->allocated)
+    {
+        node->pins += 1;
+        status = ALLOC_OK;
+    }
+    _mem_unlock((pool_mgr_pt) pool);
+
+    return status;
+}
+
+
+/*================================================== alloc_status mem_unpin_alloc function ==================================================*/
+alloc_status mem_unpin_alloc(pool_pt pool, alloc_pt alloc)
+{
+    node_pt node = (node_pt) alloc;                                                    // get node from alloc by casting the pointer to (node_pt)
+    if (pool == NULL || node == NULL)
+    {
+        return ALLOC_FAIL;
+    }
+
+    // checked under the lock, so two unpins of the last pin cannot both pass
+    _mem_lock((pool_mgr_pt) pool);
+    alloc_status status = ALLOC_FAIL;
+    if (node->allocated && node->pins > 0)
+    {
+        node->pins -= 1;
+        status = ALLOC_OK;
+    }
+    _mem_unlock((pool_mgr_pt) pool);
+
+    return status;
+}
+
+
+/*================================================== alloc_status mem_pool_stats function ==================================================*/
+alloc_status mem_pool_stats(pool_pt pool, pool_stats_pt stats)
+{
+    //----------------------------------------------------------------------
+    // the histogram is maintained as gaps come and go, and the gap index
+    // is sorted by size, so nothing here walks the segment list
+    //----------------------------------------------------------------------
+
+    pool_mgr_pt new_pool_mgr = (pool_mgr_pt) pool;                                     // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    if (new_pool_mgr == NULL || stats == NULL)
+    {
+        return ALLOC_FAIL;
+    }
+
+    _mem_lock(new_pool_mgr);
+
+    unsigned gap_ix_size = _mem_gap_ix_size(new_pool_mgr);
+
+    // the largest gap is at the end of the gap index, unless a parked block is larger
+    stats->largest_gap = (gap_ix_size > 0) ? new_pool_mgr->gap_ix[gap_ix_size - 1].size : 0;
+    if (new_pool_mgr->quick_lists != NULL)
+    {
+        int i;
+        for (i = 0; i < MEM_QUICK_LIST_CAPACITY; i++)
+        {
+            if (new_pool_mgr->quick_lists[i].head != NULL && new_pool_mgr->quick_lists[i].size > stats->largest_gap)
+            {
+                stats->largest_gap = new_pool_mgr->quick_lists[i].size;
+            }
+        }
+    }
+
+    stats->free_bytes = new_pool_mgr->pool.total_size - new_pool_mgr->pool.alloc_size;
+    stats->ext_fragmentation = (stats->free_bytes > 0)
+                               ? 1.0 - (double) stats->largest_gap / stats->free_bytes
+                               : 0.0;
+
+    memcpy(stats->gap_hist, new_pool_mgr->gap_hist, sizeof(stats->gap_hist));
+    memcpy(stats->gap_hist_bytes, new_pool_mgr->gap_hist_bytes, sizeof(stats->gap_hist_bytes));
+
+    stats->used_nodes = new_pool_mgr->used_nodes;
+    stats->total_nodes = new_pool_mgr->total_nodes;
+    stats->node_heap_occupancy = (double) new_pool_mgr->used_nodes / new_pool_mgr->total_nodes;
+
+    stats->gap_ix_size = gap_ix_size;
+    stats->gap_ix_capacity = new_pool_mgr->gap_ix_capacity;
+    stats->gap_ix_occupancy = (double) gap_ix_size / new_pool_mgr->gap_ix_capacity;
+
+    _mem_unlock(new_pool_mgr);
+
+    return ALLOC_OK;
+}
+
+
+/*================================================= alloc_status mem_pool_metrics function =================================================*/
+alloc_status mem_pool_metrics(pool_pt pool, pool_metrics_pt metrics)
+{
+    //----------------------------------------------------------------------
+    // a pool's own counters, or, for pool == NULL, the totals over all
+    // open pools, all closed pools and all failed opens
+    // fails if the library was built without MEM_POOL_METRICS
+    //----------------------------------------------------------------------
+
+#ifdef MEM_POOL_METRICS
+    if (metrics == NULL)
+    {
+        return ALLOC_FAIL;
+    }
+
+    if (pool != NULL)
+    {
+        _mem_lock((pool_mgr_pt) pool);
+        *metrics = ((pool_mgr_pt) pool)->metrics;
+        _mem_unlock((pool_mgr_pt) pool);
+
+        return ALLOC_OK;
+    }
+
+    *metrics = closed_pool_metrics;
+
+    int i;
+    for (i = 0; i < pool_store_capacity; i++)
+    {
+        if (pool_store[i] != NULL)
+        {
+            _mem_lock(pool_store[i]);
+            _mem_metrics_add(metrics, &pool_store[i]->metrics);
+            _mem_unlock(pool_store[i]);
+        }
+    }
+
+    return ALLOC_OK;
+#else
+    return ALLOC_FAIL;
+#endif
+}
+
+
+/*======================================== unsigned long long mem_latency_percentile function =========================================*/
+unsigned long long mem_latency_percentile(const latency_hist_t *hist, double percentile)
+{
+    //----------------------------------------------------------------------
+    // upper bound (in ns) of the bucket holding the given percentile,
+    // so accurate to one sub-bucket (1/8 of a power of two)
+    //----------------------------------------------------------------------
+
+    if (hist == NULL || hist->count == 0)
+    {
+        return 0;
+    }
+
+    unsigned long long rank = (unsigned long long) (percentile / 100.0 * hist->count + 0.5);
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+
+    unsigned long long seen = 0;
+    unsigned bucket;
+    for (bucket = 0; bucket < POOL_LATENCY_BUCKETS; bucket++)
+    {
+        seen += hist->buckets[bucket];
+        if (seen >= rank)
+        {
+            break;
+        }
+    }
+
+    if (bucket < POOL_LATENCY_SUB_BUCKETS)                                                   // the linear range
+    {
+        return bucket;
+    }
+    if (bucket >= POOL_LATENCY_BUCKETS - 1)                                                  // the overflow bucket
+    {
+        return hist->max_ns;
+    }
+
+    unsigned shift = (bucket - POOL_LATENCY_SUB_BUCKETS) / POOL_LATENCY_SUB_BUCKETS;
+    unsigned long long sub = (bucket - POOL_LATENCY_SUB_BUCKETS) % POOL_LATENCY_SUB_BUCKETS;
+    unsigned long long upper = ((POOL_LATENCY_SUB_BUCKETS + sub + 1) << shift) - 1;
+
+    return (upper < hist->max_ns) ? upper : hist->max_ns;
+}
+
+
+/*=================================================== alloc_status mem_trace_start function ===================================================*/
+alloc_status mem_trace_start(const char *path)
+{
+    //----------------------------------------------------------------------
+    // from here on, every open, allocation, deallocation, compaction move
+    // and close is appended to path as a mem_trace_record_t, after a
+    // mem_trace_header_t; only one trace can be recorded at a time
+    //----------------------------------------------------------------------
+
+    if (path == NULL)
+    {
+        return ALLOC_FAIL;
+    }
+
+    pthread_mutex_lock(&trace_lock);
+
+    if (atomic_load(&trace_file) != NULL)
+    {
+        pthread_mutex_unlock(&trace_lock);
+        return ALLOC_FAIL;
+    }
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        pthread_mutex_unlock(&trace_lock);
+        perror("mem_trace_start");
+        return ALLOC_FAIL;
+    }
+
+    mem_trace_header_t header = {MEM_TRACE_MAGIC, MEM_TRACE_VERSION, sizeof(mem_trace_record_t)};
+    if (fwrite(&header, sizeof(header), 1, file) != 1)
+    {
+        pthread_mutex_unlock(&trace_lock);
+        fclose(file);
+        return ALLOC_FAIL;
+    }
+
+    atomic_store(&trace_file, file);                                            // the header is out before any record
+
+    pthread_mutex_unlock(&trace_lock);
+
+    return ALLOC_OK;
+}
+
+
+/*=================================================== alloc_status mem_trace_stop function ====================================================*/
+alloc_status mem_trace_stop()
+{
+    //----------------------------------------------------------------------
+    // once trace_file is cleared under trace_lock, no thread is writing a
+    // record and none will start one, so the file can be closed unlocked
+    //----------------------------------------------------------------------
+
+    pthread_mutex_lock(&trace_lock);
+    FILE *file = atomic_exchange(&trace_file, NULL);
+    pthread_mutex_unlock(&trace_lock);
+
+    if (file == NULL)
+    {
+        return ALLOC_CALLED_AGAIN;
+    }
+
+    return (fclose(file) == 0) ? ALLOC_OK : ALLOC_FAIL;
+}
+
+
+/*================================================ alloc_status mem_profile_start function ================================================*/
+alloc_status mem_profile_start(size_t sample_bytes)
+{
+    //----------------------------------------------------------------------
+    // from here on, about one allocation per sample_bytes allocated bytes
+    // (in all pools, in every thread) has its stack recorded; sampled
+    // allocations are counted as live until they are deleted, even after
+    // mem_profile_stop; see mem_profile_dump
+    //----------------------------------------------------------------------
+
+    if (sample_bytes == 0)
+    {
+        return ALLOC_FAIL;
+    }
+
+    pthread_mutex_lock(&profile_lock);
+    if (profile_table == NULL)
+    {
+        profile_table = calloc(MEM_PROFILE_HASH_SIZE, sizeof(mem_profile_bucket_pt));
+    }
+    pthread_mutex_unlock(&profile_lock);
+
+    if (profile_table == NULL)
+    {
+        return ALLOC_FAIL;
+    }
+
+    profile_sample_bytes = sample_bytes;
+
+    return ALLOC_OK;
+}
+
+
+/*================================================ alloc_status mem_profile_stop function =================================================*/
+alloc_status mem_profile_stop()
+{
+    if (profile_sample_bytes == 0)
+    {
+        return ALLOC_CALLED_AGAIN;
+    }
+
+    profile_sample_bytes = 0;
+
+    return ALLOC_OK;
+}
+
+
+/*================================================ alloc_status mem_profile_dump function =================================================*/
+alloc_status mem_profile_dump(int fd)
+{
+    //----------------------------------------------------------------------
+    // writes everything sampled so far to fd in the legacy heap profile
+    // text format that pprof reads (heap_v2: the counts are the raw
+    // samples, pprof scales them up by the sampling rate), followed by
+    // this process's mappings, for symbolization
+    //----------------------------------------------------------------------
+
+    if (fd < 0 || profile_table == NULL)
+    {
+        return ALLOC_FAIL;
+    }
+
+    pthread_mutex_lock(&profile_lock);
+
+    mem_profile_bucket_t total;
+    memset(&total, 0, sizeof(total));
+
+    unsigned i;
+    mem_profile_bucket_pt bucket;
+    for (i = 0; i < MEM_PROFILE_HASH_SIZE; i++)
+    {
+        for (bucket = profile_table[i]; bucket != NULL; bucket = bucket->next)
+        {
+            total.inuse_objs += bucket->inuse_objs;
+            total.inuse_bytes += bucket->inuse_bytes;
+            total.alloc_objs += bucket->alloc_objs;
+            total.alloc_bytes += bucket->alloc_bytes;
+        }
+    }
+
+    int written = dprintf(fd, "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%zu\n",
+                          total.inuse_objs, total.inuse_bytes, total.alloc_objs, total.alloc_bytes,
+                          (size_t) profile_sample_bytes);
+
+    for (i = 0; i < MEM_PROFILE_HASH_SIZE && written >= 0; i++)
+    {
+        for (bucket = profile_table[i]; bucket != NULL && written >= 0; bucket = bucket->next)
+        {
+            written = dprintf(fd, "%llu: %llu [%llu: %llu] @", bucket->inuse_objs, bucket->inuse_bytes,
+                              bucket->alloc_objs, bucket->alloc_bytes);
+
+            unsigned frame;
+            for (frame = 0; frame < bucket->depth && written >= 0; frame++)
+            {
+                written = dprintf(fd, " %p", bucket->pcs[frame]);
+            }
+            if (written >= 0)
+            {
+                written = dprintf(fd, "\n");
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&profile_lock);
+
+    if (written < 0 || dprintf(fd, "\nMAPPED_LIBRARIES:\n") < 0)
+    {
+        return ALLOC_FAIL;
+    }
+
+    // the mappings are optional to pprof, so a missing /proc is not an error
+    int maps = open(MEM_PROFILE_MAPS_PATH, O_RDONLY);
+    if (maps >= 0)
+    {
+        char buf[MEM_SNAPSHOT_BUFFER_SIZE];
+        ssize_t len;
+        alloc_status status = ALLOC_OK;
+        while (status == ALLOC_OK && (len = read(maps, buf, sizeof(buf))) > 0)
+        {
+            status = _mem_write_all(fd, buf, (size_t) len);
+        }
+        close(maps);
+
+        return status;
+    }
+
+    return ALLOC_OK;
+}
+
+
+/*================================================= (void) mem_inspect_pool function ==================================================*/
+void mem_inspect_pool(pool_pt pool, pool_segment_pt *segments, unsigned *num_segments)
+{
+    _mem_lock((pool_mgr_pt) pool);
+    _mem_inspect_pool(pool, segments, num_segments);
+    _mem_unlock((pool_mgr_pt) pool);
+}
+
+
+// unlocked body of mem_inspect_pool
+static void _mem_inspect_pool(pool_pt pool, pool_segment_pt *segments, unsigned *num_segments)
+{
+    //----------------------------------------------------------------
+    // Instructor comments
+    //----------------------------------------------------------------
+    // get the mgr from the pool
+    // allocate the segments array with size == used_nodes
+    // check successful
+    // loop through the node heap and the segments array
+    //    for each node, write the size and allocated in the segment
+    // "return" the values:
+    /*
+                    *segments = segs;
+                    *num_segments = pool_mgr->used_nodes;
+    */
+    //----------------------------------------------------------------
+
+    const pool_mgr_pt new_pool_mgr = (pool_mgr_pt) pool;                                     // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    const pool_segment_pt segs = malloc(sizeof(pool_segment_t) * new_pool_mgr->used_nodes);  // allocate the segments array with size == used_nodes
+
+
+    if (segs != NULL)                                                                        // if the allocation was successful, continue
+    {
+        _mem_inspect_pool_into(new_pool_mgr, segs, new_pool_mgr->used_nodes);
+
+        *segments = segs;
+        *num_segments = new_pool_mgr->used_nodes;
+
+        return;                                                                               // "return" the updated values
+    }
+    else if (segs == NULL)                                                                    // if the allocation was not successful, just do a return
+    {
+        return;
+    }
+}
+
+
+
+/*============================================ alloc_status mem_inspect_pool_into function =============================================*/
+alloc_status mem_inspect_pool_into(pool_pt pool, pool_segment_pt buf, unsigned cap, unsigned *num_segments)
+{
+    //----------------------------------------------------------------------
+    // same walk as mem_inspect_pool, but into a caller buffer, so nothing
+    // is allocated; *num_segments is always the full count, so a caller
+    // whose buffer was too small knows how much to provide next time
+    //----------------------------------------------------------------------
+
+    pool_mgr_pt new_pool_mgr = (pool_mgr_pt) pool;                                     // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    if (new_pool_mgr == NULL || (buf == NULL && cap > 0) || num_segments == NULL)
+    {
+        return ALLOC_FAIL;
+    }
+
+    _mem_lock(new_pool_mgr);
+    unsigned used_nodes = new_pool_mgr->used_nodes;
+    _mem_inspect_pool_into(new_pool_mgr, buf, cap);
+    _mem_unlock(new_pool_mgr);
+
+    *num_segments = used_nodes;
+
+    return (used_nodes <= cap) ? ALLOC_OK : ALLOC_FAIL;                                 // ALLOC_FAIL: the buffer holds only the first cap segments
+}
+
+
+/*============================================= alloc_status mem_pool_iter_begin function ==============================================*/
+alloc_status mem_pool_iter_begin(pool_pt pool, pool_iter_pt iter)
+{
+    //----------------------------------------------------------------------
+    // the iterator takes no lock and allocates nothing, so it may be used
+    // from a signal handler; the caller must make sure the pool is not
+    // modified (e.g. by holding off other threads) while it walks
+    //----------------------------------------------------------------------
+
+    pool_mgr_pt new_pool_mgr = (pool_mgr_pt) pool;
+    if (new_pool_mgr == NULL || iter == NULL)
+    {
+        return ALLOC_FAIL;
+    }
+
+    iter->cursor = new_pool_mgr->list_head;
+
+    return ALLOC_OK;
+}
+
+
+/*================================================= (int) mem_pool_iter_next function ==================================================*/
+int mem_pool_iter_next(pool_iter_pt iter, pool_segment_pt segment)
+{
+    if (iter == NULL || segment == NULL || iter->cursor == NULL)                        // 0: no more segments
+    {
+        return 0;
+    }
+
+    const node_t *node = iter->cursor;
+    segment->size = _mem_segment_size(node);
+    segment->allocated = node->allocated;
+    iter->cursor = node->next;
+
+    return 1;
+}
+
+
+/*=========================================== alloc_status mem_inspect_pool_packed function ============================================*/
+alloc_status mem_inspect_pool_packed(pool_pt pool, uint8_t *buf, size_t cap, size_t *len)
+{
+    //----------------------------------------------------------------------
+    // each segment is one varint of (size << 1 | allocated), so most take
+    // 1-3 bytes instead of sizeof(pool_segment_t); segments that do not
+    // fit whole are left out, and *len is always the length of the full
+    // stream, like *num_segments in mem_inspect_pool_into
+    //----------------------------------------------------------------------
+
+    pool_mgr_pt new_pool_mgr = (pool_mgr_pt) pool;                                     // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    if (new_pool_mgr == NULL || (buf == NULL && cap > 0) || len == NULL)
+    {
+        return ALLOC_FAIL;
+    }
+
+    uint8_t packed[POOL_SEGMENT_PACKED_MAX];
+    size_t needed = 0;
+    size_t written = 0;
+
+    _mem_lock(new_pool_mgr);
+
+    node_pt current_node = new_pool_mgr->list_head;
+    while (current_node != NULL)
+    {
+        unsigned n = _mem_pack_segment(packed, _mem_segment_size(current_node), current_node->allocated);
+
+        if (written == needed && written + n <= cap)                                    // stop at the first segment that does not fit
+        {
+            memcpy(buf + written, packed, n);
+            written += n;
+        }
+        needed += n;
+        current_node = current_node->next;
+    }
+
+    _mem_unlock(new_pool_mgr);
+
+    *len = needed;
+
+    return (needed <= cap) ? ALLOC_OK : ALLOC_FAIL;
+}
+
+
+/*================================================= (int) mem_segment_unpack function ==================================================*/
+int mem_segment_unpack(const uint8_t *buf, size_t len, size_t *pos, pool_segment_pt segment)
+{
+    //----------------------------------------------------------------------
+    // decodes the segment at buf[*pos] and advances *pos past it;
+    // returns 0 at the end of the stream or on a truncated varint
+    //----------------------------------------------------------------------
+
+    if (buf == NULL || pos == NULL || segment == NULL)
+    {
+        return 0;
+    }
+
+    unsigned long long value = 0;
+    unsigned shift = 0;
+    size_t i = *pos;
+
+    while (i < len && shift < 7 * POOL_SEGMENT_PACKED_MAX)
+    {
+        uint8_t byte = buf[i++];
+        value |= (unsigned long long) (byte & 0x7f) << shift;
+        shift += 7;
+
+        if ((byte & 0x80) == 0)
+        {
+            segment->size = (size_t) (value >> 1);
+            segment->allocated = (unsigned long) (value & 1);
+            *pos = i;
+
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*================================================= alloc_status mem_pool_snapshot function =================================================*/
+alloc_status mem_pool_snapshot(pool_pt pool, int fd)
+{
+    //----------------------------------------------------------------------
+    // writes a mem_snapshot_header_t and the packed segment stream to fd;
+    // both are copied out under the pool lock, so they agree, and written
+    // after it is released, so a slow fd (a full pipe or socket) does not
+    // hold up other threads; fd may be a pipe or socket since the stream
+    // size is counted up front
+    //----------------------------------------------------------------------
+
+    pool_mgr_pt new_pool_mgr = (pool_mgr_pt) pool;                                     // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    if (new_pool_mgr == NULL || fd < 0)
+    {
+        return ALLOC_FAIL;
+    }
+
+    mem_snapshot_header_t header;
+    struct timespec now;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = MEM_SNAPSHOT_MAGIC;
+    header.version = MEM_SNAPSHOT_VERSION;
+    header.header_size = sizeof(header);
+    clock_gettime(CLOCK_REALTIME, &now);
+    header.timestamp_ns = (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+
+    _mem_lock(new_pool_mgr);
+
+    header.policy = new_pool_mgr->pool.policy;
+    header.flags = new_pool_mgr->flags;
+    header.total_size = new_pool_mgr->pool.total_size;
+    header.alloc_size = new_pool_mgr->pool.alloc_size;
+    header.num_allocs = new_pool_mgr->pool.num_allocs;
+    header.num_gaps = new_pool_mgr->pool.num_gaps;
+    header.num_segments = new_pool_mgr->used_nodes;
+    header.stream_size = _mem_stream_size(new_pool_mgr);
+
+    uint8_t *snapshot = malloc(sizeof(header) + header.stream_size);
+    if (snapshot != NULL)
+    {
+        memcpy(snapshot, &header, sizeof(header));
+        _mem_pack_segments(new_pool_mgr, snapshot + sizeof(header));
+    }
+
+    _mem_unlock(new_pool_mgr);
+
+    if (snapshot == NULL)
+    {
+        return ALLOC_FAIL;
+    }
+
+    alloc_status status = _mem_write_all(fd, snapshot, sizeof(header) + header.stream_size);
+    free(snapshot);
+
+    return status;
+}
+
+
+
+/*============================================== alloc_status mem_pool_leak_report function ===============================================*/
+alloc_status mem_pool_leak_report(pool_pt pool, int fd)
+{
+    //----------------------------------------------------------------------
+    // writes a line per allocation still in the pool to fd, as text: size
+    // and offset, plus age and call site with POOL_LEAK_TRACKING (symbolized
+    // where glibc can); nothing is written for an empty pool
+    //----------------------------------------------------------------------
+
+    pool_mgr_pt new_pool_mgr = (pool_mgr_pt) pool;                                     // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    if (new_pool_mgr == NULL || fd < 0)
+    {
+        return ALLOC_FAIL;
+    }
+
+    _mem_lock(new_pool_mgr);
+    alloc_status status = _mem_leak_report(new_pool_mgr, fd);
+    _mem_unlock(new_pool_mgr);
+
+    return status;
+}
+
+
+/*============================================= alloc_status mem_set_leak_report_fd function ==============================================*/
+alloc_status mem_set_leak_report_fd(int fd)
+{
+    //----------------------------------------------------------------------
+    // from here on, a pool that mem_pool_close refuses with ALLOC_NOT_FREED,
+    // and every pool mem_free finds still open, is reported to fd as by
+    // mem_pool_leak_report; -1 turns the reports off
+    //----------------------------------------------------------------------
+
+    if (fd < -1)
+    {
+        return ALLOC_FAIL;
+    }
+
+    leak_report_fd = fd;
+
+    return ALLOC_OK;
+}
+
+
+
+/***********************************/
+/*                                 */
+/* Definitions of static functions */
+/*                                 */
+/***********************************/
+static alloc_status _mem_resize_pool_store()
+{
+    //-------------------------------------------------------------
+    // Instructor comments
+    //-------------------------------------------------------------
+    // check if necessary
+    /*
+    *           if (((float) pool_store_size / pool_store_capacity)
+    *               > MEM_POOL_STORE_FILL_FACTOR) {...}
+    */
+    // don't forget to update capacity variables
+    //-------------------------------------------------------------
+
+    // a released slot will do; otherwise, if they are equal, we need to expand our pool store
+    if (pool_store_num_free == 0 && pool_store_size == pool_store_capacity)
+    {
+        // the free-slot stack never holds more than capacity slots, so it grows along
+        unsigned *new_free_slots = realloc(pool_store_free_slots, (pool_store_capacity + MEM_POOL_STORE_INIT_CAPACITY) * sizeof(unsigned));
+        if (new_free_slots == NULL)                                                         // check for realloc success, on error return ALLOC_FAIL
+        {
+            return ALLOC_FAIL;
+        }
+        pool_store_free_slots = new_free_slots;
+
+        pool_mgr_pt *new_pool_store = realloc(pool_store, (pool_store_capacity + MEM_POOL_STORE_INIT_CAPACITY) * sizeof(pool_mgr_pt));
+        if (new_pool_store == NULL)                                                         // check for realloc success, on error return ALLOC_FAIL
+        {
+            return ALLOC_FAIL;
+        }
+        memset(new_pool_store + pool_store_capacity, 0, MEM_POOL_STORE_INIT_CAPACITY * sizeof(pool_mgr_pt));   // mem_free checks every slot
+        pool_store = new_pool_store;
+        pool_store_capacity += MEM_POOL_STORE_INIT_CAPACITY;
+    }
+
+    return ALLOC_OK;                                                                        // if they are not equal, no pool store expansion is needed
+}
+
+
+// puts a manager in the pool store, in the most recently released slot
+// if there is one; _mem_resize_pool_store must have made room
+static void _mem_pool_store_add(pool_mgr_pt pool_mgr)
+{
+    unsigned slot = (pool_store_num_free > 0) ? pool_store_free_slots[--pool_store_num_free] : pool_store_size++;
+
+    pool_store[slot] = pool_mgr;
+    pool_mgr->slot = slot;
+}
+
+
+// takes a manager out of the pool store in O(1), through its slot; a
+// shared pool's slot field is overwritten by every process that attaches,
+// so a slot that does not hold the manager is searched for
+static void _mem_pool_store_remove(pool_mgr_pt pool_mgr)
+{
+    unsigned slot = pool_mgr->slot;
+
+    if (slot >= pool_store_size || pool_store[slot] != pool_mgr)
+    {
+        for (slot = 0; slot < pool_store_size && pool_store[slot] != pool_mgr; slot++)
+        {
+        }
+
+        if (slot == pool_store_size)                                                        // not in the store
+        {
+            return;
+        }
+    }
+
+    pool_store[slot] = NULL;
+    pool_store_free_slots[pool_store_num_free++] = slot;
+}
+
+
+// takes the most recently closed pool of this size out of the cache;
+// NULL if there is none
+static pool_mgr_pt _mem_pool_cache_take(size_t size)
+{
+    unsigned i = pool_cache_size;
+    while (i > 0 && pool_cache[i - 1]->pool.total_size != size)
+    {
+        i--;
+    }
+
+    if (i == 0)
+    {
+        return NULL;
+    }
+
+    pool_mgr_pt pool_mgr = pool_cache[i - 1];
+    pool_cache[i - 1] = pool_cache[--pool_cache_size];                                      // order does not matter beyond recency
+
+    return pool_mgr;
+}
+
+
+// parks a closed manager in the cache: everything but the memory pool, the
+// first node chunk and the gap index (with their sizes) is cleared, exactly
+// as a fresh open would find it; the cache must not be full
+static void _mem_pool_cache_put(pool_mgr_pt pool_mgr)
+{
+    char *mem = pool_mgr->pool.mem;
+    size_t size = pool_mgr->pool.total_size;
+    node_pt node_heap = pool_mgr->node_chunks[0].nodes;
+    gap_pt gap_ix = pool_mgr->gap_ix;
+    unsigned gap_ix_capacity = pool_mgr->gap_ix_capacity;
+
+    memset(node_heap, 0, MEM_NODE_HEAP_INIT_CAPACITY * sizeof(node_t));
+    memset(gap_ix, 0, gap_ix_capacity * sizeof(gap_t));
+    memset(pool_mgr, 0, sizeof(pool_mgr_t));
+
+    pool_mgr->pool.mem = mem;
+    pool_mgr->pool.total_size = size;
+    pool_mgr->node_heap = node_heap;
+    pool_mgr->gap_ix = gap_ix;
+    pool_mgr->gap_ix_capacity = gap_ix_capacity;
+    pool_mgr->backing = MEM_BACKING_HEAP;
+
+    pool_cache[pool_cache_size++] = pool_mgr;
+}
+
+
+// frees every cached pool, for mem_free
+static void _mem_pool_cache_flush()
+{
+    while (pool_cache_size > 0)
+    {
+        pool_mgr_pt pool_mgr = pool_cache[--pool_cache_size];
+
+        free(pool_mgr->node_heap);
+        free(pool_mgr->gap_ix);
+        _mem_release_mem(pool_mgr);
+        free(pool_mgr);
+    }
+}
+
+
+static alloc_status _mem_resize_node_heap(pool_mgr_pt pool_mgr)
+{
+    //-------------------------------------------------------------
+    // Instructor comments
+    //-------------------------------------------------------------
+    // check if necessary
+    /*
+    *           if (((float) pool_store_size / pool_store_capacity)
+    *               > MEM_POOL_STORE_FILL_FACTOR) {...}
+    */
+    // don't forget to update capacity variables
+    //-------------------------------------------------------------
+
+    if (((float)pool_mgr->used_nodes / pool_mgr->total_nodes) > MEM_NODE_HEAP_FILL_FACTOR)
+    {
+        if (pool_mgr->num_node_chunks == MEM_NODE_HEAP_MAX_CHUNKS)
+        {
+            return ALLOC_FAIL;
+        }
+
+        METRICS_START(start);
+        METRICS_COUNT(pool_mgr, node_heap_resizes, 1);
+
+        // add a chunk that brings the total up by the expand factor
+        unsigned new_node_count = pool_mgr->total_nodes * (MEM_NODE_HEAP_EXPAND_FACTOR - 1);
+        node_pt new_nodes = _mem_meta_calloc(pool_mgr->arena, new_node_count, sizeof(node_t));
+
+        if (new_nodes == NULL)
+        {
+            return ALLOC_FAIL;
+        }
+
+        pool_mgr->node_chunks[pool_mgr->num_node_chunks].nodes = new_nodes;
+        pool_mgr->node_chunks[pool_mgr->num_node_chunks].count = new_node_count;
+        pool_mgr->num_node_chunks += 1;
+        pool_mgr->total_nodes += new_node_count;                                            // update the total number nodes
+
+        _mem_push_free_nodes(pool_mgr, new_nodes, new_node_count);
+
+        METRICS_RECORD(pool_mgr, resize_latency, start);
+    }
+    return ALLOC_OK;
+}
+
+
+// returns count consecutive nodes to the free list, the first one on top
+static void _mem_push_free_nodes(pool_mgr_pt pool_mgr, node_pt nodes, unsigned count)
+{
+    unsigned i;
+    for (i = count; i > 0; i--)
+    {
+        node_pt node = &nodes[i - 1];
+
+        node->used = 0;
+        node->allocated = 0;
+        node->deferred = 0;
+        node->pins = 0;
+        node->prev = NULL;
+        node->quick_next = NULL;
+        node->next = pool_mgr->free_nodes;
+        pool_mgr->free_nodes = node;
+    }
+}
+
+
+// returns the node if it belongs to this pool's node heap, NULL otherwise;
+// one range check per chunk, so a free does not scan the whole heap
+static node_pt _mem_find_node(pool_mgr_pt pool_mgr, node_pt node)
+{
+    unsigned i;
+    for (i = 0; i < pool_mgr->num_node_chunks; i++)
+    {
+        node_chunk_pt chunk = &pool_mgr->node_chunks[i];
+        if (node >= chunk->nodes && node < chunk->nodes + chunk->count)
+        {
+            // a pointer into the middle of a node is not a node
+            return ((char *) node - (char *) chunk->nodes) % sizeof(node_t) == 0 ? node : NULL;
+        }
+    }
+
+    return NULL;
+}
+
+
+static alloc_status _mem_resize_gap_ix(pool_mgr_pt pool_mgr)
+{
+    //-------------------------------------------------------------
+    // Instructor comments
+    //-------------------------------------------------------------
+    // check if necessary
+    /*
+    *           if (((float) pool_store_size / pool_store_capacity)
+    *               > MEM_POOL_STORE_FILL_FACTOR) {...}
+    */
+    // don't forget to update capacity variables
+    //-------------------------------------------------------------
+
+    if (((float) _mem_gap_ix_size(pool_mgr) / pool_mgr->gap_ix_capacity) > MEM_GAP_IX_FILL_FACTOR)
+    {
+        unsigned new_capacity = pool_mgr->gap_ix_capacity * MEM_GAP_IX_EXPAND_FACTOR;
+
+        // reallocate/resize gap index
+        gap_pt new_gap_ix = _mem_meta_realloc(pool_mgr->arena, pool_mgr->gap_ix,
+                                              pool_mgr->gap_ix_capacity * sizeof(gap_t), new_capacity * sizeof(gap_t));
+        if (new_gap_ix == NULL)
+        {
+            return ALLOC_FAIL;
+        }
+
+        // zero out the new entries and update the gap capacity
+        memset(new_gap_ix + pool_mgr->gap_ix_capacity, 0, (new_capacity - pool_mgr->gap_ix_capacity) * sizeof(gap_t));
+        pool_mgr->gap_ix = new_gap_ix;
+        pool_mgr->gap_ix_capacity = new_capacity;
+        METRICS_COUNT(pool_mgr, gap_ix_resizes, 1);
+    }
+
+    return ALLOC_OK;
+}
+
+
+static alloc_status _mem_add_to_gap_ix(pool_mgr_pt pool_mgr, size_t size,node_pt node)
+{
+    //-------------------------------------------------------
+    // Instructor comments
+    //-------------------------------------------------------
+    // expand the gap index, if necessary (call the function)
+    // add the entry at the end
+    // update metadata (num_gaps)
+    // sort the gap index (call the function)
+    // check success
+    //-------------------------------------------------------
+
+    // expand the gap index, if necessary (call the function)
+    if (_mem_resize_gap_ix(pool_mgr) != ALLOC_OK)
+    {
+        return ALLOC_FAIL;
+    }
+
+    // add the entry at the end
+    unsigned i = _mem_gap_ix_size(pool_mgr);
+
+    pool_mgr->gap_ix[i].node = node;
+    pool_mgr->gap_ix[i].size = size;
+
+    // update number of gaps
+    pool_mgr->pool.num_gaps++;
+    _mem_track_gap(pool_mgr, size, +1);
+
+    // sort the gap index
+    return _mem_sort_gap_ix(pool_mgr);
+}
+
+
+static alloc_status _mem_remove_from_gap_ix(pool_mgr_pt pool_mgr, size_t size, node_pt node)
+{
+    //-------------------------------------------------------
+    // Instructor comments
+    //-------------------------------------------------------
+    // find the position of the node in the gap index
+    // loop from there to the end of the array:
+    //    pull the entries (i.e. copy over) one position up
+    //    this effectively deletes the chosen node
+    // update metadata (num_gaps)
+    // zero out the element at position num_gaps!
+    //-------------------------------------------------------
+
+    unsigned gap_ix_size = _mem_gap_ix_size(pool_mgr);
+
+    // find the position of the node in the gap index
+    unsigned i = 0;
+    while (i < gap_ix_size && pool_mgr->gap_ix[i].node != node)
+    {
+        i += 1;
+    }
+
+    if (i == gap_ix_size)                                                                   // not in the index
+    {
+        return ALLOC_FAIL;
+    }
+
+    size_t gap_size = pool_mgr->gap_ix[i].size;
+
+    // pull the entries after it one position up
+    for (; i + 1 < gap_ix_size; i++)
+    {
+        pool_mgr->gap_ix[i] = pool_mgr->gap_ix[i + 1];
+    }
+
+    // update metadata and zero out the freed element at the end
+    pool_mgr->pool.num_gaps--;
+    _mem_track_gap(pool_mgr, gap_size, -1);
+    pool_mgr->gap_ix[gap_ix_size - 1].size = 0;
+    pool_mgr->gap_ix[gap_ix_size - 1].node = NULL;
+
+    return ALLOC_OK;
+}
+
+
+// note: only called by _mem_add_to_gap_ix, which appends a single entry
+static alloc_status _mem_sort_gap_ix(pool_mgr_pt pool_mgr)
+{
+    //----------------------------------------------------------------------
+    // Instructor comments
+    //----------------------------------------------------------------------
+    // the new entry is at the end, so "bubble it up"
+    // loop from num_gaps - 1 until but not including 0:
+    //    if the size of the current entry is less than the previous (u - 1)
+    //       swap them (by copying) (remember to use a temporary variable)
+    //----------------------------------------------------------------------
+
+    METRICS_START(start);
+
+    // ties are broken by address, so BEST_FIT picks the lowest of equal gaps
+    int i;
+    for (i = (int) _mem_gap_ix_size(pool_mgr) - 1; i > 0; i--)
+    {
+        gap_pt current = &pool_mgr->gap_ix[i];
+        gap_pt previous = &pool_mgr->gap_ix[i - 1];
+
+        if (current->size < previous->size
+            || (current->size == previous->size && current->node->alloc_record.mem < previous->node->alloc_record.mem))
+        {
+            gap_t temp = *previous;
+            *previous = *current;
+            *current = temp;
+            METRICS_COUNT(pool_mgr, gap_ix_sort_swaps, 1);
+        }
+        else
+        {
+            break;                                                                          // the rest is already sorted
+        }
+    }
+
+    METRICS_RECORD(pool_mgr, sort_latency, start);
+
+    return ALLOC_OK;
+}
+
+
+// the gap index holds every gap except the ones parked on quick lists
+static unsigned _mem_gap_ix_size(pool_mgr_pt pool_mgr)
+{
+    return pool_mgr->pool.num_gaps - pool_mgr->num_deferred;
+}
+
+
+static node_pt _mem_find_gap(pool_mgr_pt pool_mgr, size_t size)
+{
+    METRICS_START(start);
+    METRICS_COUNT(pool_mgr, alloc_searches, 1);
+
+    node_pt found = NULL;
+
+    // FIRST_FIT: walk the segment list in address order
+    if (pool_mgr->pool.policy == FIRST_FIT)
+    {
+        node_pt node;
+        for (node = pool_mgr->list_head; node != NULL; node = node->next)
+        {
+            METRICS_COUNT(pool_mgr, alloc_probes, 1);
+            if (node->allocated == 0 && node->deferred == 0 && node->alloc_record.size >= size)
+            {
+                found = node;
+                break;
+            }
+        }
+    }
+
+    // BEST_FIT: the gap index is sorted by size, so the first sufficient entry is the best fit
+    else if (pool_mgr->pool.policy == BEST_FIT)
+    {
+        unsigned gap_ix_size = _mem_gap_ix_size(pool_mgr);
+
+        unsigned i;
+        for (i = 0; i < gap_ix_size; i++)
+        {
+            METRICS_COUNT(pool_mgr, alloc_probes, 1);
+            if (pool_mgr->gap_ix[i].size >= size)
+            {
+                found = pool_mgr->gap_ix[i].node;
+                break;
+            }
+        }
+    }
+
+    METRICS_RECORD(pool_mgr, search_latency, start);
+
+    return found;
+}
+
+
+// turns a freshly freed (non-deferred) node into a gap, merging it with
+// the gaps on either side, and adds the result to the gap index
+static alloc_status _mem_coalesce_gap(pool_mgr_pt pool_mgr, node_pt to_delete)
+{
+    // if the next node in the list is also a gap, merge into node-to-delete
+    if (to_delete->next != NULL && to_delete->next->allocated == 0 && to_delete->next->deferred == 0)
+    {
+        node_pt next = to_delete->next;
+        if (_mem_remove_from_gap_ix(pool_mgr, 0, next) == ALLOC_FAIL)
+        {
+            return ALLOC_FAIL;
+        }
+
+        to_delete->alloc_record.size += next->alloc_record.size;
+        METRICS_COUNT(pool_mgr, coalesces, 1);
+        next->used = 0;
+        pool_mgr->used_nodes -= 1;
+
+        if (next->next)
+        {
+            next->next->prev = to_delete;
+            to_delete->next = next->next;
+        }
+
+        else
+        {
+            to_delete->next = NULL;
+        }
+
+        _mem_push_free_nodes(pool_mgr, next, 1);
+    }
 
     // this merged node-to-delete might need to be added to the gap index
-    // but one more thing to check...
     // if the previous node in the list is also a gap, merge into previous!
-    //   remove the previous node from gap index
-    //   check success
-    //   add the size of node-to-delete to the previous
-    //   update node-to-delete as unused
-    //   update metadata (used_nodes)
-    //   update linked list
-    /*
-                    if (node_to_del->next) {
-                        prev->next = node_to_del->next;
-                        node_to_del->next->prev = prev;
-                    } else {
-                        prev->next = NULL;
-                    }
-                    node_to_del->next = NULL;
-                    node_to_del->prev = NULL;
-     */
-    //   change the node to add to the previous node!
+    if(to_delete->prev != NULL && to_delete->prev->allocated == 0 && to_delete->prev->deferred == 0)
+    {
+        node_pt previous = to_delete->prev;
+        if (_mem_remove_from_gap_ix(pool_mgr, 0, previous) == ALLOC_FAIL)
+        {
+            return ALLOC_FAIL;
+        }
+
+        previous->alloc_record.size += to_delete->alloc_record.size;
+        METRICS_COUNT(pool_mgr, coalesces, 1);
+        to_delete->used = 0;
+        pool_mgr->used_nodes -= 1;
+        if(to_delete->next)
+        {
+            previous->next = to_delete->next;
+            to_delete->next->prev = previous;
+        }
+        else
+        {
+            previous->next = NULL;
+        }
+
+        _mem_push_free_nodes(pool_mgr, to_delete, 1);
+        to_delete = previous;
+    }
+
     // add the resulting node to the gap index
     // check success
-    //----------------------------------------------------------------------
+    // if no success, handle appropriately
+    if (_mem_add_to_gap_ix(pool_mgr, to_delete->alloc_record.size, to_delete) != ALLOC_OK)
+    {
+        return ALLOC_FAIL;
+    }
+    else
+    {
+        return ALLOC_OK;
+    }
+}
 
-    pool_mgr_pt new_pool_mgr = (pool_mgr_pt) pool;                                     // get mgr from pool by casting the pointer to (pool_mgr_pt)
-    node_pt node = (node_pt) alloc;                                                    // get node from alloc by casting the pointer to (node_pt)
 
-    node_pt to_delete = NULL;
 
-    // find the node in the node heap
-    int i;
-    for (i = 0; i < new_pool_mgr->total_nodes; ++i)
+
+// parks a freed node on the quick list for its size; fails if the node
+// cannot be parked (no free slot for a new size), so the caller coalesces
+static alloc_status _mem_push_quick_list(pool_mgr_pt pool_mgr, node_pt node)
+{
+    size_t size = node->alloc_record.size;
+    if (size == 0)
+    {
+        return ALLOC_FAIL;
+    }
+
+    // open addressing by size, claiming the first unused slot on the way
+    unsigned probe;
+    for (probe = 0; probe < MEM_QUICK_LIST_CAPACITY; probe++)
     {
-        if(node == &new_pool_mgr->node_heap[i])
+        quick_list_pt list = &pool_mgr->quick_lists[(size + probe) % MEM_QUICK_LIST_CAPACITY];
+
+        if (list->size == 0)
         {
-            to_delete = &new_pool_mgr->node_heap[i];
-            break;
+            list->size = size;
+        }
+
+        if (list->size == size)
+        {
+            node->deferred = 1;
+            node->quick_next = list->head;
+            list->head = node;
+
+            pool_mgr->num_deferred += 1;
+            pool_mgr->pool.num_gaps += 1;
+            _mem_track_gap(pool_mgr, size, +1);
+
+            return ALLOC_OK;
         }
     }
 
-    // this is node-to-delete
-    // make sure it's found
-    // if the node is not found, handle it appropriately
-    if (to_delete == NULL)
+    return ALLOC_FAIL;
+}
+
+
+static node_pt _mem_pop_quick_list(pool_mgr_pt pool_mgr, size_t size)
+{
+    if (size == 0)
     {
-        return ALLOC_FAIL;
+        return NULL;
     }
 
-    // if it was found
-    // update metadata (num_allocs, alloc_size)
-    to_delete->allocated = 0;
-    new_pool_mgr->pool.num_allocs -= 1;
-    new_pool_mgr->pool.alloc_size = new_pool_mgr->pool.alloc_size - to_delete->alloc_record.size;
+    unsigned probe;
+    for (probe = 0; probe < MEM_QUICK_LIST_CAPACITY; probe++)
+    {
+        quick_list_pt list = &pool_mgr->quick_lists[(size + probe) % MEM_QUICK_LIST_CAPACITY];
 
-    // if the next node in the list is also a gap, merge into node-to-delete
-    if (to_delete->next != NULL && to_delete->next->allocated == 0)
+        if (list->size == 0)                                                                // size never parked
+        {
+            return NULL;
+        }
+
+        if (list->size == size)
+        {
+            node_pt node = list->head;
+            if (node != NULL)
+            {
+                list->head = node->quick_next;
+                node->quick_next = NULL;
+                node->deferred = 0;
+
+                pool_mgr->num_deferred -= 1;
+                pool_mgr->pool.num_gaps -= 1;
+                _mem_track_gap(pool_mgr, size, -1);
+            }
+
+            return node;
+        }
+    }
+
+    return NULL;
+}
+
+
+// a guarded allocation's segment starts node->guard bytes before its
+// alloc_record.mem and ends node->guard bytes after its last byte
+static char *_mem_segment_mem(const node_t *node)
+{
+    return node->alloc_record.mem - node->guard;
+}
+
+
+static size_t _mem_segment_size(const node_t *node)
+{
+    return node->alloc_record.size + 2 * (size_t) node->guard;
+}
+
+
+// turns a node that was just carved out for size + 2 * MEM_GUARD_SIZE
+// bytes into a guarded allocation of size bytes between two redzones;
+// returns the node as is outside of debug guard mode
+static alloc_pt _mem_guard_wrap(pool_mgr_pt pool_mgr, node_pt node, size_t size)
+{
+    if (!(pool_mgr->flags & POOL_DEBUG_GUARDS))
     {
-        node_pt next = to_delete->next;
-        if (_mem_remove_from_gap_ix(new_pool_mgr, 0, next) == ALLOC_FAIL)
+        return (alloc_pt) node;
+    }
+
+    char *segment = node->alloc_record.mem;
+    memset(segment, MEM_GUARD_CANARY, MEM_GUARD_SIZE);
+    memset(segment + MEM_GUARD_SIZE, MEM_GUARD_FRESH, size);
+    memset(segment + MEM_GUARD_SIZE + size, MEM_GUARD_CANARY, MEM_GUARD_SIZE);
+
+    node->guard = MEM_GUARD_SIZE;
+    node->alloc_record.mem = segment + MEM_GUARD_SIZE;
+    node->alloc_record.size = size;
+
+    return (alloc_pt) node;
+}
+
+
+// ALLOC_OK if all len bytes at mem are expected, otherwise reports the
+// first one that isn't and returns ALLOC_CORRUPTED
+static alloc_status _mem_guard_check(pool_mgr_pt pool_mgr, const char *mem, size_t len, uint8_t expected, const char *what)
+{
+    size_t i;
+    for (i = 0; i < len; i++)
+    {
+        if ((uint8_t) mem[i] != expected)
+        {
+            fprintf(stderr, "mem_pool: pool %u: %s at offset %llu\n", pool_mgr->id, what,
+                    (unsigned long long) (mem + i - pool_mgr->pool.mem));
+            return ALLOC_CORRUPTED;
+        }
+    }
+
+    return ALLOC_OK;
+}
+
+
+// mem_del_alloc for a guarded allocation: checks both redzones, turns the
+// node back into a plain block, poisons all of it and parks it, deferred,
+// at the back of the quarantine, evicting the oldest block if it is full
+static alloc_status _mem_quarantine_push(pool_mgr_pt pool_mgr, node_pt node)
+{
+    alloc_status status = ALLOC_OK;
+
+    if (pool_mgr->quarantine_count == MEM_GUARD_QUARANTINE_CAPACITY)
+    {
+        status = _mem_quarantine_evict(pool_mgr);
+        if (status == ALLOC_FAIL)
         {
             return ALLOC_FAIL;
         }
+    }
+
+    char *segment = _mem_segment_mem(node);
+    if (_mem_guard_check(pool_mgr, segment, node->guard, MEM_GUARD_CANARY, "redzone overwritten") != ALLOC_OK
+        || _mem_guard_check(pool_mgr, node->alloc_record.mem + node->alloc_record.size, node->guard,
+                            MEM_GUARD_CANARY, "redzone overwritten") != ALLOC_OK)
+    {
+        status = ALLOC_CORRUPTED;
+    }
+
+    node->alloc_record.mem = segment;
+    node->alloc_record.size += 2 * (size_t) node->guard;
+    node->guard = 0;
+    memset(segment, MEM_GUARD_POISON, node->alloc_record.size);
+
+    node->deferred = 1;
+    pool_mgr->num_deferred += 1;
+    pool_mgr->pool.num_gaps += 1;
+    _mem_track_gap(pool_mgr, node->alloc_record.size, +1);
+
+    unsigned tail = (pool_mgr->quarantine_head + pool_mgr->quarantine_count) % MEM_GUARD_QUARANTINE_CAPACITY;
+    pool_mgr->quarantine[tail] = node;
+    pool_mgr->quarantine_count += 1;
+
+    return status;
+}
+
+
+// releases the oldest block in the quarantine the way mem_del_alloc would
+// have, after checking that nothing wrote to it while it was held back
+static alloc_status _mem_quarantine_evict(pool_mgr_pt pool_mgr)
+{
+    node_pt node = pool_mgr->quarantine[pool_mgr->quarantine_head];
+    pool_mgr->quarantine_head = (pool_mgr->quarantine_head + 1) % MEM_GUARD_QUARANTINE_CAPACITY;
+    pool_mgr->quarantine_count -= 1;
+
+    alloc_status status = _mem_guard_check(pool_mgr, node->alloc_record.mem, node->alloc_record.size,
+                                           MEM_GUARD_POISON, "free memory written");
+
+    // the block stops being deferred; the quick list or _mem_coalesce_gap counts it again
+    node->deferred = 0;
+    pool_mgr->num_deferred -= 1;
+    pool_mgr->pool.num_gaps -= 1;
+    _mem_track_gap(pool_mgr, node->alloc_record.size, -1);
+
+    if (pool_mgr->quick_lists != NULL && _mem_push_quick_list(pool_mgr, node) == ALLOC_OK)
+    {
+        return status;
+    }
+
+    return (_mem_coalesce_gap(pool_mgr, node) == ALLOC_OK) ? status : ALLOC_FAIL;
+}
+
+
+// a shared pool's lock is robust: when its holder died, the pool is taken
+// over as it was left, which is consistent unless the holder died in the
+// middle of an update (rather than, say, in a move callback)
+static void _mem_lock(pool_mgr_pt pool_mgr)
+{
+    if (pool_mgr->flags & POOL_THREAD_SAFE)
+    {
+        if (pthread_mutex_lock(&pool_mgr->lock) == EOWNERDEAD)
+        {
+            fprintf(stderr, "mem_pool: pool %u: a process died holding the lock\n", pool_mgr->id);
+            pthread_mutex_consistent(&pool_mgr->lock);
+        }
+    }
+}
+
+
+static void _mem_unlock(pool_mgr_pt pool_mgr)
+{
+    if (pool_mgr->flags & POOL_THREAD_SAFE)
+    {
+        pthread_mutex_unlock(&pool_mgr->lock);
+    }
+}
+
+
+// one bounded compaction step: starting at start (or the list head, if
+// start is NULL or has been released), visit at most max_segments
+// segments; whenever a gap is followed by an unpinned allocation, the
+// allocation is moved down into the gap, and the gap, now behind it, is
+// merged with the gap that follows, if any
+// returns the node to resume from, NULL once the end of the list is reached
+static node_pt _mem_compact_step(pool_mgr_pt pool_mgr, node_pt start, unsigned max_segments, alloc_move_callback move_callback)
+{
+    node_pt node = (start != NULL && start->used) ? start : pool_mgr->list_head;
+
+    unsigned visited;
+    for (visited = 0; node != NULL && visited < max_segments; visited++)
+    {
+        node_pt alloc = node->next;
+
+        // only a regular gap followed by a movable allocation is of interest
+        if (node->allocated || node->deferred || alloc == NULL || !alloc->allocated || alloc->pins > 0)
+        {
+            node = node->next;
+            continue;
+        }
+
+        // move the allocation (redzones included) down to the start of the gap
+        node_pt gap = node;
+        char *old_mem = alloc->alloc_record.mem;
+        char *new_segment = gap->alloc_record.mem;
+        size_t segment_size = _mem_segment_size(alloc);
+
+        // only the gap: where it is smaller, the rest of the destination is the
+        // allocation itself, whose definedness memmove() must carry over
+        MEM_MARK(pool_mgr, new_segment, gap->alloc_record.size, MEM_SHADOW_UNDEFINED);
+        memmove(new_segment, _mem_segment_mem(alloc), segment_size);
+        alloc->alloc_record.mem = new_segment + alloc->guard;
+        gap->alloc_record.mem = new_segment + segment_size;
+        MEM_MARK(pool_mgr, gap->alloc_record.mem, gap->alloc_record.size, MEM_SHADOW_NOACCESS);
+
+        if (pool_mgr->flags & POOL_DEBUG_GUARDS)                                   // free memory stays poisoned
+        {
+            memset(gap->alloc_record.mem, MEM_GUARD_POISON, gap->alloc_record.size);
+        }
+
+        // swap the two nodes in the list: prev, gap, alloc, next -> prev, alloc, gap, next
+        node_pt prev = gap->prev;
+        node_pt next = alloc->next;
+
+        alloc->prev = prev;
+        alloc->next = gap;
+        gap->prev = alloc;
+        gap->next = next;
+        if (prev != NULL)
+        {
+            prev->next = alloc;
+        }
+        else
+        {
+            pool_mgr->list_head = alloc;
+        }
+        if (next != NULL)
+        {
+            next->prev = gap;
+        }
+
+        // the gap moved, so re-index it, merging in the gap that follows
+        _mem_remove_from_gap_ix(pool_mgr, 0, gap);
+        _mem_coalesce_gap(pool_mgr, gap);
+
+        TRACE(MEM_TRACE_MOVE, pool_mgr, (unsigned long long) (old_mem - pool_mgr->pool.mem),
+              (unsigned long long) (alloc->alloc_record.mem - pool_mgr->pool.mem));
+
+        if (move_callback != NULL)
+        {
+            move_callback((pool_pt) pool_mgr, &alloc->alloc_record, old_mem);
+        }
+
+        node = gap;
+    }
+
+    return node;
+}
+
+
+static void *_mem_compactor_main(void *arg)
+{
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) arg;
+    compactor_pt compactor = pool_mgr->compactor;
+
+    pthread_mutex_lock(&pool_mgr->lock);
+
+    while (!compactor->stop)
+    {
+        compactor->cursor = _mem_compact_step(pool_mgr, compactor->cursor,
+                                              compactor->segments_per_step, compactor->move_callback);
+
+        // sleep until the next step, releasing the lock to the allocating threads
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long) (compactor->step_interval_us % 1000000) * 1000;
+        deadline.tv_sec += compactor->step_interval_us / 1000000 + deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+
+        while (!compactor->stop
+               && pthread_cond_timedwait(&compactor->wakeup, &pool_mgr->lock, &deadline) == 0);
+    }
+
+    pthread_mutex_unlock(&pool_mgr->lock);
+
+    return NULL;
+}
+
+
+// size class i holds the sizes in [2^i, 2^(i+1)), the last class everything above
+static unsigned _mem_size_class(size_t size)
+{
+    unsigned size_class = 0;
+    while (size > 1 && size_class < POOL_STATS_SIZE_CLASSES - 1)
+    {
+        size >>= 1;
+        size_class += 1;
+    }
+
+    return size_class;
+}
+
+
+// called wherever pool.num_gaps changes, with delta +1 or -1
+static void _mem_track_gap(pool_mgr_pt pool_mgr, size_t size, int delta)
+{
+    unsigned size_class = _mem_size_class(size);
+
+    if (delta > 0)
+    {
+        pool_mgr->gap_hist[size_class] += 1;
+        pool_mgr->gap_hist_bytes[size_class] += size;
+    }
+    else
+    {
+        pool_mgr->gap_hist[size_class] -= 1;
+        pool_mgr->gap_hist_bytes[size_class] -= size;
+    }
+}
+
+
+static unsigned long long _mem_now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (unsigned long long) now.tv_sec * 1000000000ULL + (unsigned long long) now.tv_nsec;
+}
+
+
+// appends one record to the trace file, if tracing is still on: the file
+// is read once, under trace_lock, which mem_trace_stop takes to clear it
+static void _mem_trace(unsigned op, unsigned pool_id, alloc_policy policy, unsigned long long size, unsigned long long offset)
+{
+    mem_trace_record_t record;
+
+    record.op = (uint8_t) op;
+    record.policy = (uint8_t) policy;
+    record.reserved = 0;
+    record.pool_id = pool_id;
+    record.size = size;
+    record.offset = offset;
+
+    pthread_mutex_lock(&trace_lock);
+    record.timestamp_ns = _mem_now_ns();                                        // in file order
+    FILE *file = atomic_load(&trace_file);
+    if (file != NULL)
+    {
+        fwrite(&record, sizeof(record), 1, file);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+
+// decides whether an allocation is sampled: every thread counts down an
+// exponentially distributed number of bytes (mean profile_sample_bytes),
+// so an allocation is picked with a probability that grows with its size
+// and the samples form a Poisson process, which is what pprof assumes
+static void _mem_profile_sample(node_pt node, size_t size, const void *site)
+{
+    static _Thread_local uint64_t rng = 0;
+    static _Thread_local long long countdown = 0;
+
+    size_t mean = profile_sample_bytes;
+    if (rng == 0)                                                                   // first allocation in this thread
+    {
+        rng = _mem_now_ns() ^ (uint64_t) (uintptr_t) &rng;
+        rng = (rng != 0) ? rng : 1;
+        countdown = _mem_profile_interval(&rng, mean);
+    }
+
+    countdown -= (long long) size;
+    if (countdown > 0)
+    {
+        return;
+    }
+    countdown = _mem_profile_interval(&rng, mean);
+
+    // the stack, from the caller of mem_new_alloc down
+    void *pcs[MEM_PROFILE_MAX_DEPTH + MEM_PROFILE_MAX_SKIP];
+    int depth = 0;
+    int first = 0;
+#ifdef __GLIBC__
+    depth = backtrace(pcs, MEM_PROFILE_MAX_DEPTH + MEM_PROFILE_MAX_SKIP);
+    while (first < depth && first < MEM_PROFILE_MAX_SKIP && pcs[first] != site)
+    {
+        first++;
+    }
+    if (first == depth || pcs[first] != site)                                       // frame not found, keep them all
+    {
+        first = 0;
+    }
+#endif
+    if (depth == 0)
+    {
+        pcs[0] = (void *) site;
+        depth = 1;
+    }
+    if (depth - first > MEM_PROFILE_MAX_DEPTH)
+    {
+        depth = first + MEM_PROFILE_MAX_DEPTH;
+    }
+
+    // FNV-1a over the frame addresses
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    int i;
+    for (i = first; i < depth; i++)
+    {
+        hash = (hash ^ (uint64_t) (uintptr_t) pcs[i]) * 0x100000001b3ULL;
+    }
+
+    pthread_mutex_lock(&profile_lock);
+
+    mem_profile_bucket_pt *chain = &profile_table[hash % MEM_PROFILE_HASH_SIZE];
+    mem_profile_bucket_pt bucket = *chain;
+    while (bucket != NULL
+           && (bucket->depth != (unsigned) (depth - first) || memcmp(bucket->pcs, pcs + first, bucket->depth * sizeof(void *)) != 0))
+    {
+        bucket = bucket->next;
+    }
+
+    if (bucket == NULL)
+    {
+        bucket = calloc(1, sizeof(mem_profile_bucket_t));
+        if (bucket == NULL)                                                         // the sample is lost, nothing else
+        {
+            pthread_mutex_unlock(&profile_lock);
+            return;
+        }
+        bucket->depth = (unsigned) (depth - first);
+        memcpy(bucket->pcs, pcs + first, bucket->depth * sizeof(void *));
+        bucket->next = *chain;
+        *chain = bucket;
+    }
+
+    bucket->inuse_objs += 1;
+    bucket->inuse_bytes += size;
+    bucket->alloc_objs += 1;
+    bucket->alloc_bytes += size;
+    node->profile_bucket = bucket;
+
+    pthread_mutex_unlock(&profile_lock);
+}
+
+
+// -ln(u) * mean for a uniform u in (0, 1], from a xorshift64* generator;
+// log2 of the mantissa is approximated by a quadratic, which is plenty for
+// spacing samples and keeps the library free of libm
+static long long _mem_profile_interval(uint64_t *rng, size_t mean)
+{
+    *rng ^= *rng >> 12;
+    *rng ^= *rng << 25;
+    *rng ^= *rng >> 27;
+    uint64_t r = ((*rng * 0x2545f4914f6cdd1dULL) >> 11) + 1;                        // (0, 2^53]
+
+    int exponent = 0;
+    while ((r >> (exponent + 1)) != 0)
+    {
+        exponent++;
+    }
+    double mantissa = (double) r / (double) (1ULL << exponent);                     // [1, 2)
+    double log2_r = exponent + (-0.34484843 * mantissa + 2.02466578) * mantissa - 1.67487759;
+
+    double interval = (53.0 - log2_r) * 0.6931471805599453 * (double) mean;
+    return (interval >= 1.0) ? (long long) interval : 1;
+}
+
+
+// a sampled allocation is going away
+static void _mem_profile_release(node_pt node)
+{
+    pthread_mutex_lock(&profile_lock);
+    node->profile_bucket->inuse_objs -= 1;
+    node->profile_bucket->inuse_bytes -= node->alloc_record.size;
+    node->profile_bucket = NULL;
+    pthread_mutex_unlock(&profile_lock);
+}
+
+
+// fills buf with the first cap segments in address order, returns how many were written
+static unsigned _mem_inspect_pool_into(pool_mgr_pt pool_mgr, pool_segment_pt buf, unsigned cap)
+{
+    unsigned n = 0;
+    node_pt current_node = pool_mgr->list_head;
+
+    while (current_node != NULL && n < cap)
+    {
+        buf[n].size = _mem_segment_size(current_node);
+        buf[n].allocated = current_node->allocated;
+        n += 1;
+        current_node = current_node->next;
+    }
+
+    return n;
+}
+
+
+// LEB128 encoding of (size << 1 | allocated), returns the number of bytes written
+static unsigned _mem_pack_segment(uint8_t *out, size_t size, unsigned allocated)
+{
+    unsigned long long value = ((unsigned long long) size << 1) | (allocated ? 1 : 0);
+    unsigned n = 0;
+
+    while (value >= 0x80)
+    {
+        out[n++] = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (uint8_t) value;
 
-        to_delete->alloc_record.size += next->alloc_record.size;
-        next->used = 0;
-        new_pool_mgr->used_nodes -= 1;
+    return n;
+}
 
-        if (next->next)
-        {
-            next->next->prev = to_delete;
-            to_delete->next = next->next;
-        }
 
-        else
-        {
-            to_delete->next = NULL;
-        }
+// unlocked body of mem_pool_leak_report
+static alloc_status _mem_leak_report(pool_mgr_pt pool_mgr, int fd)
+{
+    if (pool_mgr->pool.num_allocs == 0)
+    {
+        return ALLOC_OK;
+    }
 
-        next->next = NULL;
-        next->prev = NULL;
+    if (dprintf(fd, "mem_pool: pool %u: %u allocations (%zu bytes) not freed\n", pool_mgr->id,
+                pool_mgr->pool.num_allocs, pool_mgr->pool.alloc_size) < 0)
+    {
+        return ALLOC_FAIL;
     }
 
-    // this merged node-to-delete might need to be added to the gap index
-    // if the previous node in the list is also a gap, merge into previous!
-    if(to_delete->prev != NULL && to_delete->prev->allocated == 0)
+    unsigned long long now = _mem_now_ns();
+    node_pt node;
+    for (node = pool_mgr->list_head; node != NULL; node = node->next)
     {
-        node_pt previous = to_delete->prev;
-        if (_mem_remove_from_gap_ix(new_pool_mgr, 0, previous) == ALLOC_FAIL)
+        if (!node->allocated)
         {
-            return ALLOC_FAIL;
+            continue;
         }
 
-        previous->alloc_record.size += to_delete->alloc_record.size;
-        to_delete->used = 0;
-        new_pool_mgr->used_nodes -= 1;
-        if(to_delete->next)
+        int written = dprintf(fd, "mem_pool:   %zu bytes at offset %llu", node->alloc_record.size,
+                              (unsigned long long) (node->alloc_record.mem - pool_mgr->pool.mem));
+        if (written >= 0 && node->alloc_ns != 0)
         {
-            previous->next = to_delete->next;
-            to_delete->next->prev = previous;
+            unsigned long long age_ms = (now - node->alloc_ns) / 1000000;
+            written = dprintf(fd, ", %llu.%03llu s old", age_ms / 1000, age_ms % 1000);
         }
-        else
+        if (written >= 0 && node->alloc_site != NULL)
         {
-            previous->next = NULL;
+#ifdef __GLIBC__
+            written = dprintf(fd, ", allocated at ");
+            if (written >= 0)
+            {
+                void *site = (void *) node->alloc_site;
+                backtrace_symbols_fd(&site, 1, fd);                                   // ends the line
+                continue;
+            }
+#else
+            written = dprintf(fd, ", allocated at %p", node->alloc_site);
+#endif
+        }
+        if (written < 0 || dprintf(fd, "\n") < 0)
+        {
+            return ALLOC_FAIL;
         }
-
-        to_delete = previous;
     }
 
-    // add the resulting node to the gap index
-    // check success
-    // if no success, handle appropriately
-    if (_mem_add_to_gap_ix(new_pool_mgr, to_delete->alloc_record.size, to_delete) != ALLOC_OK)
-    {
-        return ALLOC_FAIL;
-    }
-    else
-    {
-        return ALLOC_OK;
-    }
+    return ALLOC_OK;
 }
 
 
-/*================================================= (void) mem_inspect_pool function ==================================================*/
-void mem_inspect_pool(pool_pt pool, pool_segment_pt *segments, unsigned *num_segments)
+// write() until all of buf is out, retrying on EINTR and short writes
+static alloc_status _mem_write_all(int fd, const void *buf, size_t len)
 {
-    //----------------------------------------------------------------
-    // Instructor comments
-    //----------------------------------------------------------------
-    // get the mgr from the pool
-    // allocate the segments array with size == used_nodes
-    // check successful
-    // loop through the node heap and the segments array
-    //    for each node, write the size and allocated in the segment
-    // "return" the values:
-    /*
-                    *segments = segs;
-                    *num_segments = pool_mgr->used_nodes;
-    */
-    //----------------------------------------------------------------
-
-    const pool_mgr_pt new_pool_mgr = (pool_mgr_pt) pool;                                     // get mgr from pool by casting the pointer to (pool_mgr_pt)
-    const pool_segment_pt segs = malloc(sizeof(pool_segment_t) * new_pool_mgr->used_nodes);  // allocate the segments array with size == used_nodes
-
+    const char *p = buf;
 
-    if (segs != NULL)                                                                        // if the allocation was successful, continue
+    while (len > 0)
     {
-        pool_segment_pt current_seg = segs;
-        node_pt current_node = new_pool_mgr->node_heap;
-
-        int i;
-        for (i = 0; i < new_pool_mgr->used_nodes; i++)
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
         {
-            current_seg->size = current_node->alloc_record.size;
-            current_seg->allocated = current_node->allocated;
-            current_seg += 1;
-            current_node = current_node->next;
+            return ALLOC_FAIL;
         }
+        p += n;
+        len -= (size_t) n;
+    }
 
-        *segments = segs;
-        *num_segments = new_pool_mgr->used_nodes;
+    return ALLOC_OK;
+}
 
-        return;                                                                               // "return" the updated values
-    }
-    else if (segs == NULL)                                                                    // if the allocation was not successful, just do a return
+
+// length of the packed segment stream
+static size_t _mem_stream_size(pool_mgr_pt pool_mgr)
+{
+    uint8_t packed[POOL_SEGMENT_PACKED_MAX];
+    size_t size = 0;
+
+    node_pt current_node;
+    for (current_node = pool_mgr->list_head; current_node != NULL; current_node = current_node->next)
     {
-        return;
+        size += _mem_pack_segment(packed, _mem_segment_size(current_node), current_node->allocated);
     }
-}
-
 
+    return size;
+}
 
 
-/***********************************/
-/*                                 */
-/* Definitions of static functions */
-/*                                 */
-/***********************************/
-static alloc_status _mem_resize_pool_store()
+// writes the packed segment stream to fd in MEM_SNAPSHOT_BUFFER_SIZE blocks
+static alloc_status _mem_write_segments(pool_mgr_pt pool_mgr, int fd)
 {
-    //-------------------------------------------------------------
-    // Instructor comments
-    //-------------------------------------------------------------
-    // check if necessary
-    /*
-    *           if (((float) pool_store_size / pool_store_capacity)
-    *               > MEM_POOL_STORE_FILL_FACTOR) {...}
-    */
-    // don't forget to update capacity variables
-    //-------------------------------------------------------------
+    uint8_t buf[MEM_SNAPSHOT_BUFFER_SIZE];
+    size_t used = 0;
+    alloc_status status = ALLOC_OK;
 
-    if (pool_store_size == pool_store_capacity)                                             // if they are equal, we need to expand our pool store
+    node_pt current_node = pool_mgr->list_head;
+    while (status == ALLOC_OK && current_node != NULL)
     {
-        pool_store = realloc(pool_store, (pool_store_capacity + MEM_POOL_STORE_INIT_CAPACITY) * sizeof(pool_mgr_pt));
-        if (pool_store == NULL)                                                             // check for realloc success, on error return ALLOC_FAIL
+        used += _mem_pack_segment(buf + used, _mem_segment_size(current_node), current_node->allocated);
+        current_node = current_node->next;
+
+        if (used > MEM_SNAPSHOT_BUFFER_SIZE - POOL_SEGMENT_PACKED_MAX || current_node == NULL)
         {
-            return ALLOC_FAIL;
+            status = _mem_write_all(fd, buf, used);
+            used = 0;
         }
-        pool_store_capacity += MEM_POOL_STORE_INIT_CAPACITY;
-    }
-    else if (pool_store_size != pool_store_capacity)                                        // if they are not equal, no pool store expansion is needed
-    {
-        return ALLOC_OK;
     }
+
+    return status;
 }
 
 
-static alloc_status _mem_resize_node_heap(pool_mgr_pt pool_mgr)
+// packs the segment stream into out, which holds _mem_stream_size bytes
+static void _mem_pack_segments(pool_mgr_pt pool_mgr, uint8_t *out)
 {
-    //-------------------------------------------------------------
-    // Instructor comments
-    //-------------------------------------------------------------
-    // check if necessary
-    /*
-    *           if (((float) pool_store_size / pool_store_capacity)
-    *               > MEM_POOL_STORE_FILL_FACTOR) {...}
-    */
-    // don't forget to update capacity variables
-    //-------------------------------------------------------------
-
-    if (((float)pool_mgr->used_nodes / pool_mgr->total_nodes) > MEM_NODE_HEAP_FILL_FACTOR)
+    node_pt current_node;
+    for (current_node = pool_mgr->list_head; current_node != NULL; current_node = current_node->next)
     {
-        int new_node_count = pool_mgr->total_nodes * MEM_NODE_HEAP_EXPAND_FACTOR;
-        int new_heap_size = new_node_count * sizeof(node_t);
+        out += _mem_pack_segment(out, _mem_segment_size(current_node), current_node->allocated);
+    }
+}
 
-        node_pt new_node_heap = (node_pt)malloc(new_heap_size);
 
-        if (new_node_heap != NULL)
+// rebuilds the segment list of a freshly opened pool (a single gap) from
+// a packed segment stream, as written by _mem_write_segments; the gap
+// index is sorted once at the end rather than on every insert
+static alloc_status _mem_restore_segments(pool_mgr_pt pool_mgr, const uint8_t *stream, size_t len)
+{
+    node_pt first = pool_mgr->list_head;
+    _mem_remove_from_gap_ix(pool_mgr, first->alloc_record.size, first);
+    _mem_push_free_nodes(pool_mgr, first, 1);
+    pool_mgr->list_head = NULL;
+    pool_mgr->used_nodes = 0;
+
+    pool_segment_t segment;
+    node_pt tail = NULL;
+    size_t offset = 0;
+    size_t pos = 0;
+
+    while (mem_segment_unpack(stream, len, &pos, &segment))
+    {
+        if (segment.size > pool_mgr->pool.total_size - offset
+            || _mem_resize_node_heap(pool_mgr) != ALLOC_OK || pool_mgr->free_nodes == NULL
+            || (!segment.allocated && _mem_resize_gap_ix(pool_mgr) != ALLOC_OK))
         {
-            pool_mgr->total_nodes += new_node_count;                                        // update the total number nodes
+            return ALLOC_FAIL;
+        }
 
-            // link the chunk of nodes we're adding to the old list
-            node_pt last_node = pool_mgr->node_heap;
-            node_pt node;
-            for (node = pool_mgr->node_heap; node->next != NULL; node = node->next)
-            {
-                last_node = node;
-            }
-            last_node->next = new_node_heap;
+        node_pt node = pool_mgr->free_nodes;
+        pool_mgr->free_nodes = node->next;
 
-            // initialize the new nodes and link them together
-            node_pt prev_node = NULL;
-            node_pt this_node = new_node_heap;
+        node->used = 1;
+        node->allocated = segment.allocated ? 1 : 0;
+        node->alloc_record.mem = pool_mgr->pool.mem + offset;
+        node->alloc_record.size = segment.size;
+        node->prev = tail;
+        node->next = NULL;
+        if (tail != NULL)
+        {
+            tail->next = node;
+        }
+        else
+        {
+            pool_mgr->list_head = node;
+        }
+        tail = node;
+        pool_mgr->used_nodes += 1;
+        offset += segment.size;
 
-            int i;
-            for (i = 0; i < new_node_count; i++)
-            {
-                this_node->used = 1;
-                this_node->allocated = 0;
-                this_node->alloc_record.size = 0;
-                this_node->alloc_record.mem = 0;
-                if (prev_node != NULL)
-                {
-                    prev_node->next = this_node;
-                    this_node->prev = prev_node;
-                }
-                prev_node = this_node;
-                this_node += 1;
-            }
+        if (node->allocated)
+        {
+            pool_mgr->pool.num_allocs += 1;
+            pool_mgr->pool.alloc_size += segment.size;
         }
         else
         {
-            return ALLOC_FAIL;
+            pool_mgr->gap_ix[pool_mgr->pool.num_gaps].size = segment.size;
+            pool_mgr->gap_ix[pool_mgr->pool.num_gaps].node = node;
+            pool_mgr->pool.num_gaps += 1;
+            _mem_track_gap(pool_mgr, segment.size, +1);
         }
     }
+
+    if (pos != len || offset != pool_mgr->pool.total_size || pool_mgr->list_head == NULL)
+    {
+        return ALLOC_FAIL;
+    }
+
+    qsort(pool_mgr->gap_ix, pool_mgr->pool.num_gaps, sizeof(gap_t), _mem_compare_gaps);
+
     return ALLOC_OK;
 }
 
 
-static alloc_status _mem_resize_gap_ix(pool_mgr_pt pool_mgr)
+// gap index order: by size, ties by address (as _mem_sort_gap_ix keeps it)
+static int _mem_compare_gaps(const void *a, const void *b)
 {
-    //-------------------------------------------------------------
-    // Instructor comments
-    //-------------------------------------------------------------
-    // check if necessary
-    /*
-    *           if (((float) pool_store_size / pool_store_capacity)
-    *               > MEM_POOL_STORE_FILL_FACTOR) {...}
-    */
-    // don't forget to update capacity variables
-    //-------------------------------------------------------------
-
-    if (pool_mgr->pool.num_gaps / pool_mgr->gap_ix_capacity > MEM_GAP_IX_FILL_FACTOR)
-    {
-        // reallocate/resize gap index
-        pool_mgr->gap_ix = realloc(pool_mgr->gap_ix, sizeof(pool_mgr->gap_ix) * MEM_GAP_IX_EXPAND_FACTOR);
+    const gap_t *x = a;
+    const gap_t *y = b;
 
-        // update the gap capacity
-        pool_mgr->gap_ix_capacity = pool_mgr->gap_ix_capacity * MEM_GAP_IX_EXPAND_FACTOR;
-
-        return ALLOC_OK;
-    }
-    else
+    if (x->size != y->size)
     {
-        return ALLOC_FAIL;
+        return (x->size < y->size) ? -1 : 1;
     }
+
+    return (x->node->alloc_record.mem > y->node->alloc_record.mem) - (x->node->alloc_record.mem < y->node->alloc_record.mem);
 }
 
 
-static alloc_status _mem_add_to_gap_ix(pool_mgr_pt pool_mgr, size_t size,node_pt node)
+// writes the segment stream after the pool memory, then marks the file
+// clean; the header is only synced once the data and stream are on disk,
+// so a crash part way leaves the file dirty rather than inconsistent
+static alloc_status _mem_persist_file(pool_mgr_pt pool_mgr)
 {
-    //-------------------------------------------------------
-    // Instructor comments
-    //-------------------------------------------------------
-    // expand the gap index, if necessary (call the function)
-    // add the entry at the end
-    // update metadata (num_gaps)
-    // sort the gap index (call the function)
-    // check success
-    //-------------------------------------------------------
+    mem_file_header_t *header = (mem_file_header_t *) pool_mgr->map;
+    off_t stream_offset = (off_t) (MEM_FILE_HEADER_SIZE + pool_mgr->pool.total_size);
+    size_t stream_size = _mem_stream_size(pool_mgr);
 
-    // expand the gap index, if necessary (call the function)
-    _mem_resize_gap_ix(pool_mgr);
+    MEM_MARK(pool_mgr, pool_mgr->pool.mem, pool_mgr->pool.total_size, MEM_SHADOW_DEFINED);  // msync() reads the gaps too
 
-    // add the entry at the end
-    int i = 0;
-    while (pool_mgr->gap_ix[i].node != NULL)
+    if (ftruncate(pool_mgr->fd, stream_offset + (off_t) stream_size) != 0
+        || lseek(pool_mgr->fd, stream_offset, SEEK_SET) != stream_offset
+        || _mem_write_segments(pool_mgr, pool_mgr->fd) != ALLOC_OK
+        || msync(pool_mgr->map, pool_mgr->map_size, MS_SYNC) != 0
+        || fsync(pool_mgr->fd) != 0)
     {
-        i += 1;
+        MEM_MARK_GAPS(pool_mgr);
+        return ALLOC_FAIL;
     }
 
-    pool_mgr->gap_ix[i].node = node;
-    pool_mgr->gap_ix[i].size = size;
+    header->policy = pool_mgr->pool.policy;
+    header->stream_size = stream_size;
+    header->num_segments = pool_mgr->used_nodes;
+    header->state = MEM_FILE_CLEAN;
 
-    // update number of gaps
-    pool_mgr->pool.num_gaps++;
+    return (msync(pool_mgr->map, MEM_FILE_HEADER_SIZE, MS_SYNC) == 0) ? ALLOC_OK : ALLOC_FAIL;
+}
 
-    // sort the gap index
-    if (pool_mgr->gap_ix[i].node != NULL)
+
+#if defined(MEM_POOL_ASAN) || defined(MEM_POOL_VALGRIND)
+// tells the sanitizers about a range of pool.mem; shared pools are left
+// alone, as one process's shadow memory knows nothing of the others'
+// allocations, and so are guarded pools, which read their own redzones
+// and free memory
+static void _mem_mark(pool_mgr_pt pool_mgr, const char *addr, size_t size, mem_shadow state)
+{
+    if (pool_mgr->backing == MEM_BACKING_SHARED || (pool_mgr->flags & POOL_DEBUG_GUARDS) || size == 0)
     {
-        _mem_sort_gap_ix(pool_mgr);
-        return ALLOC_OK;
+        return;
+    }
+
+#ifdef MEM_POOL_ASAN
+    if (state == MEM_SHADOW_NOACCESS)
+    {
+        ASAN_POISON_MEMORY_REGION(addr, size);
     }
     else
     {
-        return ALLOC_FAIL;
+        ASAN_UNPOISON_MEMORY_REGION(addr, size);
     }
+#endif
+
+#ifdef MEM_POOL_VALGRIND
+    switch (state)
+    {
+        case MEM_SHADOW_NOACCESS:
+            VALGRIND_MAKE_MEM_NOACCESS(addr, size);
+            break;
+        case MEM_SHADOW_UNDEFINED:
+            VALGRIND_MAKE_MEM_UNDEFINED(addr, size);
+            break;
+        case MEM_SHADOW_DEFINED:
+            VALGRIND_MAKE_MEM_DEFINED(addr, size);
+            break;
+    }
+#endif
 }
 
 
-static alloc_status _mem_remove_from_gap_ix(pool_mgr_pt pool_mgr, size_t size, node_pt node)
+// marks every gap (deferred ones included) inaccessible and every
+// allocation as holding defined data
+static void _mem_mark_gaps(pool_mgr_pt pool_mgr)
 {
-    //-------------------------------------------------------
-    // Instructor comments
-    //-------------------------------------------------------
-    // find the position of the node in the gap index
-    // loop from there to the end of the array:
-    //    pull the entries (i.e. copy over) one position up
-    //    this effectively deletes the chosen node
-    // update metadata (num_gaps)
-    // zero out the element at position num_gaps!
-    //-------------------------------------------------------
+    node_pt node;
+    for (node = pool_mgr->list_head; node != NULL; node = node->next)
+    {
+        _mem_mark(pool_mgr, node->alloc_record.mem, node->alloc_record.size,
+                  node->allocated ? MEM_SHADOW_DEFINED : MEM_SHADOW_NOACCESS);
+    }
+}
+#endif
 
-    int i = 0;
-    if (i == 0)
+
+#ifdef MEM_POOL_METRICS
+
+
+// HDR-style log-linear bucketing: values below POOL_LATENCY_SUB_BUCKETS
+// get a bucket each, every power of two above that is split into
+// POOL_LATENCY_SUB_BUCKETS linear sub-buckets
+static unsigned _mem_hist_bucket(unsigned long long value)
+{
+    if (value < POOL_LATENCY_SUB_BUCKETS)
     {
-        while (pool_mgr->gap_ix[i].node != node)
-        {
-            i += 1;
-        }
+        return (unsigned) value;
     }
 
-    pool_mgr->gap_ix[i].size = 0;
-    pool_mgr->gap_ix[i].node = NULL;
-    pool_mgr->pool.num_gaps--;
+    unsigned shift = 0;
+    while ((value >> shift) >= 2 * POOL_LATENCY_SUB_BUCKETS)
+    {
+        shift += 1;
+    }
 
-    return ALLOC_OK;
+    unsigned bucket = POOL_LATENCY_SUB_BUCKETS * (shift + 1) + (unsigned) (value >> shift) - POOL_LATENCY_SUB_BUCKETS;
+
+    return (bucket < POOL_LATENCY_BUCKETS) ? bucket : POOL_LATENCY_BUCKETS - 1;
 }
 
 
-// note: only called by _mem_add_to_gap_ix, which appends a single entry
-static alloc_status _mem_sort_gap_ix(pool_mgr_pt pool_mgr)
+static void _mem_hist_record(latency_hist_pt hist, unsigned long long value)
 {
-    //----------------------------------------------------------------------
-    // Instructor comments
-    //----------------------------------------------------------------------
-    // the new entry is at the end, so "bubble it up"
-    // loop from num_gaps - 1 until but not including 0:
-    //    if the size of the current entry is less than the previous (u - 1)
-    //       swap them (by copying) (remember to use a temporary variable)
-    //----------------------------------------------------------------------
+    hist->buckets[_mem_hist_bucket(value)] += 1;
+    hist->count += 1;
+    if (value > hist->max_ns)
+    {
+        hist->max_ns = value;
+    }
+}
 
-    int i = pool_mgr->pool.num_gaps - 1;
 
-    for (i; i >= 0; i--)
+static void _mem_hist_add(latency_hist_pt sum, const latency_hist_t *hist)
+{
+    unsigned bucket;
+    for (bucket = 0; bucket < POOL_LATENCY_BUCKETS; bucket++)
     {
-        if (pool_mgr->gap_ix[i].size < pool_mgr->gap_ix[i+1].size)
-        {
-            gap_t temp = pool_mgr->gap_ix[i];
-            pool_mgr->gap_ix[i] = pool_mgr->gap_ix[i + 1];
-            pool_mgr->gap_ix[i + 1] = temp;
-        }
+        sum->buckets[bucket] += hist->buckets[bucket];
+    }
+    sum->count += hist->count;
+    if (hist->max_ns > sum->max_ns)
+    {
+        sum->max_ns = hist->max_ns;
     }
+}
 
-    return ALLOC_OK;
-}
\ No newline at end of file
+
+static void _mem_metrics_add(pool_metrics_pt sum, const pool_metrics_t *metrics)
+{
+    sum->alloc_calls += metrics->alloc_calls;
+    sum->alloc_failures += metrics->alloc_failures;
+    sum->alloc_quick_hits += metrics->alloc_quick_hits;
+    sum->alloc_searches += metrics->alloc_searches;
+    sum->alloc_probes += metrics->alloc_probes;
+    sum->del_calls += metrics->del_calls;
+    sum->del_failures += metrics->del_failures;
+    sum->coalesces += metrics->coalesces;
+    sum->node_heap_resizes += metrics->node_heap_resizes;
+    sum->gap_ix_resizes += metrics->gap_ix_resizes;
+    sum->gap_ix_sort_swaps += metrics->gap_ix_sort_swaps;
+    sum->open_calls += metrics->open_calls;
+    sum->open_failures += metrics->open_failures;
+    sum->close_calls += metrics->close_calls;
+    sum->close_failures += metrics->close_failures;
+
+    _mem_hist_add(&sum->alloc_latency, &metrics->alloc_latency);
+    _mem_hist_add(&sum->del_latency, &metrics->del_latency);
+    _mem_hist_add(&sum->open_latency, &metrics->open_latency);
+    _mem_hist_add(&sum->close_latency, &metrics->close_latency);
+    _mem_hist_add(&sum->search_latency, &metrics->search_latency);
+    _mem_hist_add(&sum->sort_latency, &metrics->sort_latency);
+    _mem_hist_add(&sum->resize_latency, &metrics->resize_latency);
+}
+#endif
@@ -6,11 +6,21 @@
 #define DENVER_OS_PA_C_MEM_POOL_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 /* type declarations */
 
 typedef enum _alloc_policy { FIRST_FIT, BEST_FIT } alloc_policy;
 
+typedef enum _pool_flags {
+    POOL_DEFAULT             = 0,
+    POOL_DEFERRED_COALESCING = 1 << 0, // free to per-size quick lists, coalesce lazily
+    POOL_THREAD_SAFE         = 1 << 1, // serialize all calls on a per-pool lock
+    POOL_DEBUG_GUARDS        = 1 << 2, // redzones, poisoning and a quarantine, to catch stray writes
+    POOL_LEAK_TRACKING       = 1 << 3, // record when and where each allocation was made, for leak reports
+    POOL_SINGLE_BLOCK        = 1 << 4  // manager, initial metadata and pool memory in one malloc() (mem_pool_open_ex only)
+} pool_flags;
+
 typedef struct _pool {
     char *mem;
     alloc_policy policy;
@@ -25,16 +35,136 @@ typedef struct _alloc {
     char *mem;
 } alloc_t, *alloc_pt;
 
+// called by mem_pool_compact and the background compactor after each move,
+// with the pool lock held: it must not call mem_* on the same pool, which
+// would deadlock a POOL_THREAD_SAFE pool (and corrupt any other)
+typedef void (*alloc_move_callback)(pool_pt pool, alloc_pt alloc, char *old_mem);
+
 typedef struct _pool_segment {
     size_t size;
     unsigned long allocated; // 1-allocation, 0-gap (note: 8 bytes)
 } pool_segment_t, *pool_segment_pt;
 
+// packed inspection: one LEB128 varint of (size << 1 | allocated) per segment
+#define POOL_SEGMENT_PACKED_MAX 10 // bytes, for a 64-bit size
+
+#define POOL_SET_MAX_POOLS 64
+
+// one pool per NUMA node, see mem_pool_set_open_numa()
+typedef struct _pool_set {
+    unsigned num_pools;
+    pool_pt pools[POOL_SET_MAX_POOLS]; // pools[i] - on node i
+} pool_set_t, *pool_set_pt;
+
+typedef struct _pool_iter {
+    const void *cursor; // next segment to visit, NULL at the end
+} pool_iter_t, *pool_iter_pt;
+
+#define POOL_STATS_SIZE_CLASSES 48 // size class i: gaps of [2^i, 2^(i+1)) bytes
+
+typedef struct _pool_stats {
+    size_t largest_gap;
+    size_t free_bytes;
+    double ext_fragmentation; // 1 - largest_gap / free_bytes
+    unsigned gap_hist[POOL_STATS_SIZE_CLASSES]; // number of gaps per size class
+    size_t gap_hist_bytes[POOL_STATS_SIZE_CLASSES]; // free bytes per size class
+    unsigned used_nodes;
+    unsigned total_nodes;
+    double node_heap_occupancy; // used_nodes / total_nodes
+    unsigned gap_ix_size;
+    unsigned gap_ix_capacity;
+    double gap_ix_occupancy; // gap_ix_size / gap_ix_capacity
+} pool_stats_t, *pool_stats_pt;
+
+#define POOL_LATENCY_SUB_BUCKETS 8 // linear sub-buckets per power of two (~12% precision)
+#define POOL_LATENCY_BUCKETS 304 // covers 0 ns to 2^40 ns, the last bucket takes the rest
+
+typedef struct _latency_hist {
+    unsigned long long count;
+    unsigned long long max_ns;
+    unsigned long long buckets[POOL_LATENCY_BUCKETS];
+} latency_hist_t, *latency_hist_pt;
+
+// only collected when the library is built with MEM_POOL_METRICS
+typedef struct _pool_metrics {
+    unsigned long long alloc_calls;
+    unsigned long long alloc_failures;
+    unsigned long long alloc_quick_hits; // served from a quick list, no search
+    unsigned long long alloc_searches;
+    unsigned long long alloc_probes; // nodes or gap index entries examined by all searches
+    unsigned long long del_calls;
+    unsigned long long del_failures;
+    unsigned long long coalesces;
+    unsigned long long node_heap_resizes;
+    unsigned long long gap_ix_resizes;
+    unsigned long long gap_ix_sort_swaps;
+    unsigned long long open_calls;
+    unsigned long long open_failures;
+    unsigned long long close_calls;
+    unsigned long long close_failures;
+    latency_hist_t alloc_latency;
+    latency_hist_t del_latency;
+    latency_hist_t open_latency;
+    latency_hist_t close_latency;
+    latency_hist_t search_latency; // gap search inside mem_new_alloc
+    latency_hist_t sort_latency; // gap index re-sort
+    latency_hist_t resize_latency; // node heap resize
+} pool_metrics_t, *pool_metrics_pt;
+
+#define MEM_TRACE_MAGIC 0x5254504dU // "MPTR"
+#define MEM_TRACE_VERSION 1
+#define MEM_TRACE_NO_OFFSET UINT64_MAX // the allocation (or open) failed
+
+typedef enum _mem_trace_op {
+    MEM_TRACE_OPEN = 1, // size - pool size
+    MEM_TRACE_ALLOC,    // size - requested, offset - of the allocation in pool.mem
+    MEM_TRACE_FREE,     // size and offset of the freed allocation
+    MEM_TRACE_MOVE,     // size - old offset, offset - new offset (compaction)
+    MEM_TRACE_CLOSE
+} mem_trace_op;
+
+typedef struct _mem_trace_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+} mem_trace_header_t;
+
+typedef struct _mem_trace_record {
+    uint8_t op;
+    uint8_t policy;
+    uint16_t reserved;
+    uint32_t pool_id;
+    uint64_t size;
+    uint64_t offset;
+    uint64_t timestamp_ns; // CLOCK_MONOTONIC
+} mem_trace_record_t;
+
+#define MEM_SNAPSHOT_MAGIC 0x4e53504dU // "MPSN"
+#define MEM_SNAPSHOT_VERSION 1
+
+// followed by stream_size bytes of packed segments (see POOL_SEGMENT_PACKED_MAX)
+typedef struct _mem_snapshot_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size; // later versions may append fields, readers skip to header_size
+    uint32_t policy;
+    uint32_t flags;
+    uint32_t reserved;
+    uint64_t total_size;
+    uint64_t alloc_size;
+    uint64_t num_allocs;
+    uint64_t num_gaps;
+    uint64_t num_segments;
+    uint64_t stream_size;
+    uint64_t timestamp_ns; // CLOCK_REALTIME
+} mem_snapshot_header_t;
+
 typedef enum _alloc_status {
     ALLOC_OK,
     ALLOC_FAIL,
     ALLOC_CALLED_AGAIN,
-    ALLOC_NOT_FREED
+    ALLOC_NOT_FREED,
+    ALLOC_CORRUPTED // POOL_DEBUG_GUARDS: done, but a redzone or freed memory had been written to
 } alloc_status;
 
 /* function declarations */
@@ -48,6 +178,36 @@ mem_free();
 pool_pt
 mem_pool_open(size_t size, alloc_policy policy);
 
+pool_pt
+mem_pool_open_ex(size_t size, alloc_policy policy, unsigned flags);
+
+pool_pt
+mem_pool_open_in(void *buf, size_t size, alloc_policy policy);
+
+pool_pt
+mem_pool_open_file(const char *path, size_t size, alloc_policy policy);
+
+pool_pt
+mem_pool_open_shared(const char *name, size_t size, alloc_policy policy);
+
+pool_pt
+mem_pool_open_numa(size_t size, alloc_policy policy, unsigned flags, int node);
+
+alloc_status
+mem_pool_set_open_numa(pool_set_pt set, size_t size_per_node, alloc_policy policy, unsigned flags);
+
+alloc_pt
+mem_pool_set_alloc(pool_set_pt set, size_t size);
+
+alloc_status
+mem_pool_set_del_alloc(pool_set_pt set, alloc_pt alloc);
+
+alloc_status
+mem_pool_set_close(pool_set_pt set);
+
+alloc_pt
+mem_find_alloc(pool_pt pool, const char *mem);
+
 alloc_status
 mem_pool_close(pool_pt pool);
 
@@ -57,7 +217,77 @@ mem_new_alloc(pool_pt pool, size_t size);
 alloc_status
 mem_del_alloc(pool_pt pool, alloc_pt alloc);
 
+alloc_status
+mem_pool_consolidate(pool_pt pool);
+
+alloc_status
+mem_pool_check_guards(pool_pt pool);
+
+alloc_status
+mem_pool_compact(pool_pt pool, alloc_move_callback move_callback);
+
+alloc_status
+mem_pool_start_compactor(pool_pt pool, unsigned segments_per_step, unsigned step_interval_us,
+                         alloc_move_callback move_callback);
+
+alloc_status
+mem_pool_stop_compactor(pool_pt pool);
+
+alloc_status
+mem_pin_alloc(pool_pt pool, alloc_pt alloc);
+
+alloc_status
+mem_unpin_alloc(pool_pt pool, alloc_pt alloc);
+
+alloc_status
+mem_pool_stats(pool_pt pool, pool_stats_pt stats);
+
+alloc_status
+mem_pool_metrics(pool_pt pool, pool_metrics_pt metrics);
+
+unsigned long long
+mem_latency_percentile(const latency_hist_t *hist, double percentile);
+
+alloc_status
+mem_trace_start(const char *path);
+
+alloc_status
+mem_trace_stop();
+
+alloc_status
+mem_profile_start(size_t sample_bytes);
+
+alloc_status
+mem_profile_stop();
+
+alloc_status
+mem_profile_dump(int fd);
+
 void
 mem_inspect_pool(pool_pt pool, pool_segment_pt *segments, unsigned *num_segments);
 
+alloc_status
+mem_inspect_pool_into(pool_pt pool, pool_segment_pt buf, unsigned cap, unsigned *num_segments);
+
+alloc_status
+mem_pool_iter_begin(pool_pt pool, pool_iter_pt iter);
+
+int
+mem_pool_iter_next(pool_iter_pt iter, pool_segment_pt segment);
+
+alloc_status
+mem_inspect_pool_packed(pool_pt pool, uint8_t *buf, size_t cap, size_t *len);
+
+int
+mem_segment_unpack(const uint8_t *buf, size_t len, size_t *pos, pool_segment_pt segment);
+
+alloc_status
+mem_pool_snapshot(pool_pt pool, int fd);
+
+alloc_status
+mem_pool_leak_report(pool_pt pool, int fd);
+
+alloc_status
+mem_set_leak_report_fd(int fd);
+
 #endif //DENVER_OS_PA_C_MEM_POOL_H
@@ -0,0 +1,472 @@
+// Loads a pool snapshot written with mem_pool_snapshot() and reports its
+// fragmentation, the size distributions of allocations and gaps, and how
+// each allocation policy would fare placing more requests into its gaps.
+//
+// usage: mem_pool_analyze [-n requests] <snapshot file> ...
+//
+// The what-if replays the snapshot's own allocation sizes, in address order
+// and wrapping around, into its gaps until the first request that does not
+// fit (or -n requests, 100000 by default), once first-fit and once best-fit.
+// First-fit keeps the gaps in address order under a max tree; best-fit only
+// depends on the gap sizes, so it keeps them sorted by size.
+
+#define _POSIX_C_SOURCE 200809L // for getopt() under -std=c11
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mem_pool.h"
+
+/*************/
+/*           */
+/* Constants */
+/*           */
+/*************/
+static const unsigned long  ANALYZE_DEFAULT_REQUESTS    = 100000;
+static const size_t         ANALYZE_MAX_HEADER_SIZE     = 4096; // sanity bound on header_size
+
+
+
+/*********************/
+/*                   */
+/* Type declarations */
+/*                   */
+/*********************/
+typedef struct _snapshot {
+    mem_snapshot_header_t header;
+    pool_segment_pt segments;
+    size_t num_segments;
+} snapshot_t, *snapshot_pt;
+
+typedef struct _whatif_result {
+    unsigned long placed;
+    unsigned long long placed_bytes;
+    size_t failed_size; // 0 - the request budget ran out first
+    unsigned long long free_bytes;
+    size_t largest_gap;
+} whatif_result_t, *whatif_result_pt;
+
+
+
+/********************************************/
+/*                                          */
+/* Forward declarations of static functions */
+/*                                          */
+/********************************************/
+static int load_snapshot(const char *path, snapshot_pt snapshot);
+static void report(const char *path, const snapshot_t *snapshot, unsigned long max_requests);
+static void print_histogram(const char *title, const unsigned long *count, const unsigned long long *bytes);
+static void whatif_first_fit(const snapshot_t *snapshot, unsigned long max_requests, whatif_result_pt result);
+static void whatif_best_fit(const snapshot_t *snapshot, unsigned long max_requests, whatif_result_pt result);
+static size_t next_request(const snapshot_t *snapshot, size_t *cursor);
+static unsigned size_class(size_t size);
+static int compare_size(const void *a, const void *b);
+
+
+
+/********/
+/*      */
+/* Main */
+/*      */
+/********/
+int main(int argc, char *argv[])
+{
+    unsigned long max_requests = ANALYZE_DEFAULT_REQUESTS;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n':
+                max_requests = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n requests] <snapshot file> ...\n", argv[0]);
+                return 2;
+        }
+    }
+
+    if (optind >= argc)
+    {
+        fprintf(stderr, "usage: %s [-n requests] <snapshot file> ...\n", argv[0]);
+        return 2;
+    }
+
+    int status = 0;
+    int i;
+    for (i = optind; i < argc; i++)
+    {
+        snapshot_t snapshot;
+        if (load_snapshot(argv[i], &snapshot) != 0)
+        {
+            status = 1;
+            continue;
+        }
+
+        report(argv[i], &snapshot, max_requests);
+        free(snapshot.segments);
+    }
+
+    return status;
+}
+
+
+
+/***********************************/
+/*                                 */
+/* Definitions of static functions */
+/*                                 */
+/***********************************/
+// reads the header and decodes the packed segment stream, 0 on success
+static int load_snapshot(const char *path, snapshot_pt snapshot)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    memset(snapshot, 0, sizeof(*snapshot));
+    mem_snapshot_header_t *header = &snapshot->header;
+
+    // version 1 is the smallest header; anything past sizeof(*header) is
+    // from a later version and is skipped
+    if (fread(header, sizeof(*header), 1, file) != 1
+        || header->magic != MEM_SNAPSHOT_MAGIC
+        || header->version < 1
+        || header->header_size < sizeof(*header)
+        || header->header_size > ANALYZE_MAX_HEADER_SIZE
+        || fseek(file, (long) header->header_size, SEEK_SET) != 0)
+    {
+        fprintf(stderr, "%s: not a pool snapshot\n", path);
+        fclose(file);
+        return -1;
+    }
+
+    uint8_t *stream = malloc(header->stream_size > 0 ? header->stream_size : 1);
+    snapshot->segments = calloc(header->num_segments > 0 ? header->num_segments : 1, sizeof(pool_segment_t));
+    if (stream == NULL || snapshot->segments == NULL
+        || fread(stream, 1, header->stream_size, file) != header->stream_size)
+    {
+        fprintf(stderr, "%s: truncated snapshot\n", path);
+        free(stream);
+        free(snapshot->segments);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+
+    size_t pos = 0;
+    while (snapshot->num_segments < header->num_segments
+           && mem_segment_unpack(stream, header->stream_size, &pos, &snapshot->segments[snapshot->num_segments]))
+    {
+        snapshot->num_segments += 1;
+    }
+    free(stream);
+
+    if (snapshot->num_segments != header->num_segments || pos != header->stream_size)
+    {
+        fprintf(stderr, "%s: corrupt segment stream\n", path);
+        free(snapshot->segments);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static void report(const char *path, const snapshot_t *snapshot, unsigned long max_requests)
+{
+    const mem_snapshot_header_t *header = &snapshot->header;
+    unsigned long alloc_count[POOL_STATS_SIZE_CLASSES] = {0};
+    unsigned long long alloc_bytes[POOL_STATS_SIZE_CLASSES] = {0};
+    unsigned long gap_count[POOL_STATS_SIZE_CLASSES] = {0};
+    unsigned long long gap_bytes[POOL_STATS_SIZE_CLASSES] = {0};
+    unsigned long num_allocs = 0;
+    unsigned long num_gaps = 0;
+    unsigned long long used_bytes = 0;
+    unsigned long long free_bytes = 0;
+    size_t largest_gap = 0;
+
+    size_t i;
+    for (i = 0; i < snapshot->num_segments; i++)
+    {
+        const pool_segment_t *segment = &snapshot->segments[i];
+        unsigned c = size_class(segment->size);
+
+        if (segment->allocated)
+        {
+            num_allocs += 1;
+            used_bytes += segment->size;
+            alloc_count[c] += 1;
+            alloc_bytes[c] += segment->size;
+        }
+        else
+        {
+            num_gaps += 1;
+            free_bytes += segment->size;
+            gap_count[c] += 1;
+            gap_bytes[c] += segment->size;
+            if (segment->size > largest_gap)
+            {
+                largest_gap = segment->size;
+            }
+        }
+    }
+
+    double fragmentation = (free_bytes > 0) ? 1.0 - (double) largest_gap / (double) free_bytes : 0.0;
+
+    printf("%s: version %u, policy %s, flags 0x%x\n", path, header->version,
+           (header->policy == BEST_FIT) ? "best" : "first", header->flags);
+    printf("  total size      %20llu\n", (unsigned long long) header->total_size);
+    printf("  segments        %20zu\n", snapshot->num_segments);
+    printf("  allocations     %20lu (%llu bytes, mean %.1f)\n", num_allocs, used_bytes,
+           num_allocs ? (double) used_bytes / num_allocs : 0.0);
+    printf("  gaps            %20lu (%llu bytes, mean %.1f)\n", num_gaps, free_bytes,
+           num_gaps ? (double) free_bytes / num_gaps : 0.0);
+    printf("  largest gap     %20zu\n", largest_gap);
+    printf("  fragmentation   %20.6f\n", fragmentation);
+    if (num_allocs != header->num_allocs || num_gaps != header->num_gaps
+        || used_bytes != header->alloc_size || used_bytes + free_bytes != header->total_size)
+    {
+        printf("  warning: segments disagree with the recorded pool counters\n");
+    }
+
+    print_histogram("allocation sizes", alloc_count, alloc_bytes);
+    print_histogram("gap sizes", gap_count, gap_bytes);
+
+    if (num_allocs == 0)
+    {
+        printf("  what-if: no allocations to replay\n\n");
+        return;
+    }
+
+    whatif_result_t results[2];
+    whatif_first_fit(snapshot, max_requests, &results[0]);
+    whatif_best_fit(snapshot, max_requests, &results[1]);
+
+    printf("  what-if, replaying allocation sizes into the gaps (up to %lu requests):\n", max_requests);
+    printf("    %-8s %12s %16s %12s %16s %12s %10s\n",
+           "policy", "placed", "placed_bytes", "failed_at", "free_after", "largest", "frag");
+    for (i = 0; i < 2; i++)
+    {
+        const whatif_result_t *r = &results[i];
+        double frag = (r->free_bytes > 0) ? 1.0 - (double) r->largest_gap / (double) r->free_bytes : 0.0;
+
+        printf("    %-8s %12lu %16llu %12zu %16llu %12zu %10.6f\n", (i == 0) ? "first" : "best",
+               r->placed, r->placed_bytes, r->failed_size, r->free_bytes, r->largest_gap, frag);
+    }
+    printf("\n");
+}
+
+
+// one line per non-empty power-of-two size class, as in pool_stats_t
+static void print_histogram(const char *title, const unsigned long *count, const unsigned long long *bytes)
+{
+    printf("  %s:\n", title);
+
+    unsigned c;
+    for (c = 0; c < POOL_STATS_SIZE_CLASSES; c++)
+    {
+        if (count[c] > 0)
+        {
+            printf("    [2^%-2u, 2^%-2u) %12lu %20llu\n", c, c + 1, count[c], bytes[c]);
+        }
+    }
+}
+
+
+// first-fit: a max tree over the gaps in address order finds the
+// leftmost gap large enough in O(log gaps)
+static void whatif_first_fit(const snapshot_t *snapshot, unsigned long max_requests, whatif_result_pt result)
+{
+    memset(result, 0, sizeof(*result));
+
+    size_t num_gaps = 0;
+    size_t i;
+    for (i = 0; i < snapshot->num_segments; i++)
+    {
+        num_gaps += !snapshot->segments[i].allocated;
+    }
+
+    size_t leaves = 1;
+    while (leaves < num_gaps)
+    {
+        leaves *= 2;
+    }
+
+    size_t *tree = calloc(2 * leaves, sizeof(size_t));
+    if (tree == NULL)
+    {
+        return;
+    }
+
+    size_t leaf = leaves;
+    for (i = 0; i < snapshot->num_segments; i++)
+    {
+        if (!snapshot->segments[i].allocated)
+        {
+            tree[leaf++] = snapshot->segments[i].size;
+        }
+    }
+    for (i = leaves - 1; i >= 1; i--)
+    {
+        tree[i] = (tree[2 * i] > tree[2 * i + 1]) ? tree[2 * i] : tree[2 * i + 1];
+    }
+
+    size_t cursor = 0;
+    while (result->placed < max_requests)
+    {
+        size_t size = next_request(snapshot, &cursor);
+        if (tree[1] < size)
+        {
+            result->failed_size = size;
+            break;
+        }
+
+        size_t node = 1;
+        while (node < leaves)
+        {
+            node = (tree[2 * node] >= size) ? 2 * node : 2 * node + 1;
+        }
+
+        tree[node] -= size;
+        for (node /= 2; node >= 1; node /= 2)
+        {
+            tree[node] = (tree[2 * node] > tree[2 * node + 1]) ? tree[2 * node] : tree[2 * node + 1];
+        }
+
+        result->placed += 1;
+        result->placed_bytes += size;
+    }
+
+    result->largest_gap = tree[1];
+    for (i = leaves; i < 2 * leaves; i++)
+    {
+        result->free_bytes += tree[i];
+    }
+
+    free(tree);
+}
+
+
+// best-fit: which gap is picked depends only on the sizes, so the gaps
+// are kept as a sorted array of sizes
+static void whatif_best_fit(const snapshot_t *snapshot, unsigned long max_requests, whatif_result_pt result)
+{
+    memset(result, 0, sizeof(*result));
+
+    size_t num_gaps = 0;
+    size_t *gaps = malloc((snapshot->num_segments > 0 ? snapshot->num_segments : 1) * sizeof(size_t));
+    if (gaps == NULL)
+    {
+        return;
+    }
+
+    size_t i;
+    for (i = 0; i < snapshot->num_segments; i++)
+    {
+        if (!snapshot->segments[i].allocated)
+        {
+            gaps[num_gaps++] = snapshot->segments[i].size;
+        }
+    }
+    qsort(gaps, num_gaps, sizeof(size_t), compare_size);
+
+    size_t cursor = 0;
+    while (result->placed < max_requests)
+    {
+        size_t size = next_request(snapshot, &cursor);
+
+        // lower bound: the smallest gap >= size
+        size_t lo = 0, hi = num_gaps;
+        while (lo < hi)
+        {
+            size_t mid = lo + (hi - lo) / 2;
+            if (gaps[mid] < size)
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+        if (lo == num_gaps)
+        {
+            result->failed_size = size;
+            break;
+        }
+
+        // the remainder can only move down the array, to after the
+        // last gap <= remainder
+        size_t remainder = gaps[lo] - size;
+        size_t to = 0, end = lo;
+        while (to < end)
+        {
+            size_t mid = to + (end - to) / 2;
+            if (gaps[mid] <= remainder)
+            {
+                to = mid + 1;
+            }
+            else
+            {
+                end = mid;
+            }
+        }
+        memmove(&gaps[to + 1], &gaps[to], (lo - to) * sizeof(size_t));
+        gaps[to] = remainder;
+
+        result->placed += 1;
+        result->placed_bytes += size;
+    }
+
+    result->largest_gap = (num_gaps > 0) ? gaps[num_gaps - 1] : 0;
+    for (i = 0; i < num_gaps; i++)
+    {
+        result->free_bytes += gaps[i];
+    }
+
+    free(gaps);
+}
+
+
+// the next allocation size in address order, wrapping around
+static size_t next_request(const snapshot_t *snapshot, size_t *cursor)
+{
+    while (!snapshot->segments[*cursor].allocated)
+    {
+        *cursor = (*cursor + 1) % snapshot->num_segments;
+    }
+
+    size_t size = snapshot->segments[*cursor].size;
+    *cursor = (*cursor + 1) % snapshot->num_segments;
+
+    return size;
+}
+
+
+static unsigned size_class(size_t size)
+{
+    unsigned c = 0;
+    while (size > 1 && c < POOL_STATS_SIZE_CLASSES - 1)
+    {
+        size >>= 1;
+        c += 1;
+    }
+
+    return c;
+}
+
+
+static int compare_size(const void *a, const void *b)
+{
+    size_t x = *(const size_t *) a;
+    size_t y = *(const size_t *) b;
+
+    return (x > y) - (x < y);
+}
@@ -0,0 +1,1009 @@
+// Microbenchmarks the allocation policies on synthetic workloads and reports
+// throughput, per-operation latency percentiles, peak RSS and fragmentation.
+//
+// usage: mem_pool_bench [-c] [-T threads] [-w workload] [-p first|best|malloc] [-n ops] [-l live]
+//                       [-m min size] [-M max size] [-P pools] [-s seed] [-f table|csv|json]
+//
+// workloads: churn  - fixed-size (min size) allocations and frees at random slots
+//            random - random-size allocations and frees at random slots
+//            lifo   - fill all slots, free them newest first, repeat
+//            fifo   - fill all slots, then free the oldest and reallocate it, in a ring
+//            ramp   - fill all slots, free them in random order, repeat
+//            pools  - random churn spread across several pools
+// By default, all workloads are run against both policies. With -c, each workload
+// is also run through malloc()/free(), and the pools are reported relative to it:
+// rel_throughput is ops/sec over malloc's ops/sec. mem_overhead is, for every
+// backend, the RSS the run grew by over the peak number of live requested bytes.
+// An allocator LD_PRELOADed in place of libc's is picked up by the malloc backend.
+// Every run is done in a child process, so that its peak RSS is its own.
+//
+// With -T, the bench measures scaling instead: for 1 .. threads threads (0 - one
+// per online core), every thread runs its own copy of the workload (random by
+// default, pools is not supported) for -n operations, once against a private
+// pool per thread and once against a single POOL_THREAD_SAFE pool shared by all
+// of them. Throughput is reported with the speedup over one thread and the
+// parallel efficiency (speedup / threads).
+
+#define _POSIX_C_SOURCE 200809L // for clock_gettime(), getopt() and fork() under -std=c11
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "mem_pool.h"
+
+/*************/
+/*           */
+/* Constants */
+/*           */
+/*************/
+static const unsigned long  BENCH_DEFAULT_OPS           = 1000000;
+static const unsigned       BENCH_DEFAULT_LIVE          = 1024;
+static const size_t         BENCH_DEFAULT_MIN_SIZE      = 16;
+static const size_t         BENCH_DEFAULT_MAX_SIZE      = 1024;
+static const unsigned       BENCH_DEFAULT_POOLS         = 8;
+static const unsigned       BENCH_DEFAULT_SEED          = 1;
+static const unsigned       BENCH_POOL_SIZE_FACTOR      = 2;        // pool size = factor * live * max size
+
+
+
+/*********************/
+/*                   */
+/* Type declarations */
+/*                   */
+/*********************/
+typedef enum _bench_workload {
+    BENCH_CHURN, BENCH_RANDOM, BENCH_LIFO, BENCH_FIFO, BENCH_RAMP, BENCH_POOLS, BENCH_NUM_WORKLOADS
+} bench_workload;
+
+// the pool policies first, so that they match alloc_policy
+typedef enum _bench_backend { BENCH_FIRST_FIT, BENCH_BEST_FIT, BENCH_MALLOC, BENCH_NUM_BACKENDS } bench_backend;
+
+typedef enum _bench_format { BENCH_TABLE, BENCH_CSV, BENCH_JSON } bench_format;
+
+typedef enum _bench_sharing { BENCH_PRIVATE, BENCH_SHARED } bench_sharing;
+
+typedef struct _bench_config {
+    unsigned long ops;
+    unsigned live;              // slots per pool
+    size_t min_size;
+    size_t max_size;
+    unsigned pools;             // for the pools workload, 1 otherwise
+    unsigned seed;
+} bench_config_t, *bench_config_pt;
+
+// one pre-generated operation: allocate size bytes into an empty slot, or free a full one (size 0)
+typedef struct _bench_op {
+    unsigned slot;
+    unsigned size;
+} bench_op_t, *bench_op_pt;
+
+typedef struct _bench_result {
+    unsigned long long ops;
+    double seconds;
+    unsigned long long alloc_failures;
+    unsigned long long ns_p50;
+    unsigned long long ns_p90;
+    unsigned long long ns_p99;
+    unsigned long long ns_max;
+    double mean_fragmentation;
+    double max_fragmentation;
+    long peak_rss_kb;
+    long rss_growth_kb;         // peak RSS over the RSS before the first operation
+    unsigned long long peak_live_bytes;
+    double rel_throughput;      // over malloc, 0 if malloc was not run
+} bench_result_t, *bench_result_pt;
+
+// one worker of a scaling run; its slots are its own even when the pool is shared
+typedef struct _bench_thread {
+    pthread_t thread;
+    pthread_barrier_t *start;
+    bench_backend backend;
+    pool_pt pool;
+    bench_op_pt ops;
+    unsigned long num_ops;
+    void **slots;
+    unsigned num_slots;
+    unsigned long long start_ns;
+    unsigned long long finish_ns;
+    unsigned long long alloc_failures;
+} bench_thread_t, *bench_thread_pt;
+
+typedef struct _bench_scale_result {
+    unsigned threads;
+    unsigned long long ops;     // over all threads
+    double seconds;
+    unsigned long long alloc_failures;
+    double speedup;             // over one thread
+} bench_scale_result_t, *bench_scale_result_pt;
+
+
+
+/********************************************/
+/*                                          */
+/* Forward declarations of static functions */
+/*                                          */
+/********************************************/
+static bench_op_pt generate(bench_workload workload, const bench_config_t *config);
+static int run(bench_workload workload, bench_backend backend, const bench_config_t *config,
+               bench_result_pt result);
+static int run_in_child(bench_workload workload, bench_backend backend, const bench_config_t *config,
+                        bench_result_pt result);
+static void print_result(bench_format format, bench_workload workload, const char *backend_name,
+                         const bench_result_t *result, int first);
+static int run_scaling(bench_workload workload, bench_backend backend, bench_sharing sharing,
+                       unsigned threads, const bench_config_t *config, bench_scale_result_pt result);
+static void *run_thread(void *arg);
+static void print_scale_result(bench_format format, bench_workload workload, const char *backend_name,
+                               bench_sharing sharing, const bench_scale_result_t *result, int first);
+static int compare_ns(const void *a, const void *b);
+static unsigned next_random(unsigned *state);
+static unsigned long long now_ns();
+
+static const char *const workload_names[BENCH_NUM_WORKLOADS] =
+        {"churn", "random", "lifo", "fifo", "ramp", "pools"};
+
+static const char *const backend_names[BENCH_NUM_BACKENDS] =
+        {"FIRST_FIT", "BEST_FIT", "malloc"};
+
+
+
+/********/
+/*      */
+/* Main */
+/*      */
+/********/
+int main(int argc, char *argv[])
+{
+    bench_config_t config = {BENCH_DEFAULT_OPS, BENCH_DEFAULT_LIVE, BENCH_DEFAULT_MIN_SIZE,
+                             BENCH_DEFAULT_MAX_SIZE, 1, BENCH_DEFAULT_SEED};
+    unsigned pools = BENCH_DEFAULT_POOLS;
+    int workload = -1;                                                          // all
+    int backend = -1;                                                           // both policies
+    int compare = 0;
+    int max_threads = -1;                                                       // no scaling run
+    bench_format format = BENCH_TABLE;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "cT:w:p:n:l:m:M:P:s:f:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'c':
+                compare = 1;
+                break;
+            case 'T':
+                max_threads = (int) strtoul(optarg, NULL, 10);
+                if (max_threads == 0)
+                {
+                    max_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+                }
+                break;
+            case 'w':
+                for (workload = 0; workload < BENCH_NUM_WORKLOADS; workload++)
+                {
+                    if (strcmp(optarg, workload_names[workload]) == 0)
+                    {
+                        break;
+                    }
+                }
+                if (workload == BENCH_NUM_WORKLOADS)
+                {
+                    fprintf(stderr, "unknown workload '%s'\n", optarg);
+                    return 2;
+                }
+                break;
+            case 'p':
+                if (strcmp(optarg, "first") == 0)
+                {
+                    backend = BENCH_FIRST_FIT;
+                }
+                else if (strcmp(optarg, "best") == 0)
+                {
+                    backend = BENCH_BEST_FIT;
+                }
+                else if (strcmp(optarg, "malloc") == 0)
+                {
+                    backend = BENCH_MALLOC;
+                }
+                else
+                {
+                    fprintf(stderr, "unknown policy '%s'\n", optarg);
+                    return 2;
+                }
+                break;
+            case 'n': config.ops = strtoul(optarg, NULL, 10); break;
+            case 'l': config.live = (unsigned) strtoul(optarg, NULL, 10); break;
+            case 'm': config.min_size = strtoul(optarg, NULL, 10); break;
+            case 'M': config.max_size = strtoul(optarg, NULL, 10); break;
+            case 'P': pools = (unsigned) strtoul(optarg, NULL, 10); break;
+            case 's': config.seed = (unsigned) strtoul(optarg, NULL, 10); break;
+            case 'f':
+                if (strcmp(optarg, "table") == 0)
+                {
+                    format = BENCH_TABLE;
+                }
+                else if (strcmp(optarg, "csv") == 0)
+                {
+                    format = BENCH_CSV;
+                }
+                else if (strcmp(optarg, "json") == 0)
+                {
+                    format = BENCH_JSON;
+                }
+                else
+                {
+                    fprintf(stderr, "unknown format '%s'\n", optarg);
+                    return 2;
+                }
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-c] [-T threads] [-w workload] [-p first|best|malloc] [-n ops] [-l live]\n"
+                                "       [-m min size] [-M max size] [-P pools] [-s seed] [-f table|csv|json]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    if (config.ops == 0 || config.live == 0 || pools == 0
+        || config.min_size == 0 || config.max_size < config.min_size)
+    {
+        fprintf(stderr, "ops, live, pools and sizes must be positive, and min size <= max size\n");
+        return 2;
+    }
+
+    // name the malloc backend after the preloaded allocator, if any
+    char malloc_name[64] = "malloc";
+    const char *preload = getenv("LD_PRELOAD");
+    if (preload != NULL && preload[0] != '\0')
+    {
+        const char *base = strrchr(preload, '/');
+        snprintf(malloc_name, sizeof(malloc_name), "malloc:%s", (base != NULL) ? base + 1 : preload);
+    }
+
+    int first = 1;
+    int w, b;
+
+    if (max_threads > 0)
+    {
+        if (workload == BENCH_POOLS)
+        {
+            fprintf(stderr, "the pools workload cannot be run with -T\n");
+            return 2;
+        }
+        w = (workload == -1) ? BENCH_RANDOM : workload;
+
+        for (b = 0; b < BENCH_NUM_BACKENDS; b++)
+        {
+            if (b == BENCH_MALLOC ? (backend != BENCH_MALLOC && !compare) : (backend != -1 && backend != b))
+            {
+                continue;
+            }
+
+            // malloc has no pools to share, so it is run once
+            bench_sharing sharing;
+            for (sharing = BENCH_PRIVATE; sharing <= ((b == BENCH_MALLOC) ? BENCH_PRIVATE : BENCH_SHARED); sharing++)
+            {
+                double single_ops_per_sec = 0.0;
+                unsigned threads;
+                for (threads = 1; threads <= (unsigned) max_threads; threads++)
+                {
+                    bench_scale_result_t result;
+                    if (run_scaling((bench_workload) w, (bench_backend) b, sharing, threads, &config, &result) != 0)
+                    {
+                        fprintf(stderr, "%s/%s: scaling run with %u threads failed\n",
+                                workload_names[w], backend_names[b], threads);
+                        return 1;
+                    }
+
+                    double ops_per_sec = (result.seconds > 0) ? result.ops / result.seconds : 0.0;
+                    if (threads == 1)
+                    {
+                        single_ops_per_sec = ops_per_sec;
+                    }
+                    result.speedup = (single_ops_per_sec > 0) ? ops_per_sec / single_ops_per_sec : 0.0;
+
+                    print_scale_result(format, (bench_workload) w,
+                                       (b == BENCH_MALLOC) ? malloc_name : backend_names[b], sharing, &result, first);
+                    first = 0;
+                }
+            }
+        }
+
+        if (format == BENCH_JSON)
+        {
+            printf(first ? "[]\n" : "\n]\n");
+        }
+
+        return 0;
+    }
+
+    for (w = 0; w < BENCH_NUM_WORKLOADS; w++)
+    {
+        if (workload != -1 && workload != w)
+        {
+            continue;
+        }
+
+        config.pools = (w == BENCH_POOLS) ? pools : 1;
+
+        // in comparison mode, malloc goes first, so that the pools can be reported relative to it
+        double malloc_ops_per_sec = 0.0;
+        int order[BENCH_NUM_BACKENDS] = {BENCH_MALLOC, BENCH_FIRST_FIT, BENCH_BEST_FIT};
+
+        for (b = 0; b < BENCH_NUM_BACKENDS; b++)
+        {
+            bench_backend this_backend = (bench_backend) order[b];
+            if (this_backend == BENCH_MALLOC ? (backend != BENCH_MALLOC && !compare)
+                                             : (backend != -1 && backend != this_backend))
+            {
+                continue;
+            }
+
+            bench_result_t result;
+            if (run_in_child((bench_workload) w, this_backend, &config, &result) != 0)
+            {
+                fprintf(stderr, "%s/%s: run failed\n", workload_names[w], backend_names[this_backend]);
+                return 1;
+            }
+
+            double ops_per_sec = (result.seconds > 0) ? result.ops / result.seconds : 0.0;
+            if (this_backend == BENCH_MALLOC)
+            {
+                malloc_ops_per_sec = ops_per_sec;
+            }
+            result.rel_throughput = (malloc_ops_per_sec > 0) ? ops_per_sec / malloc_ops_per_sec : 0.0;
+
+            print_result(format, (bench_workload) w,
+                         (this_backend == BENCH_MALLOC) ? malloc_name : backend_names[this_backend], &result, first);
+            first = 0;
+        }
+    }
+
+    if (format == BENCH_JSON)
+    {
+        printf(first ? "[]\n" : "\n]\n");
+    }
+
+    return 0;
+}
+
+
+
+/***********************************/
+/*                                 */
+/* Definitions of static functions */
+/*                                 */
+/***********************************/
+
+// generates the operation sequence up front, so that both policies see identical work
+// and the generator is not part of the measurement
+static bench_op_pt generate(bench_workload workload, const bench_config_t *config)
+{
+    unsigned num_slots = config->live * config->pools;
+    bench_op_pt ops = malloc(config->ops * sizeof(bench_op_t));
+    unsigned char *full = calloc(num_slots, 1);
+    unsigned *order = malloc(num_slots * sizeof(unsigned));
+    if (ops == NULL || full == NULL || order == NULL)
+    {
+        free(ops);
+        free(full);
+        free(order);
+        return NULL;
+    }
+
+    unsigned state = config->seed;
+    unsigned size_range = (unsigned) (config->max_size - config->min_size + 1);
+    unsigned filled = 0;                                                        // lifo, fifo and ramp cursors
+    unsigned freed = 0;
+    int filling = 1;
+
+    unsigned long i;
+    for (i = 0; i < config->ops; i++)
+    {
+        unsigned slot = 0;
+
+        switch (workload)
+        {
+            case BENCH_CHURN:
+            case BENCH_RANDOM:
+            case BENCH_POOLS:
+                slot = next_random(&state) % num_slots;
+                break;
+
+            case BENCH_LIFO:
+                // push 0 .. live-1, then pop live-1 .. 0
+                slot = filling ? filled++ : --filled;
+                if (filled == num_slots || filled == 0)
+                {
+                    filling = !filling;
+                }
+                break;
+
+            case BENCH_FIFO:
+                // fill once, then each slot is freed and refilled in turn, oldest first
+                slot = filling ? filled++ : freed;
+                if (filling && filled == num_slots)
+                {
+                    filling = 0;
+                }
+                else if (!filling && full[slot] == 0)
+                {
+                    freed = (freed + 1) % num_slots;
+                }
+                break;
+
+            case BENCH_RAMP:
+                // fill 0 .. live-1, then free in a random order, then fill again
+                if (filling)
+                {
+                    slot = filled++;
+                    if (filled == num_slots)
+                    {
+                        unsigned s;
+                        for (s = 0; s < num_slots; s++)
+                        {
+                            order[s] = s;
+                        }
+                        for (s = num_slots - 1; s > 0; s--)
+                        {
+                            unsigned j = next_random(&state) % (s + 1);
+                            unsigned tmp = order[s];
+                            order[s] = order[j];
+                            order[j] = tmp;
+                        }
+                        filling = 0;
+                        freed = 0;
+                    }
+                }
+                else
+                {
+                    slot = order[freed++];
+                    if (freed == num_slots)
+                    {
+                        filling = 1;
+                        filled = 0;
+                    }
+                }
+                break;
+
+            default:
+                break;
+        }
+
+        ops[i].slot = slot;
+        if (full[slot])
+        {
+            ops[i].size = 0;
+        }
+        else
+        {
+            ops[i].size = (unsigned) ((workload == BENCH_CHURN) ? config->min_size
+                                                                : config->min_size + next_random(&state) % size_range);
+        }
+        full[slot] = !full[slot];
+    }
+
+    free(full);
+    free(order);
+
+    return ops;
+}
+
+
+// runs the workload twice: once for throughput, once timing every operation and sampling the pools
+static int run(bench_workload workload, bench_backend backend, const bench_config_t *config,
+               bench_result_pt result)
+{
+    memset(result, 0, sizeof(*result));
+
+    unsigned num_slots = config->live * config->pools;
+    size_t pool_size = BENCH_POOL_SIZE_FACTOR * config->live * config->max_size;
+
+    bench_op_pt ops = generate(workload, config);
+    void **slots = calloc(num_slots, sizeof(void *));                          // alloc_pt, or malloc'd block
+    size_t *slot_sizes = calloc(num_slots, sizeof(size_t));
+    pool_pt *pools = calloc(config->pools, sizeof(pool_pt));
+    unsigned *latencies = malloc(config->ops * sizeof(unsigned));
+    if (ops == NULL || slots == NULL || slot_sizes == NULL || pools == NULL || latencies == NULL
+        || mem_init() != ALLOC_OK)
+    {
+        free(ops);
+        free(slots);
+        free(slot_sizes);
+        free(pools);
+        free(latencies);
+        return -1;
+    }
+
+    // fault in the bookkeeping, so that only the allocator's own memory counts as growth
+    memset(latencies, 0, config->ops * sizeof(unsigned));
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    long base_rss_kb = usage.ru_maxrss;
+
+    int pass;
+    for (pass = 0; pass < 2; pass++)
+    {
+        unsigned p;
+        for (p = 0; backend != BENCH_MALLOC && p < config->pools; p++)
+        {
+            pools[p] = mem_pool_open(pool_size, (alloc_policy) backend);
+            if (pools[p] == NULL)
+            {
+                return -1;
+            }
+        }
+
+        unsigned long long live_bytes = 0;
+
+        unsigned long long start = now_ns();
+
+        unsigned long i;
+        for (i = 0; i < config->ops; i++)
+        {
+            unsigned slot = ops[i].slot;
+            pool_pt pool = pools[slot / config->live];
+            unsigned long long op_start = 0;
+
+            if (pass == 1)
+            {
+                op_start = now_ns();
+            }
+
+            // both backends touch the first byte of a block, as its user would
+            if (ops[i].size != 0 && backend == BENCH_MALLOC)
+            {
+                char *mem = malloc(ops[i].size);
+                if (mem != NULL)
+                {
+                    mem[0] = 1;
+                }
+                slots[slot] = mem;
+            }
+            else if (ops[i].size != 0)
+            {
+                alloc_pt alloc = mem_new_alloc(pool, ops[i].size);
+                if (alloc != NULL)
+                {
+                    alloc->mem[0] = 1;
+                }
+                slots[slot] = alloc;
+            }
+            else if (slots[slot] != NULL && backend == BENCH_MALLOC)
+            {
+                free(slots[slot]);
+                slots[slot] = NULL;
+            }
+            else if (slots[slot] != NULL)
+            {
+                mem_del_alloc(pool, slots[slot]);
+                slots[slot] = NULL;
+            }
+
+            if (pass == 1)
+            {
+                latencies[i] = (unsigned) (now_ns() - op_start);
+            }
+
+            if (pass == 0 && ops[i].size != 0)
+            {
+                if (slots[slot] == NULL)
+                {
+                    result->alloc_failures += 1;
+                }
+                else
+                {
+                    slot_sizes[slot] = ops[i].size;
+                    live_bytes += ops[i].size;
+                    if (live_bytes > result->peak_live_bytes)
+                    {
+                        result->peak_live_bytes = live_bytes;
+                    }
+                }
+            }
+            else if (pass == 0 && slot_sizes[slot] != 0)
+            {
+                live_bytes -= slot_sizes[slot];
+                slot_sizes[slot] = 0;
+            }
+
+            if (pass == 1 && backend != BENCH_MALLOC)
+            {
+                pool_stats_t stats;
+                mem_pool_stats(pool, &stats);
+                result->mean_fragmentation += stats.ext_fragmentation;
+                if (stats.ext_fragmentation > result->max_fragmentation)
+                {
+                    result->max_fragmentation = stats.ext_fragmentation;
+                }
+            }
+        }
+
+        if (pass == 0)
+        {
+            result->ops = config->ops;
+            result->seconds = (now_ns() - start) / 1e9;
+        }
+
+        // release whatever the workload left behind
+        for (i = 0; i < num_slots; i++)
+        {
+            if (slots[i] != NULL && backend == BENCH_MALLOC)
+            {
+                free(slots[i]);
+            }
+            else if (slots[i] != NULL)
+            {
+                mem_del_alloc(pools[i / config->live], slots[i]);
+            }
+            slots[i] = NULL;
+            slot_sizes[i] = 0;
+        }
+        for (p = 0; backend != BENCH_MALLOC && p < config->pools; p++)
+        {
+            mem_pool_close(pools[p]);
+        }
+    }
+
+    // before sorting the latencies, which may take scratch memory
+    getrusage(RUSAGE_SELF, &usage);
+    result->peak_rss_kb = usage.ru_maxrss;
+    result->rss_growth_kb = usage.ru_maxrss - base_rss_kb;
+
+    mem_free();
+
+    result->mean_fragmentation /= config->ops;
+
+    qsort(latencies, config->ops, sizeof(unsigned), compare_ns);
+    result->ns_p50 = latencies[(config->ops - 1) * 50 / 100];
+    result->ns_p90 = latencies[(config->ops - 1) * 90 / 100];
+    result->ns_p99 = latencies[(config->ops - 1) * 99 / 100];
+    result->ns_max = latencies[config->ops - 1];
+
+    free(ops);
+    free(slots);
+    free(slot_sizes);
+    free(pools);
+    free(latencies);
+
+    return 0;
+}
+
+
+static int run_in_child(bench_workload workload, bench_backend backend, const bench_config_t *config,
+                        bench_result_pt result)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+    {
+        return -1;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if (pid == 0)
+    {
+        close(fds[0]);
+        int status = run(workload, backend, config, result);
+        if (status == 0 && write(fds[1], result, sizeof(*result)) != sizeof(*result))
+        {
+            status = -1;
+        }
+        _exit(status == 0 ? 0 : 1);
+    }
+
+    close(fds[1]);
+    ssize_t received = read(fds[0], result, sizeof(*result));
+    close(fds[0]);
+
+    int status;
+    waitpid(pid, &status, 0);
+
+    return (received == sizeof(*result) && WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+}
+
+
+static void print_result(bench_format format, bench_workload workload, const char *backend_name,
+                         const bench_result_t *result, int first)
+{
+    double ops_per_sec = (result->seconds > 0) ? result->ops / result->seconds : 0.0;
+    double mem_overhead = (result->peak_live_bytes > 0) ? result->rss_growth_kb * 1024.0 / result->peak_live_bytes : 0.0;
+
+    switch (format)
+    {
+        case BENCH_TABLE:
+            if (first)
+            {
+                printf("%-8s %-10s %10s %12s %8s %8s %8s %10s %9s %9s %9s %12s %8s %8s\n",
+                       "workload", "policy", "ops", "ops/sec", "ns_p50", "ns_p90", "ns_p99", "ns_max",
+                       "failures", "frag_mean", "frag_max", "peak_rss_kb", "rel_tput", "mem_ovhd");
+            }
+            printf("%-8s %-10s %10llu %12.0f %8llu %8llu %8llu %10llu %9llu %9.4f %9.4f %12ld %8.3f %8.2f\n",
+                   workload_names[workload], backend_name, result->ops, ops_per_sec,
+                   result->ns_p50, result->ns_p90, result->ns_p99, result->ns_max,
+                   result->alloc_failures, result->mean_fragmentation, result->max_fragmentation,
+                   result->peak_rss_kb, result->rel_throughput, mem_overhead);
+            break;
+
+        case BENCH_CSV:
+            if (first)
+            {
+                printf("workload,policy,ops,seconds,ops_per_sec,ns_p50,ns_p90,ns_p99,ns_max,"
+                       "alloc_failures,frag_mean,frag_max,peak_rss_kb,rss_growth_kb,peak_live_bytes,"
+                       "rel_throughput,mem_overhead\n");
+            }
+            printf("%s,%s,%llu,%.6f,%.0f,%llu,%llu,%llu,%llu,%llu,%.6f,%.6f,%ld,%ld,%llu,%.6f,%.6f\n",
+                   workload_names[workload], backend_name, result->ops, result->seconds, ops_per_sec,
+                   result->ns_p50, result->ns_p90, result->ns_p99, result->ns_max,
+                   result->alloc_failures, result->mean_fragmentation, result->max_fragmentation,
+                   result->peak_rss_kb, result->rss_growth_kb, result->peak_live_bytes,
+                   result->rel_throughput, mem_overhead);
+            break;
+
+        case BENCH_JSON:
+            printf("%s  {\"workload\": \"%s\", \"policy\": \"%s\", \"ops\": %llu, \"seconds\": %.6f, "
+                   "\"ops_per_sec\": %.0f, \"ns_p50\": %llu, \"ns_p90\": %llu, \"ns_p99\": %llu, \"ns_max\": %llu, "
+                   "\"alloc_failures\": %llu, \"frag_mean\": %.6f, \"frag_max\": %.6f, \"peak_rss_kb\": %ld, "
+                   "\"rss_growth_kb\": %ld, \"peak_live_bytes\": %llu, \"rel_throughput\": %.6f, \"mem_overhead\": %.6f}",
+                   first ? "[\n" : ",\n", workload_names[workload], backend_name, result->ops, result->seconds,
+                   ops_per_sec, result->ns_p50, result->ns_p90, result->ns_p99, result->ns_max,
+                   result->alloc_failures, result->mean_fragmentation, result->max_fragmentation,
+                   result->peak_rss_kb, result->rss_growth_kb, result->peak_live_bytes,
+                   result->rel_throughput, mem_overhead);
+            break;
+    }
+}
+
+
+// runs threads copies of the workload at once, each on its own op sequence and slots
+static int run_scaling(bench_workload workload, bench_backend backend, bench_sharing sharing,
+                       unsigned threads, const bench_config_t *config, bench_scale_result_pt result)
+{
+    memset(result, 0, sizeof(*result));
+    result->threads = threads;
+
+    size_t pool_size = BENCH_POOL_SIZE_FACTOR * config->live * config->max_size;
+    bench_thread_pt workers = calloc(threads, sizeof(bench_thread_t));
+    pthread_barrier_t start;
+
+    if (workers == NULL || mem_init() != ALLOC_OK)
+    {
+        free(workers);
+        return -1;
+    }
+    pthread_barrier_init(&start, NULL, threads + 1);
+
+    // the pools are opened and closed here, since the pool store is not thread safe
+    pool_pt shared_pool = NULL;
+    if (backend != BENCH_MALLOC && sharing == BENCH_SHARED)
+    {
+        shared_pool = mem_pool_open_ex(threads * pool_size, (alloc_policy) backend, POOL_THREAD_SAFE);
+    }
+
+    int status = 0;
+    unsigned t;
+    for (t = 0; t < threads; t++)
+    {
+        bench_config_t thread_config = *config;
+        thread_config.pools = 1;
+        thread_config.seed = config->seed + t;
+
+        workers[t].start = &start;
+        workers[t].backend = backend;
+        workers[t].num_ops = config->ops;
+        workers[t].ops = generate(workload, &thread_config);
+        workers[t].slots = calloc(config->live, sizeof(void *));
+        workers[t].num_slots = config->live;
+        if (backend != BENCH_MALLOC)
+        {
+            workers[t].pool = (sharing == BENCH_SHARED) ? shared_pool : mem_pool_open(pool_size, (alloc_policy) backend);
+        }
+
+        if (workers[t].ops == NULL || workers[t].slots == NULL
+            || (backend != BENCH_MALLOC && workers[t].pool == NULL))
+        {
+            status = -1;
+        }
+    }
+
+    unsigned started = 0;
+    while (status == 0 && started < threads)
+    {
+        if (pthread_create(&workers[started].thread, NULL, run_thread, &workers[started]) != 0)
+        {
+            // nobody can pass the barrier now, so the run cannot go ahead
+            fprintf(stderr, "could not start thread %u\n", started);
+            exit(1);
+        }
+        started += 1;
+    }
+
+    if (status == 0)
+    {
+        pthread_barrier_wait(&start);
+
+        // from the first thread to start to the last one to finish
+        unsigned long long start_ns = ~0ULL;
+        unsigned long long finish_ns = 0;
+
+        for (t = 0; t < threads; t++)
+        {
+            pthread_join(workers[t].thread, NULL);
+            if (workers[t].start_ns < start_ns)
+            {
+                start_ns = workers[t].start_ns;
+            }
+            if (workers[t].finish_ns > finish_ns)
+            {
+                finish_ns = workers[t].finish_ns;
+            }
+            result->alloc_failures += workers[t].alloc_failures;
+        }
+
+        result->ops = (unsigned long long) threads * config->ops;
+        result->seconds = (finish_ns - start_ns) / 1e9;
+    }
+
+    for (t = 0; t < threads; t++)
+    {
+        if (workers[t].pool != NULL && workers[t].pool != shared_pool)
+        {
+            mem_pool_close(workers[t].pool);
+        }
+        free(workers[t].ops);
+        free(workers[t].slots);
+    }
+    if (shared_pool != NULL)
+    {
+        mem_pool_close(shared_pool);
+    }
+    mem_free();
+
+    pthread_barrier_destroy(&start);
+    free(workers);
+
+    return status;
+}
+
+
+static void *run_thread(void *arg)
+{
+    bench_thread_pt worker = (bench_thread_pt) arg;
+
+    pthread_barrier_wait(worker->start);
+    worker->start_ns = now_ns();
+
+    unsigned long i;
+    for (i = 0; i < worker->num_ops; i++)
+    {
+        void **slot = &worker->slots[worker->ops[i].slot];
+
+        if (worker->ops[i].size != 0)
+        {
+            if (worker->backend == BENCH_MALLOC)
+            {
+                *slot = malloc(worker->ops[i].size);
+            }
+            else
+            {
+                *slot = mem_new_alloc(worker->pool, worker->ops[i].size);
+            }
+            worker->alloc_failures += (*slot == NULL);
+        }
+        else if (*slot != NULL)
+        {
+            if (worker->backend == BENCH_MALLOC)
+            {
+                free(*slot);
+            }
+            else
+            {
+                mem_del_alloc(worker->pool, *slot);
+            }
+            *slot = NULL;
+        }
+    }
+
+    worker->finish_ns = now_ns();
+
+    // release whatever the workload left behind, outside the measurement
+    unsigned s;
+    for (s = 0; s < worker->num_slots; s++)
+    {
+        if (worker->slots[s] != NULL && worker->backend == BENCH_MALLOC)
+        {
+            free(worker->slots[s]);
+        }
+        else if (worker->slots[s] != NULL)
+        {
+            mem_del_alloc(worker->pool, worker->slots[s]);
+        }
+    }
+
+    return NULL;
+}
+
+
+static void print_scale_result(bench_format format, bench_workload workload, const char *backend_name,
+                               bench_sharing sharing, const bench_scale_result_t *result, int first)
+{
+    const char *sharing_name = (sharing == BENCH_SHARED) ? "shared" : "private";
+    double ops_per_sec = (result->seconds > 0) ? result->ops / result->seconds : 0.0;
+    double efficiency = result->speedup / result->threads;
+
+    switch (format)
+    {
+        case BENCH_TABLE:
+            if (first)
+            {
+                printf("%-8s %-10s %-8s %8s %12s %10s %12s %8s %10s %9s\n",
+                       "workload", "policy", "pools", "threads", "ops", "seconds", "ops/sec", "speedup",
+                       "efficiency", "failures");
+            }
+            printf("%-8s %-10s %-8s %8u %12llu %10.4f %12.0f %8.2f %10.2f %9llu\n",
+                   workload_names[workload], backend_name, sharing_name, result->threads, result->ops,
+                   result->seconds, ops_per_sec, result->speedup, efficiency, result->alloc_failures);
+            break;
+
+        case BENCH_CSV:
+            if (first)
+            {
+                printf("workload,policy,pools,threads,ops,seconds,ops_per_sec,speedup,efficiency,alloc_failures\n");
+            }
+            printf("%s,%s,%s,%u,%llu,%.6f,%.0f,%.6f,%.6f,%llu\n",
+                   workload_names[workload], backend_name, sharing_name, result->threads, result->ops,
+                   result->seconds, ops_per_sec, result->speedup, efficiency, result->alloc_failures);
+            break;
+
+        case BENCH_JSON:
+            printf("%s  {\"workload\": \"%s\", \"policy\": \"%s\", \"pools\": \"%s\", \"threads\": %u, "
+                   "\"ops\": %llu, \"seconds\": %.6f, \"ops_per_sec\": %.0f, \"speedup\": %.6f, "
+                   "\"efficiency\": %.6f, \"alloc_failures\": %llu}",
+                   first ? "[\n" : ",\n", workload_names[workload], backend_name, sharing_name, result->threads,
+                   result->ops, result->seconds, ops_per_sec, result->speedup, efficiency, result->alloc_failures);
+            break;
+    }
+}
+
+
+static int compare_ns(const void *a, const void *b)
+{
+    unsigned x = *(const unsigned *) a;
+    unsigned y = *(const unsigned *) b;
+
+    return (x > y) - (x < y);
+}
+
+
+// xorshift32, so that runs are reproducible across libcs
+static unsigned next_random(unsigned *state)
+{
+    unsigned x = *state ? *state : 1;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+
+    return x;
+}
+
+
+static unsigned long long now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
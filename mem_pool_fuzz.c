@@ -0,0 +1,533 @@
+// Differential fuzz harness: decodes a byte string into a sequence of pool
+// operations, runs it against the library and against a simple reference
+// model of the segment list, and aborts on the first disagreement in the
+// returned allocations, mem_inspect_pool() output or pool_t metadata.
+//
+// usage: mem_pool_fuzz [-r iterations] [-s seed] [-v] [file ...]
+//
+// With files, each one is run as an input ("-" - stdin), which is how AFL
+// drives it (afl-fuzz ... -- mem_pool_fuzz @@). Without files, random inputs
+// are generated from the seed. Built with -DMEM_POOL_LIBFUZZER (see the
+// MEM_POOL_LIBFUZZER CMake option), main() is left to libFuzzer, which calls
+// LLVMFuzzerTestOneInput() directly.
+//
+// input: byte 0     - bit 0: policy (0 - FIRST_FIT, 1 - BEST_FIT)
+//        bytes 1, 2 - pool size, little-endian (0 - 65536)
+//        then 3-byte operations: opcode, slot, size
+//        opcode % 8: 0..3 - allocate 1 + size * (opcode / 8 + 1) bytes into the slot,
+//                           or free the slot if it is taken
+//                    4    - free the slot, if it is taken
+//                    5    - allocate 0 bytes into the slot, if it is free
+//                    6    - compact the pool
+//                    7    - free a pointer that is not an allocation (must fail)
+
+#define _POSIX_C_SOURCE 200809L // for fileno() under -std=c11
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "mem_pool.h"
+
+/*************/
+/*           */
+/* Constants */
+/*           */
+/*************/
+#define FUZZ_NUM_SLOTS 64
+#define FUZZ_MAX_SEGMENTS (2 * FUZZ_NUM_SLOTS + 1)
+
+static const unsigned   FUZZ_DEFAULT_ITERATIONS         = 10000;
+static const unsigned   FUZZ_DEFAULT_SEED               = 1;
+static const size_t     FUZZ_RANDOM_MAX_LENGTH          = 3 + 3 * 512;
+static const size_t     FUZZ_MAX_INPUT_LENGTH           = 1 << 20;
+
+
+
+/*********************/
+/*                   */
+/* Type declarations */
+/*                   */
+/*********************/
+
+// the model: the segment list, in address order
+typedef struct _model_segment {
+    size_t offset;
+    size_t size;
+    int allocated;
+    int slot; // owner of an allocation, -1 for a gap
+    unsigned long seq; // when a gap was last (re)indexed: zero-size gaps can share an address
+} model_segment_t, *model_segment_pt;
+
+typedef struct _model {
+    alloc_policy policy;
+    size_t total_size;
+    model_segment_t segments[FUZZ_MAX_SEGMENTS];
+    unsigned num_segments;
+    unsigned long next_seq;
+} model_t, *model_pt;
+
+
+
+/********************************************/
+/*                                          */
+/* Forward declarations of static functions */
+/*                                          */
+/********************************************/
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+static void run_input(const uint8_t *data, size_t size);
+static int model_alloc(model_pt model, size_t size, int slot);
+static void model_free(model_pt model, int slot);
+static void model_compact(model_pt model);
+static void check(const model_t *model, pool_pt pool, alloc_pt slots[], unsigned op_index);
+static void fail(unsigned op_index, const char *what);
+static int run_file(const char *path);
+
+static int verbose = 0;
+
+
+
+/***************/
+/*             */
+/* Entry point */
+/*             */
+/***************/
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    run_input(data, size);
+
+    return 0;
+}
+
+
+#ifndef MEM_POOL_LIBFUZZER
+int main(int argc, char *argv[])
+{
+    unsigned iterations = FUZZ_DEFAULT_ITERATIONS;
+    unsigned seed = FUZZ_DEFAULT_SEED;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:s:v")) != -1)
+    {
+        switch (opt)
+        {
+            case 'r': iterations = (unsigned) strtoul(optarg, NULL, 10); break;
+            case 's': seed = (unsigned) strtoul(optarg, NULL, 10); break;
+            case 'v': verbose = 1; break;
+            default:
+                fprintf(stderr, "usage: %s [-r iterations] [-s seed] [-v] [file ...]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    // replay the given inputs
+    if (optind < argc)
+    {
+        int i;
+        for (i = optind; i < argc; i++)
+        {
+            if (run_file(argv[i]) != 0)
+            {
+                return 1;
+            }
+        }
+
+        return 0;
+    }
+
+    // or generate random ones
+    uint8_t *data = malloc(FUZZ_RANDOM_MAX_LENGTH);
+    if (data == NULL)
+    {
+        return 1;
+    }
+
+    srand(seed);
+    unsigned iteration;
+    for (iteration = 0; iteration < iterations; iteration++)
+    {
+        size_t size = 3 + 3 * (rand() % ((FUZZ_RANDOM_MAX_LENGTH - 3) / 3 + 1));
+        size_t i;
+        for (i = 0; i < size; i++)
+        {
+            data[i] = (uint8_t) rand();
+        }
+
+        // keep the pools small enough that they fill up and fragment
+        data[2] &= 0x0f;
+
+        if (verbose)
+        {
+            printf("iteration %u: %lu bytes\n", iteration, (unsigned long) size);
+        }
+        run_input(data, size);
+    }
+
+    free(data);
+    printf("%u random inputs, no mismatches\n", iterations);
+
+    return 0;
+}
+#endif
+
+
+
+/***********************************/
+/*                                 */
+/* Definitions of static functions */
+/*                                 */
+/***********************************/
+static void run_input(const uint8_t *data, size_t size)
+{
+    if (size < 3)
+    {
+        return;
+    }
+
+    model_t model;
+    model.policy = (data[0] & 1) ? BEST_FIT : FIRST_FIT;
+    model.total_size = (size_t) data[1] | ((size_t) data[2] << 8);
+    if (model.total_size == 0)
+    {
+        model.total_size = 1 << 16;
+    }
+    model.segments[0].offset = 0;
+    model.segments[0].size = model.total_size;
+    model.segments[0].allocated = 0;
+    model.segments[0].slot = -1;
+    model.segments[0].seq = 0;
+    model.num_segments = 1;
+    model.next_seq = 1;
+
+    if (mem_init() != ALLOC_OK)
+    {
+        fail(0, "mem_init");
+    }
+
+    pool_pt pool = mem_pool_open(model.total_size, model.policy);
+    if (pool == NULL)
+    {
+        fail(0, "mem_pool_open");
+    }
+
+    alloc_pt slots[FUZZ_NUM_SLOTS] = {NULL};
+    check(&model, pool, slots, 0);
+
+    size_t i;
+    for (i = 3; i + 2 < size; i += 3)
+    {
+        unsigned op_index = (unsigned) (i / 3);
+        unsigned opcode = data[i];
+        unsigned slot = data[i + 1] % FUZZ_NUM_SLOTS;
+        size_t alloc_size = 1 + (size_t) data[i + 2] * (opcode / 8 + 1);
+
+        switch (opcode % 8)
+        {
+            case 5:
+                if (slots[slot] != NULL)
+                {
+                    break;
+                }
+                alloc_size = 0;
+                // fall through
+            case 0:
+            case 1:
+            case 2:
+            case 3:
+                if (slots[slot] == NULL)
+                {
+                    int expected = model_alloc(&model, alloc_size, (int) slot);
+                    slots[slot] = mem_new_alloc(pool, alloc_size);
+                    if ((slots[slot] != NULL) != expected)
+                    {
+                        fail(op_index, expected ? "mem_new_alloc failed, the model did not" : "mem_new_alloc succeeded, the model did not");
+                    }
+                    break;
+                }
+                // fall through
+            case 4:
+                if (slots[slot] != NULL)
+                {
+                    model_free(&model, (int) slot);
+                    if (mem_del_alloc(pool, slots[slot]) != ALLOC_OK)
+                    {
+                        fail(op_index, "mem_del_alloc");
+                    }
+                    slots[slot] = NULL;
+                }
+                break;
+
+            case 6:
+                model_compact(&model);
+                if (mem_pool_compact(pool, NULL) != ALLOC_OK)
+                {
+                    fail(op_index, "mem_pool_compact");
+                }
+                break;
+
+            case 7:
+            {
+                // an interior pointer into a live allocation's node, or the pool itself
+                alloc_pt bogus = (slots[slot] != NULL) ? (alloc_pt) ((char *) slots[slot] + 1) : (alloc_pt) pool;
+                if (mem_del_alloc(pool, bogus) != ALLOC_FAIL)
+                {
+                    fail(op_index, "mem_del_alloc accepted a pointer that is not an allocation");
+                }
+                break;
+            }
+        }
+
+        check(&model, pool, slots, op_index);
+    }
+
+    // tear down, checking that everything merges back into one gap
+    unsigned s;
+    for (s = 0; s < FUZZ_NUM_SLOTS; s++)
+    {
+        if (slots[s] != NULL)
+        {
+            model_free(&model, (int) s);
+            if (mem_del_alloc(pool, slots[s]) != ALLOC_OK)
+            {
+                fail((unsigned) (size / 3), "mem_del_alloc on teardown");
+            }
+            slots[s] = NULL;
+        }
+    }
+    check(&model, pool, slots, (unsigned) (size / 3));
+
+    if (mem_pool_close(pool) != ALLOC_OK)
+    {
+        fail((unsigned) (size / 3), "mem_pool_close");
+    }
+    if (mem_free() != ALLOC_OK)
+    {
+        fail((unsigned) (size / 3), "mem_free");
+    }
+}
+
+
+// FIRST_FIT takes the lowest sufficient gap, BEST_FIT the smallest, the lowest of equals,
+// and of equals at the same address (zero-size gaps) the one indexed first
+static int model_alloc(model_pt model, size_t size, int slot)
+{
+    int found = -1;
+    unsigned i;
+    for (i = 0; i < model->num_segments; i++)
+    {
+        model_segment_pt segment = &model->segments[i];
+        if (segment->allocated || segment->size < size)
+        {
+            continue;
+        }
+        if (found == -1
+            || (model->policy == BEST_FIT
+                && (segment->size < model->segments[found].size
+                    || (segment->size == model->segments[found].size
+                        && segment->offset == model->segments[found].offset
+                        && segment->seq < model->segments[found].seq))))
+        {
+            found = (int) i;
+        }
+        if (model->policy == FIRST_FIT)
+        {
+            break;
+        }
+    }
+
+    if (found == -1)
+    {
+        return 0;
+    }
+
+    model_segment_pt gap = &model->segments[found];
+    size_t remainder = gap->size - size;
+
+    gap->size = size;
+    gap->allocated = 1;
+    gap->slot = slot;
+
+    // the remainder stays a gap, right after the allocation
+    if (remainder > 0)
+    {
+        memmove(gap + 2, gap + 1, (model->num_segments - found - 1) * sizeof(model_segment_t));
+        gap[1].offset = gap->offset + size;
+        gap[1].size = remainder;
+        gap[1].allocated = 0;
+        gap[1].slot = -1;
+        gap[1].seq = model->next_seq++;
+        model->num_segments += 1;
+    }
+
+    return 1;
+}
+
+
+// frees the slot's allocation and merges it with the gaps on either side
+static void model_free(model_pt model, int slot)
+{
+    unsigned i = 0;
+    while (model->segments[i].slot != slot)
+    {
+        i += 1;
+    }
+
+    model->segments[i].allocated = 0;
+    model->segments[i].slot = -1;
+    model->segments[i].seq = model->next_seq++;
+
+    if (i + 1 < model->num_segments && !model->segments[i + 1].allocated)
+    {
+        model->segments[i].size += model->segments[i + 1].size;
+        memmove(&model->segments[i + 1], &model->segments[i + 2],
+                (model->num_segments - i - 2) * sizeof(model_segment_t));
+        model->num_segments -= 1;
+    }
+    if (i > 0 && !model->segments[i - 1].allocated)
+    {
+        model->segments[i - 1].size += model->segments[i].size;
+        model->segments[i - 1].seq = model->segments[i].seq;
+        memmove(&model->segments[i], &model->segments[i + 1],
+                (model->num_segments - i - 1) * sizeof(model_segment_t));
+        model->num_segments -= 1;
+    }
+}
+
+
+// slides every allocation down, in order, leaving one gap at the end;
+// the gaps merge even when they add up to nothing (freed zero-size allocations)
+static void model_compact(model_pt model)
+{
+    unsigned kept = 0;
+    size_t offset = 0;
+    int had_gap = 0;
+    unsigned i;
+    for (i = 0; i < model->num_segments; i++)
+    {
+        if (model->segments[i].allocated)
+        {
+            model->segments[kept] = model->segments[i];
+            model->segments[kept].offset = offset;
+            offset += model->segments[i].size;
+            kept += 1;
+        }
+        else
+        {
+            had_gap = 1;
+        }
+    }
+
+    if (had_gap)
+    {
+        model->segments[kept].offset = offset;
+        model->segments[kept].size = model->total_size - offset;
+        model->segments[kept].allocated = 0;
+        model->segments[kept].slot = -1;
+        model->segments[kept].seq = model->next_seq++;
+        kept += 1;
+    }
+
+    model->num_segments = kept;
+}
+
+
+static void check(const model_t *model, pool_pt pool, alloc_pt slots[], unsigned op_index)
+{
+    size_t alloc_size = 0;
+    unsigned num_allocs = 0;
+    unsigned num_gaps = 0;
+
+    unsigned i;
+    for (i = 0; i < model->num_segments; i++)
+    {
+        const model_segment_t *segment = &model->segments[i];
+        if (segment->allocated)
+        {
+            alloc_size += segment->size;
+            num_allocs += 1;
+
+            alloc_pt alloc = slots[segment->slot];
+            if (alloc->size != segment->size || alloc->mem != pool->mem + segment->offset)
+            {
+                fail(op_index, "allocation size or address");
+            }
+        }
+        else
+        {
+            num_gaps += 1;
+        }
+    }
+
+    if (pool->total_size != model->total_size || pool->alloc_size != alloc_size
+        || pool->num_allocs != num_allocs || pool->num_gaps != num_gaps)
+    {
+        fail(op_index, "pool_t metadata");
+    }
+
+    pool_segment_pt segments = NULL;
+    unsigned num_segments = 0;
+    mem_inspect_pool(pool, &segments, &num_segments);
+
+    if (segments == NULL || num_segments != model->num_segments)
+    {
+        free(segments);
+        fail(op_index, "mem_inspect_pool segment count");
+    }
+    for (i = 0; i < num_segments; i++)
+    {
+        if (segments[i].size != model->segments[i].size
+            || segments[i].allocated != (unsigned long) model->segments[i].allocated)
+        {
+            free(segments);
+            fail(op_index, "mem_inspect_pool segment");
+        }
+    }
+
+    free(segments);
+}
+
+
+static void fail(unsigned op_index, const char *what)
+{
+    fprintf(stderr, "mismatch after operation %u: %s\n", op_index, what);
+    abort();                                                                    // a crash, as far as the fuzzer is concerned
+}
+
+
+static int run_file(const char *path)
+{
+    FILE *file = (strcmp(path, "-") == 0) ? stdin : fopen(path, "rb");
+    if (file == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    uint8_t *data = malloc(FUZZ_MAX_INPUT_LENGTH);
+    if (data == NULL)
+    {
+        if (file != stdin)
+        {
+            fclose(file);
+        }
+        return -1;
+    }
+
+    size_t size = fread(data, 1, FUZZ_MAX_INPUT_LENGTH, file);
+    if (file != stdin)
+    {
+        fclose(file);
+    }
+
+    run_input(data, size);
+    free(data);
+
+    if (verbose)
+    {
+        printf("%s: %lu bytes, no mismatches\n", path, (unsigned long) size);
+    }
+
+    return 0;
+}
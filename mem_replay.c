@@ -0,0 +1,445 @@
+// Replays an allocation trace recorded with mem_trace_start() against
+// one or both allocation policies and reports throughput and fragmentation.
+//
+// usage: mem_replay <trace file> [first|best|recorded]
+
+#define _POSIX_C_SOURCE 200809L // for clock_gettime() under -std=c11
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "mem_pool.h"
+
+/*************/
+/*           */
+/* Constants */
+/*           */
+/*************/
+static const unsigned   REPLAY_MAP_INIT_CAPACITY        = 1024;
+static const float      REPLAY_MAP_FILL_FACTOR          = 0.5;
+static const unsigned   REPLAY_MAP_EXPAND_FACTOR        = 2;
+
+
+
+/*********************/
+/*                   */
+/* Type declarations */
+/*                   */
+/*********************/
+typedef enum _replay_policy { REPLAY_FIRST_FIT, REPLAY_BEST_FIT, REPLAY_RECORDED } replay_policy;
+
+// live allocations, keyed by (pool id, offset in the recorded run)
+typedef struct _map_entry {
+    uint32_t pool_id; // 0 - empty slot
+    uint64_t offset;
+    alloc_pt alloc;
+} map_entry_t, *map_entry_pt;
+
+typedef struct _replay_map {
+    map_entry_pt entries;
+    unsigned capacity;
+    unsigned size;
+} replay_map_t, *replay_map_pt;
+
+typedef struct _replay_result {
+    unsigned long long ops;
+    double seconds;
+    unsigned long long alloc_failures; // failed here, succeeded when recorded
+    unsigned long long samples;
+    double mean_fragmentation;
+    double max_fragmentation;
+    double max_node_heap_occupancy;
+} replay_result_t, *replay_result_pt;
+
+
+
+/********************************************/
+/*                                          */
+/* Forward declarations of static functions */
+/*                                          */
+/********************************************/
+static mem_trace_record_t *load_trace(const char *path, size_t *num_records);
+static int replay(const mem_trace_record_t *records, size_t num_records, replay_policy policy,
+                  int sample_stats, replay_result_pt result);
+static unsigned map_slot(const replay_map_t *map, uint32_t pool_id, uint64_t offset);
+static int map_put(replay_map_pt map, uint32_t pool_id, uint64_t offset, alloc_pt alloc);
+static alloc_pt map_take(replay_map_pt map, uint32_t pool_id, uint64_t offset);
+static double now_seconds();
+
+
+
+/********/
+/*      */
+/* Main */
+/*      */
+/********/
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 3)
+    {
+        fprintf(stderr, "usage: %s <trace file> [first|best|recorded]\n", argv[0]);
+        return 2;
+    }
+
+    size_t num_records = 0;
+    mem_trace_record_t *records = load_trace(argv[1], &num_records);
+    if (records == NULL)
+    {
+        return 1;
+    }
+
+    // by default, compare the two policies
+    replay_policy policies[2] = {REPLAY_FIRST_FIT, REPLAY_BEST_FIT};
+    unsigned num_policies = 2;
+    if (argc == 3)
+    {
+        num_policies = 1;
+        if (strcmp(argv[2], "first") == 0)
+        {
+            policies[0] = REPLAY_FIRST_FIT;
+        }
+        else if (strcmp(argv[2], "best") == 0)
+        {
+            policies[0] = REPLAY_BEST_FIT;
+        }
+        else if (strcmp(argv[2], "recorded") == 0)
+        {
+            policies[0] = REPLAY_RECORDED;
+        }
+        else
+        {
+            fprintf(stderr, "unknown policy '%s'\n", argv[2]);
+            free(records);
+            return 2;
+        }
+    }
+
+    printf("%-10s %12s %10s %14s %10s %10s %10s %10s\n",
+           "policy", "ops", "seconds", "ops/sec", "failures", "frag_mean", "frag_max", "heap_max");
+
+    unsigned p;
+    for (p = 0; p < num_policies; p++)
+    {
+        replay_result_t timed, sampled;
+
+        // time a clean run first, then sample fragmentation in a second one
+        if (replay(records, num_records, policies[p], 0, &timed) != 0
+            || replay(records, num_records, policies[p], 1, &sampled) != 0)
+        {
+            free(records);
+            return 1;
+        }
+
+        printf("%-10s %12llu %10.4f %14.0f %10llu %10.4f %10.4f %10.4f\n",
+               (policies[p] == REPLAY_FIRST_FIT) ? "FIRST_FIT" : (policies[p] == REPLAY_BEST_FIT) ? "BEST_FIT" : "recorded",
+               timed.ops, timed.seconds, (timed.seconds > 0) ? timed.ops / timed.seconds : 0.0,
+               timed.alloc_failures, sampled.mean_fragmentation, sampled.max_fragmentation,
+               sampled.max_node_heap_occupancy);
+    }
+
+    free(records);
+
+    return 0;
+}
+
+
+
+/***********************************/
+/*                                 */
+/* Definitions of static functions */
+/*                                 */
+/***********************************/
+static mem_trace_record_t *load_trace(const char *path, size_t *num_records)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        perror(path);
+        return NULL;
+    }
+
+    mem_trace_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1
+        || header.magic != MEM_TRACE_MAGIC
+        || header.version != MEM_TRACE_VERSION
+        || header.record_size != sizeof(mem_trace_record_t))
+    {
+        fprintf(stderr, "%s: not a version %d allocation trace\n", path, MEM_TRACE_VERSION);
+        fclose(file);
+        return NULL;
+    }
+
+    // read the records in growing chunks
+    size_t capacity = 4096;
+    size_t size = 0;
+    mem_trace_record_t *records = malloc(capacity * sizeof(mem_trace_record_t));
+
+    while (records != NULL)
+    {
+        size += fread(records + size, sizeof(mem_trace_record_t), capacity - size, file);
+        if (size < capacity)
+        {
+            break;
+        }
+
+        capacity *= 2;
+        mem_trace_record_t *grown = realloc(records, capacity * sizeof(mem_trace_record_t));
+        if (grown == NULL)
+        {
+            free(records);
+        }
+        records = grown;
+    }
+
+    fclose(file);
+
+    if (records == NULL)
+    {
+        fprintf(stderr, "%s: out of memory\n", path);
+        return NULL;
+    }
+
+    *num_records = size;
+
+    return records;
+}
+
+
+static int replay(const mem_trace_record_t *records, size_t num_records, replay_policy policy,
+                  int sample_stats, replay_result_pt result)
+{
+    memset(result, 0, sizeof(*result));
+
+    // pools by recorded id
+    uint32_t max_pool_id = 0;
+    size_t r;
+    for (r = 0; r < num_records; r++)
+    {
+        if (records[r].pool_id > max_pool_id)
+        {
+            max_pool_id = records[r].pool_id;
+        }
+    }
+
+    pool_pt *pools = calloc(max_pool_id + 1, sizeof(pool_pt));
+    replay_map_t map = {calloc(REPLAY_MAP_INIT_CAPACITY, sizeof(map_entry_t)), REPLAY_MAP_INIT_CAPACITY, 0};
+    if (pools == NULL || map.entries == NULL || mem_init() == ALLOC_FAIL)
+    {
+        free(pools);
+        free(map.entries);
+        return -1;
+    }
+
+    double start = now_seconds();
+
+    for (r = 0; r < num_records; r++)
+    {
+        const mem_trace_record_t *record = &records[r];
+        pool_pt pool = pools[record->pool_id];
+
+        switch (record->op)
+        {
+            case MEM_TRACE_OPEN:
+                if (record->pool_id != 0)
+                {
+                    alloc_policy pool_policy = (policy == REPLAY_FIRST_FIT) ? FIRST_FIT
+                                             : (policy == REPLAY_BEST_FIT) ? BEST_FIT
+                                             : (alloc_policy) record->policy;
+                    pools[record->pool_id] = mem_pool_open(record->size, pool_policy);
+                }
+                break;
+
+            case MEM_TRACE_ALLOC:
+                if (pool != NULL)
+                {
+                    alloc_pt alloc = mem_new_alloc(pool, record->size);
+                    if (alloc != NULL && record->offset != MEM_TRACE_NO_OFFSET)
+                    {
+                        map_put(&map, record->pool_id, record->offset, alloc);
+                    }
+                    else if (alloc != NULL)
+                    {
+                        mem_del_alloc(pool, alloc);                                 // failed when recorded, so nobody frees it
+                    }
+                    else if (record->offset != MEM_TRACE_NO_OFFSET)
+                    {
+                        result->alloc_failures += 1;
+                    }
+                }
+                break;
+
+            case MEM_TRACE_FREE:
+                if (pool != NULL)
+                {
+                    alloc_pt alloc = map_take(&map, record->pool_id, record->offset);
+                    if (alloc != NULL)
+                    {
+                        mem_del_alloc(pool, alloc);
+                    }
+                }
+                break;
+
+            case MEM_TRACE_MOVE:
+                if (pool != NULL)
+                {
+                    // only the key changes: the replayed allocation lives wherever it lives
+                    alloc_pt alloc = map_take(&map, record->pool_id, record->size);
+                    if (alloc != NULL)
+                    {
+                        map_put(&map, record->pool_id, record->offset, alloc);
+                    }
+                }
+                break;
+
+            case MEM_TRACE_CLOSE:
+                if (pool != NULL)
+                {
+                    mem_pool_close(pool);
+                    pools[record->pool_id] = NULL;
+                }
+                break;
+
+            default:
+                break;
+        }
+        result->ops += 1;
+
+        if (sample_stats && pool != NULL && pools[record->pool_id] != NULL
+            && (record->op == MEM_TRACE_ALLOC || record->op == MEM_TRACE_FREE))
+        {
+            pool_stats_t stats;
+            mem_pool_stats(pool, &stats);
+
+            result->samples += 1;
+            result->mean_fragmentation += stats.ext_fragmentation;
+            if (stats.ext_fragmentation > result->max_fragmentation)
+            {
+                result->max_fragmentation = stats.ext_fragmentation;
+            }
+            if (stats.node_heap_occupancy > result->max_node_heap_occupancy)
+            {
+                result->max_node_heap_occupancy = stats.node_heap_occupancy;
+            }
+        }
+    }
+
+    result->seconds = now_seconds() - start;
+    if (result->samples > 0)
+    {
+        result->mean_fragmentation /= result->samples;
+    }
+
+    // release whatever the trace left open
+    unsigned i;
+    for (i = 0; i < map.capacity; i++)
+    {
+        if (map.entries[i].pool_id != 0 && pools[map.entries[i].pool_id] != NULL)
+        {
+            mem_del_alloc(pools[map.entries[i].pool_id], map.entries[i].alloc);
+        }
+    }
+    for (i = 0; i <= max_pool_id; i++)
+    {
+        if (pools[i] != NULL)
+        {
+            mem_pool_close(pools[i]);
+        }
+    }
+    mem_free();
+
+    free(pools);
+    free(map.entries);
+
+    return 0;
+}
+
+
+// linear probing; returns the slot holding the key, or the empty slot where it would go
+static unsigned map_slot(const replay_map_t *map, uint32_t pool_id, uint64_t offset)
+{
+    unsigned slot = (unsigned) ((offset * 0x9E3779B97F4A7C15ULL + pool_id) >> 20) % map->capacity;
+
+    while (map->entries[slot].pool_id != 0
+           && (map->entries[slot].pool_id != pool_id || map->entries[slot].offset != offset))
+    {
+        slot = (slot + 1) % map->capacity;
+    }
+
+    return slot;
+}
+
+
+static int map_put(replay_map_pt map, uint32_t pool_id, uint64_t offset, alloc_pt alloc)
+{
+    // grow and rehash, if necessary
+    if ((float) (map->size + 1) / map->capacity > REPLAY_MAP_FILL_FACTOR)
+    {
+        replay_map_t grown = {calloc(map->capacity * REPLAY_MAP_EXPAND_FACTOR, sizeof(map_entry_t)),
+                              map->capacity * REPLAY_MAP_EXPAND_FACTOR, map->size};
+        if (grown.entries == NULL)
+        {
+            return -1;
+        }
+
+        unsigned i;
+        for (i = 0; i < map->capacity; i++)
+        {
+            if (map->entries[i].pool_id != 0)
+            {
+                grown.entries[map_slot(&grown, map->entries[i].pool_id, map->entries[i].offset)] = map->entries[i];
+            }
+        }
+
+        free(map->entries);
+        *map = grown;
+    }
+
+    unsigned slot = map_slot(map, pool_id, offset);
+    if (map->entries[slot].pool_id == 0)
+    {
+        map->size += 1;
+    }
+    map->entries[slot].pool_id = pool_id;
+    map->entries[slot].offset = offset;
+    map->entries[slot].alloc = alloc;
+
+    return 0;
+}
+
+
+// removes and returns the allocation under the key, NULL if absent
+static alloc_pt map_take(replay_map_pt map, uint32_t pool_id, uint64_t offset)
+{
+    unsigned slot = map_slot(map, pool_id, offset);
+    if (map->entries[slot].pool_id == 0)
+    {
+        return NULL;
+    }
+
+    alloc_pt alloc = map->entries[slot].alloc;
+    map->entries[slot].pool_id = 0;
+    map->size -= 1;
+
+    // re-insert the rest of the cluster, so that no tombstones are needed
+    unsigned next = (slot + 1) % map->capacity;
+    while (map->entries[next].pool_id != 0)
+    {
+        map_entry_t entry = map->entries[next];
+        map->entries[next].pool_id = 0;
+        map->entries[map_slot(map, entry.pool_id, entry.offset)] = entry;
+        next = (next + 1) % map->capacity;
+    }
+
+    return alloc;
+}
+
+
+static double now_seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
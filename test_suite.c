@@ -2,17 +2,40 @@
 // Created by Ivo Georgiev on 3/3/16.
 //
 
+#define _POSIX_C_SOURCE 200809L // for nanosleep() and clock_gettime() under -std=c11
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 #include <stdarg.h>
 #include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include <setjmp.h>
 
 #include "cmocka.h"
 #include "mem_pool.h"
 #include "test_suite.h"
 
+#if defined(__SANITIZE_ADDRESS__)
+#define TEST_ASAN
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define TEST_ASAN
+#endif
+#endif
+
+#ifdef TEST_ASAN
+#include <sanitizer/asan_interface.h>
+#endif
+
 
 /*****             macros              *****/
 
@@ -153,6 +176,199 @@ static void test_pool_store_smoketest(void **state) {
     }
 }
 
+static void test_pool_store_reuse(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * Slots of closed pools are reused: pools opened and closed in
+     * interleaved order (well past the initial store capacity) stay
+     * independent, and mem_free finds them all closed.
+     */
+
+    pool_pt pools[50];
+    alloc_pt allocs[50];
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    for (int round=0; round<10; ++round) {
+        for (int i=0; i<50; ++i) {
+            pools[i] = mem_pool_open(100 + i, (i % 2) ? BEST_FIT : FIRST_FIT);
+            assert_non_null(pools[i]);
+            allocs[i] = mem_new_alloc(pools[i], i + 1);
+            assert_non_null(allocs[i]);
+        }
+        for (int i=0; i<50; i+=2) {
+            assert_int_equal(mem_del_alloc(pools[i], allocs[i]), ALLOC_OK);
+            assert_int_equal(mem_pool_close(pools[i]), ALLOC_OK);
+        }
+        assert_int_equal(mem_free(), ALLOC_FAIL);
+        for (int i=1; i<50; i+=2) {
+            assert_int_equal(pools[i]->total_size, 100 + i);
+            assert_int_equal(pools[i]->alloc_size, i + 1);
+            assert_int_equal(mem_del_alloc(pools[i], allocs[i]), ALLOC_OK);
+            assert_int_equal(mem_pool_close(pools[i]), ALLOC_OK);
+        }
+    }
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+static void test_pool_cache(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * A closed pool is handed out again by the next open of the same
+     * size, with its memory, and looks just like a new pool; pools of
+     * other sizes, and a second open of the same size, get their own.
+     */
+
+    alloc_pt allocs[100];
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open(1000, FIRST_FIT);
+    assert_non_null(pool);
+    char *mem = pool->mem;
+    for (int i=0; i<100; ++i) { // more nodes and gaps than the initial capacities
+        allocs[i] = mem_new_alloc(pool, 10);
+        assert_non_null(allocs[i]);
+    }
+    for (int i=0; i<100; i+=2) {
+        assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+    for (int i=1; i<100; i+=2) {
+        assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool_pt again = mem_pool_open_ex(1000, BEST_FIT, POOL_DEFERRED_COALESCING);
+    assert_ptr_equal(again, pool);
+    assert_ptr_equal(again->mem, mem);
+    assert_int_equal(again->policy, BEST_FIT);
+    assert_int_equal(again->total_size, 1000);
+    assert_int_equal(again->alloc_size, 0);
+    assert_int_equal(again->num_allocs, 0);
+    assert_int_equal(again->num_gaps, 1);
+
+    pool_segment_pt segs = NULL;
+    unsigned num_segs = 0;
+    mem_inspect_pool(again, &segs, &num_segs);
+    assert_int_equal(num_segs, 1);
+    assert_int_equal(segs[0].size, 1000);
+    assert_int_equal(segs[0].allocated, 0);
+    free(segs);
+
+    for (int i=0; i<100; ++i) {
+        allocs[i] = mem_new_alloc(again, 10);
+        assert_non_null(allocs[i]);
+        assert_ptr_equal(allocs[i]->mem, mem + 10 * i);
+    }
+
+    pool_pt other = mem_pool_open(1000, FIRST_FIT);
+    assert_non_null(other);
+    assert_ptr_not_equal(other, again);
+    pool_pt bigger = mem_pool_open(2000, FIRST_FIT);
+    assert_non_null(bigger);
+    assert_ptr_not_equal(bigger, again);
+
+    for (int i=0; i<100; ++i) {
+        assert_int_equal(mem_del_alloc(again, allocs[i]), ALLOC_OK);
+    }
+    assert_int_equal(mem_pool_close(again), ALLOC_OK);
+    assert_int_equal(mem_pool_close(other), ALLOC_OK);
+    assert_int_equal(mem_pool_close(bigger), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+static void test_pool_single_block(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * POOL_SINGLE_BLOCK puts the manager just before the pool memory;
+     * metadata that outgrows the block (many nodes and gaps) still
+     * works, with any combination of the other flags.
+     */
+
+    const unsigned flag_sets[] = {
+        POOL_DEFAULT,
+        POOL_DEFERRED_COALESCING | POOL_THREAD_SAFE,
+        POOL_DEBUG_GUARDS | POOL_LEAK_TRACKING,
+    };
+    alloc_pt allocs[200];
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    for (unsigned f=0; f<sizeof(flag_sets)/sizeof(flag_sets[0]); ++f) {
+        pool_pt pool = mem_pool_open_ex(20000, BEST_FIT, flag_sets[f] | POOL_SINGLE_BLOCK);
+        assert_non_null(pool);
+        assert_true((char *) pool < pool->mem);
+        assert_true(pool->mem - (char *) pool < 65536); // manager and initial metadata only
+        assert_int_equal(pool->total_size, 20000);
+        assert_int_equal(pool->num_gaps, 1);
+
+        for (int i=0; i<200; ++i) {
+            allocs[i] = mem_new_alloc(pool, 16 + i % 5);
+            assert_non_null(allocs[i]);
+            memset(allocs[i]->mem, i, allocs[i]->size);
+        }
+        for (int i=0; i<200; i+=2) {
+            assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+        }
+        assert_int_equal(pool->num_allocs, 100);
+        for (int i=1; i<200; i+=2) {
+            assert_int_equal((unsigned char) allocs[i]->mem[0], i);
+            assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+        }
+        assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    }
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+static void test_pool_open_in(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * mem_pool_open_in hands out the caller's buffer, a static one and
+     * one on the stack, and leaves it to the caller on close, contents
+     * and all.
+     */
+
+    static char static_buf[4096];
+    _Alignas(16) char stack_buf[1024];
+    char *bufs[] = { static_buf, stack_buf };
+    size_t sizes[] = { sizeof(static_buf), sizeof(stack_buf) };
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    assert_null(mem_pool_open_in(NULL, 1024, FIRST_FIT));
+    assert_null(mem_pool_open_in(stack_buf, 0, FIRST_FIT));
+
+    for (int b=0; b<2; ++b) {
+        pool_pt pool = mem_pool_open_in(bufs[b], sizes[b], BEST_FIT);
+        assert_non_null(pool);
+        assert_ptr_equal(pool->mem, bufs[b]);
+        assert_int_equal(pool->total_size, sizes[b]);
+
+        alloc_pt first = mem_new_alloc(pool, 100);
+        alloc_pt second = mem_new_alloc(pool, sizes[b] - 100);
+        assert_non_null(first);
+        assert_non_null(second);
+        assert_null(mem_new_alloc(pool, 1));
+        assert_ptr_equal(first->mem, bufs[b]);
+        assert_ptr_equal(second->mem, bufs[b] + 100);
+        memset(first->mem, 'a', 100);
+
+        assert_int_equal(mem_del_alloc(pool, second), ALLOC_OK);
+        assert_int_equal(mem_del_alloc(pool, first), ALLOC_OK);
+        assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+        assert_int_equal(bufs[b][0], 'a');
+        assert_int_equal(bufs[b][99], 'a');
+        memset(bufs[b], 0, sizes[b]); // still the caller's
+    }
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
 static void test_pool_smoketest(void **state) {
     (void) state; /* unused */
 
@@ -448,17 +664,944 @@ static void test_pool_bf_metadata(void **state) {
     check_metadata(pool, BEST_FIT, POOL_SIZE, 500, 6, 3);
 
 
-    // clean up
-    for (int i=0; i<NUM_ALLOCS; ++i) {
-        if (allocs[i])
-            assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
-    }
-    free(allocs);
-    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
-    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    // clean up
+    for (int i=0; i<NUM_ALLOCS; ++i) {
+        if (allocs[i])
+            assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+    free(allocs);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+
+
+    check_metadata(pool, BEST_FIT, POOL_SIZE, 0, 0, 1);
+}
+
+
+static void test_pool_stats(void **state) {
+    pool_pt pool = *state;
+    pool_stats_t stats;
+
+    /*
+     * Uses scenario 17 w/ fragmentation stats:
+     *
+     * 1. Pool starts out as a single gap.
+     * 2. Allocate 10 x 100.
+     * 3. Deallocate (2, 1, 3), (6, 5), 8
+     * 4. Clean up.
+     */
+
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+    assert_int_equal(stats.largest_gap, POOL_SIZE);
+    assert_int_equal(stats.free_bytes, POOL_SIZE);
+    assert_true(stats.ext_fragmentation == 0.0);
+    assert_int_equal(stats.gap_hist[19], 1); // 2^19 <= 1000000 < 2^20
+    assert_int_equal(stats.used_nodes, 1);
+
+
+    const unsigned NUM_ALLOCS = 10;
+
+    alloc_pt *allocs = (alloc_pt *) calloc(NUM_ALLOCS, sizeof(alloc_pt));
+    assert_non_null(allocs);
+
+    for (int i=0; i<NUM_ALLOCS; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100);
+        assert_non_null(allocs[i]);
+    }
+    assert_int_equal(mem_del_alloc(pool, allocs[2]), ALLOC_OK); allocs[2]=0;
+    assert_int_equal(mem_del_alloc(pool, allocs[1]), ALLOC_OK); allocs[1]=0;
+    assert_int_equal(mem_del_alloc(pool, allocs[3]), ALLOC_OK); allocs[3]=0;
+    assert_int_equal(mem_del_alloc(pool, allocs[6]), ALLOC_OK); allocs[6]=0;
+    assert_int_equal(mem_del_alloc(pool, allocs[5]), ALLOC_OK); allocs[5]=0;
+    assert_int_equal(mem_del_alloc(pool, allocs[8]), ALLOC_OK); allocs[8]=0;
+
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+    assert_int_equal(stats.largest_gap, POOL_SIZE - 1000);
+    assert_int_equal(stats.free_bytes, POOL_SIZE - 400);
+    assert_true(stats.ext_fragmentation > 0.0005 && stats.ext_fragmentation < 0.0007);
+    assert_int_equal(stats.gap_hist[6], 1);  // 100
+    assert_int_equal(stats.gap_hist[7], 1);  // 200
+    assert_int_equal(stats.gap_hist[8], 1);  // 300
+    assert_int_equal(stats.gap_hist[19], 1); // 999000
+    assert_int_equal(stats.gap_hist_bytes[8], 300);
+    assert_int_equal(stats.used_nodes, 8);
+    assert_int_equal(stats.gap_ix_size, 4);
+    assert_true(stats.node_heap_occupancy == (double) stats.used_nodes / stats.total_nodes);
+
+
+    // clean up
+    for (int i=0; i<NUM_ALLOCS; ++i) {
+        if (allocs[i])
+            assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+    free(allocs);
+
+    assert_int_equal(mem_pool_stats(pool, &stats), ALLOC_OK);
+    assert_int_equal(stats.gap_hist[6] + stats.gap_hist[7] + stats.gap_hist[8], 0);
+    assert_int_equal(stats.gap_hist[19], 1);
+}
+
+
+static void test_pool_inspect_into(void **state) {
+    pool_pt pool = *state;
+    pool_segment_pt segs = NULL;
+    unsigned num_segs = 0;
+    pool_segment_t buf[16];
+    unsigned n = 0;
+    pool_iter_t iter;
+    pool_segment_t seg;
+
+    /*
+     * The non-allocating inspection calls see the same segments as
+     * mem_inspect_pool:
+     *
+     * 1. Allocate 5 x 100, deallocate 1 and 3.
+     * 2. Inspect into a large enough buffer and a too small one.
+     * 3. Walk the segments with the iterator.
+     */
+
+    alloc_pt allocs[5];
+    for (int i=0; i<5; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100);
+        assert_non_null(allocs[i]);
+    }
+    assert_int_equal(mem_del_alloc(pool, allocs[1]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, allocs[3]), ALLOC_OK);
+
+    mem_inspect_pool(pool, &segs, &num_segs);
+    assert_non_null(segs);
+    assert_int_equal(num_segs, 6);
+
+    assert_int_equal(mem_inspect_pool_into(pool, buf, 16, &n), ALLOC_OK);
+    assert_int_equal(n, num_segs);
+    assert_memory_equal(buf, segs, num_segs * sizeof(pool_segment_t));
+
+    memset(buf, 0, sizeof(buf));
+    assert_int_equal(mem_inspect_pool_into(pool, buf, 2, &n), ALLOC_FAIL);
+    assert_int_equal(n, num_segs);
+    assert_memory_equal(buf, segs, 2 * sizeof(pool_segment_t));
+    assert_int_equal(buf[2].size, 0);
+
+    assert_int_equal(mem_inspect_pool_into(pool, NULL, 0, &n), ALLOC_FAIL);
+    assert_int_equal(n, num_segs);
+
+    assert_int_equal(mem_pool_iter_begin(pool, &iter), ALLOC_OK);
+    n = 0;
+    while (mem_pool_iter_next(&iter, &seg)) {
+        assert_true(n < num_segs);
+        assert_memory_equal(&seg, &segs[n], sizeof(pool_segment_t));
+        ++n;
+    }
+    assert_int_equal(n, num_segs);
+    assert_int_equal(mem_pool_iter_next(&iter, &seg), 0);
+
+    free(segs);
+
+    // clean up
+    assert_int_equal(mem_del_alloc(pool, allocs[0]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, allocs[2]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, allocs[4]), ALLOC_OK);
+    assert_int_equal(mem_pool_iter_begin(NULL, &iter), ALLOC_FAIL);
+}
+
+
+static void test_pool_inspect_packed(void **state) {
+    pool_pt pool = *state;
+    pool_segment_pt segs = NULL;
+    unsigned num_segs = 0;
+    uint8_t buf[6 * POOL_SEGMENT_PACKED_MAX];
+    size_t len = 0;
+    size_t pos = 0;
+    pool_segment_t seg;
+    unsigned n = 0;
+
+    /*
+     * The packed stream decodes to the same segments as mem_inspect_pool:
+     *
+     * 1. Allocate 5 x 100, deallocate 1 and 3.
+     * 2. Pack: 5 x 2 bytes for the 100-byte segments, 3 for the last gap.
+     * 3. Pack into a short buffer: only whole segments are written.
+     */
+
+    alloc_pt allocs[5];
+    for (int i=0; i<5; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100);
+        assert_non_null(allocs[i]);
+    }
+    assert_int_equal(mem_del_alloc(pool, allocs[1]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, allocs[3]), ALLOC_OK);
+
+    mem_inspect_pool(pool, &segs, &num_segs);
+    assert_non_null(segs);
+    assert_int_equal(num_segs, 6);
+
+    assert_int_equal(mem_inspect_pool_packed(pool, buf, sizeof(buf), &len), ALLOC_OK);
+    assert_int_equal(len, 13);
+
+    while (mem_segment_unpack(buf, len, &pos, &seg)) {
+        assert_true(n < num_segs);
+        assert_int_equal(seg.size, segs[n].size);
+        assert_int_equal(seg.allocated, segs[n].allocated);
+        ++n;
+    }
+    assert_int_equal(n, num_segs);
+    assert_int_equal(pos, len);
+
+    memset(buf, 0, sizeof(buf));
+    assert_int_equal(mem_inspect_pool_packed(pool, buf, 11, &len), ALLOC_FAIL);
+    assert_int_equal(len, 13);
+    pos = 0;
+    n = 0;
+    while (mem_segment_unpack(buf, 11, &pos, &seg) && seg.size > 0) ++n;
+    assert_int_equal(n, 5);
+
+    free(segs);
+
+    // clean up
+    assert_int_equal(mem_del_alloc(pool, allocs[0]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, allocs[2]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, allocs[4]), ALLOC_OK);
+}
+
+
+static void test_pool_snapshot(void **state) {
+    pool_pt pool = *state;
+    pool_segment_pt segs = NULL;
+    unsigned num_segs = 0;
+
+    /*
+     * A snapshot holds the pool counters and the packed segments:
+     *
+     * 1. Allocate 5 x 100, deallocate 1 and 3.
+     * 2. Snapshot to a temporary file and read it back.
+     */
+
+    alloc_pt allocs[5];
+    for (int i=0; i<5; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100);
+        assert_non_null(allocs[i]);
+    }
+    assert_int_equal(mem_del_alloc(pool, allocs[1]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, allocs[3]), ALLOC_OK);
+
+    FILE *file = tmpfile();
+    assert_non_null(file);
+    assert_int_equal(mem_pool_snapshot(pool, fileno(file)), ALLOC_OK);
+    assert_int_equal(mem_pool_snapshot(NULL, fileno(file)), ALLOC_FAIL);
+    assert_int_equal(mem_pool_snapshot(pool, -1), ALLOC_FAIL);
+    rewind(file);
+
+    mem_snapshot_header_t header;
+    assert_int_equal(fread(&header, sizeof(header), 1, file), 1);
+    assert_int_equal(header.magic, MEM_SNAPSHOT_MAGIC);
+    assert_int_equal(header.version, MEM_SNAPSHOT_VERSION);
+    assert_int_equal(header.header_size, sizeof(header));
+    assert_int_equal(header.policy, FIRST_FIT);
+    assert_true(header.total_size == POOL_SIZE);
+    assert_true(header.alloc_size == 300);
+    assert_true(header.num_allocs == 3);
+    assert_true(header.num_gaps == 3);
+    assert_true(header.num_segments == 6);
+    assert_true(header.stream_size == 13);
+
+    uint8_t stream[16];
+    assert_int_equal(fread(stream, 1, sizeof(stream), file), 13);
+    fclose(file);
+
+    mem_inspect_pool(pool, &segs, &num_segs);
+    assert_non_null(segs);
+    size_t pos = 0;
+    pool_segment_t seg;
+    for (unsigned i=0; i<num_segs; ++i) {
+        assert_true(mem_segment_unpack(stream, 13, &pos, &seg));
+        assert_memory_equal(&seg, &segs[i], sizeof(pool_segment_t));
+    }
+    assert_false(mem_segment_unpack(stream, 13, &pos, &seg));
+    free(segs);
+
+    // clean up
+    assert_int_equal(mem_del_alloc(pool, allocs[0]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, allocs[2]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, allocs[4]), ALLOC_OK);
+}
+
+
+static void test_pool_metrics(void **state) {
+    pool_pt pool = *state;
+    pool_metrics_t metrics;
+
+    /*
+     * Hot-path counters (only with MEM_POOL_METRICS):
+     *
+     * 1. Allocate 3 x 100 and try 2000000 (fails).
+     * 2. Deallocate the 3 x 100 in order, merging twice.
+     * 3. Check the counters and the latency histograms.
+     */
+
+#ifdef MEM_POOL_METRICS
+    alloc_pt allocs[3];
+    for (int i=0; i<3; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100);
+        assert_non_null(allocs[i]);
+    }
+    assert_null(mem_new_alloc(pool, 2 * POOL_SIZE));
+    for (int i=0; i<3; ++i)
+        assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, allocs[0]), ALLOC_FAIL); // double free
+
+    assert_int_equal(mem_pool_metrics(pool, &metrics), ALLOC_OK);
+    assert_int_equal(metrics.open_calls, 1);
+    assert_int_equal(metrics.alloc_calls, 4);
+    assert_int_equal(metrics.alloc_failures, 1);
+    assert_int_equal(metrics.alloc_searches, 4);
+    assert_true(metrics.alloc_probes >= metrics.alloc_searches);
+    assert_int_equal(metrics.del_calls, 4);
+    assert_int_equal(metrics.del_failures, 1);
+    assert_int_equal(metrics.coalesces, 3);
+    assert_int_equal(metrics.alloc_latency.count, 4);
+    assert_int_equal(metrics.del_latency.count, 4);
+    assert_int_equal(metrics.open_latency.count, 1);
+    assert_true(mem_latency_percentile(&metrics.alloc_latency, 50) <= metrics.alloc_latency.max_ns);
+    assert_int_equal(mem_latency_percentile(&metrics.alloc_latency, 100), metrics.alloc_latency.max_ns);
+
+    // store-wide totals include this pool
+    assert_int_equal(mem_pool_metrics(NULL, &metrics), ALLOC_OK);
+    assert_true(metrics.alloc_calls >= 4);
+#else
+    assert_int_equal(mem_pool_metrics(pool, &metrics), ALLOC_FAIL);
+#endif
+}
+
+
+static atomic_int trace_churn_stop;
+
+// allocates and deallocates on its own thread until told to stop
+static void *trace_churn(void *arg) {
+    pool_pt pool = arg;
+    while (!atomic_load(&trace_churn_stop)) {
+        alloc_pt alloc = mem_new_alloc(pool, 64);
+        if (alloc != NULL)
+            mem_del_alloc(pool, alloc);
+    }
+    return NULL;
+}
+
+
+static void test_pool_trace(void **state) {
+    (void) state; /* unused */
+
+    const char *trace_path = "pool_trace.bin";
+
+    /*
+     * Trace recording:
+     *
+     * 1. Start tracing, open a pool, allocate 100 and 200,
+     *    deallocate 100, try 2000000 (fails), deallocate 200, close.
+     * 2. Stop tracing and read the records back.
+     * 3. Start and stop tracing over and over while another thread
+     *    allocates from a POOL_THREAD_SAFE pool: every trace is a header
+     *    and whole records, and nothing is written to a closed file.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    assert_int_equal(mem_trace_start(trace_path), ALLOC_OK);
+    assert_int_equal(mem_trace_start(trace_path), ALLOC_FAIL);
+
+    pool_pt pool = mem_pool_open(POOL_SIZE, BEST_FIT);
+    assert_non_null(pool);
+    alloc_pt alloc0 = mem_new_alloc(pool, 100);
+    alloc_pt alloc1 = mem_new_alloc(pool, 200);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_null(mem_new_alloc(pool, 2 * POOL_SIZE));
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_trace_stop(), ALLOC_OK);
+    assert_int_equal(mem_trace_stop(), ALLOC_CALLED_AGAIN);
+    assert_int_equal(mem_free(), ALLOC_OK);
+
+
+    FILE *file = fopen(trace_path, "rb");
+    assert_non_null(file);
+
+    mem_trace_header_t header;
+    assert_int_equal(fread(&header, sizeof(header), 1, file), 1);
+    assert_int_equal(header.magic, MEM_TRACE_MAGIC);
+    assert_int_equal(header.version, MEM_TRACE_VERSION);
+    assert_int_equal(header.record_size, sizeof(mem_trace_record_t));
+
+    mem_trace_record_t records[8];
+    assert_int_equal(fread(records, sizeof(mem_trace_record_t), 8, file), 7);
+    fclose(file);
+    remove(trace_path);
+
+    const struct { unsigned op; uint64_t size; uint64_t offset; } exp[7] =
+            {
+                    {MEM_TRACE_OPEN,  POOL_SIZE,     0},
+                    {MEM_TRACE_ALLOC, 100,           0},
+                    {MEM_TRACE_ALLOC, 200,           100},
+                    {MEM_TRACE_FREE,  100,           0},
+                    {MEM_TRACE_ALLOC, 2 * POOL_SIZE, MEM_TRACE_NO_OFFSET},
+                    {MEM_TRACE_FREE,  200,           100},
+                    {MEM_TRACE_CLOSE, 0,             0},
+            };
+    for (int i=0; i<7; ++i) {
+        assert_int_equal(records[i].op, exp[i].op);
+        assert_int_equal(records[i].policy, BEST_FIT);
+        assert_int_equal(records[i].pool_id, records[0].pool_id);
+        assert_true(records[i].size == exp[i].size);
+        assert_true(records[i].offset == exp[i].offset);
+        if (i > 0)
+            assert_true(records[i].timestamp_ns >= records[i - 1].timestamp_ns);
+    }
+
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool = mem_pool_open_ex(POOL_SIZE, FIRST_FIT, POOL_THREAD_SAFE);
+    assert_non_null(pool);
+
+    pthread_t churn;
+    atomic_store(&trace_churn_stop, 0);
+    assert_int_equal(pthread_create(&churn, NULL, trace_churn, pool), 0);
+
+    for (int i=0; i<200; ++i) {
+        assert_int_equal(mem_trace_start(trace_path), ALLOC_OK);
+        const struct timespec pause = {0, 10000};
+        nanosleep(&pause, NULL);
+        assert_int_equal(mem_trace_stop(), ALLOC_OK);
+
+        struct stat st;
+        assert_int_equal(stat(trace_path, &st), 0);
+        assert_true((size_t) st.st_size >= sizeof(mem_trace_header_t));
+        assert_int_equal((st.st_size - sizeof(mem_trace_header_t)) % sizeof(mem_trace_record_t), 0);
+    }
+
+    atomic_store(&trace_churn_stop, 1);
+    assert_int_equal(pthread_join(churn, NULL), 0);
+    remove(trace_path);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+static void test_pool_file(void **state) {
+    (void) state; /* unused */
+
+    const char *pool_path = "pool_file.bin";
+
+    /*
+     * File-backed pools keep their allocations across close:
+     *
+     * 1. Open a new file pool, allocate 100, 200 and 300, fill them,
+     *    deallocate 200 and close with two allocations still live.
+     * 2. Reopen it: same segments, same contents, found again by address.
+     * 3. Deallocate everything, close, reopen as empty.
+     */
+
+    remove(pool_path);
+    assert_int_equal(mem_init(), ALLOC_OK);
+    assert_null(mem_pool_open_file(pool_path, 0, FIRST_FIT));   // a new file needs a size
+
+    pool_pt pool = mem_pool_open_file(pool_path, POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+    alloc_pt alloc0 = mem_new_alloc(pool, 100);
+    alloc_pt alloc1 = mem_new_alloc(pool, 200);
+    alloc_pt alloc2 = mem_new_alloc(pool, 300);
+    assert_non_null(alloc2);
+    memset(alloc0->mem, 'a', 100);
+    memset(alloc2->mem, 'c', 300);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+
+    pool_segment_pt segs = NULL;
+    unsigned num_segs = 0;
+    mem_inspect_pool(pool, &segs, &num_segs);
+    assert_int_equal(num_segs, 4);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_null(mem_pool_open_file(pool_path, POOL_SIZE + 1, FIRST_FIT));   // size mismatch
+
+    pool = mem_pool_open_file(pool_path, 0, BEST_FIT);
+    assert_non_null(pool);
+    assert_int_equal(pool->total_size, POOL_SIZE);
+    assert_int_equal(pool->policy, BEST_FIT);
+    assert_int_equal(pool->num_allocs, 2);
+    assert_int_equal(pool->alloc_size, 400);
+    assert_int_equal(pool->num_gaps, 2);
+
+    pool_segment_pt reopened = NULL;
+    unsigned num_reopened = 0;
+    mem_inspect_pool(pool, &reopened, &num_reopened);
+    assert_int_equal(num_reopened, num_segs);
+    assert_memory_equal(reopened, segs, num_segs * sizeof(pool_segment_t));
+    free(reopened);
+    free(segs);
+
+    // best fit takes the 200-byte gap, so the gap index was rebuilt sorted
+    alloc_pt alloc3 = mem_new_alloc(pool, 150);
+    assert_non_null(alloc3);
+    assert_ptr_equal(alloc3->mem, pool->mem + 100);
+
+    alloc0 = mem_find_alloc(pool, pool->mem);
+    alloc2 = mem_find_alloc(pool, pool->mem + 300);
+    assert_non_null(alloc0);
+    assert_non_null(alloc2);
+    assert_null(mem_find_alloc(pool, pool->mem + 250));
+    assert_int_equal(alloc2->size, 300);
+    assert_true(alloc0->mem[0] == 'a' && alloc0->mem[99] == 'a');
+    assert_true(alloc2->mem[0] == 'c' && alloc2->mem[299] == 'c');
+
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc3), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool = mem_pool_open_file(pool_path, POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+    assert_int_equal(pool->num_allocs, 0);
+    assert_int_equal(pool->num_gaps, 1);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+
+    // anything but a cleanly closed pool file is refused
+    FILE *file = fopen(pool_path, "wb");
+    assert_non_null(file);
+    fputs("not a pool", file);
+    fclose(file);
+    assert_null(mem_pool_open_file(pool_path, POOL_SIZE, FIRST_FIT));
+    remove(pool_path);
+}
+
+
+static void die_in_move(pool_pt pool, alloc_pt alloc, char *old_mem) {
+    (void) pool; (void) alloc; (void) old_mem;
+    _exit(0); // with the pool lock held
+}
+
+
+static void test_pool_shared(void **state) {
+    (void) state; /* unused */
+
+    char name[64];
+    snprintf(name, sizeof(name), "/denver_os_pa_c_test_%d", (int) getpid());
+
+    /*
+     * Two processes allocating from one shared pool:
+     *
+     * 1. The parent creates the pool and allocates 100 bytes of 'p'.
+     * 2. A child attaches by name, sees the parent's data, allocates
+     *    100 bytes of 'c', hands back the offset and detaches.
+     * 3. The parent finds the child's allocation at that offset.
+     * 4. The last close removes the name.
+     * 5. A new shared pool holds as many 16-byte allocations as a heap
+     *    pool, with every other one freed first (the node heap and gap
+     *    index cannot leave the segment).
+     * 6. A child dies holding the lock: the parent takes the pool over,
+     *    but the child's attachment is never dropped, so the last close
+     *    leaves the name behind.
+     */
+
+    int to_child[2], to_parent[2];
+    assert_int_equal(pipe(to_child), 0);
+    assert_int_equal(pipe(to_parent), 0);
+
+    pid_t pid = fork();
+    assert_true(pid >= 0);
+    if (pid == 0) {
+        char go;
+        size_t offset = 0;
+        int ok = (read(to_child[0], &go, 1) == 1);
+
+        pool_pt pool = ok ? mem_pool_open_shared(name, 0, FIRST_FIT) : NULL;
+        alloc_pt alloc = (pool != NULL) ? mem_new_alloc(pool, 100) : NULL;
+        if (alloc != NULL) {
+            memset(alloc->mem, 'c', 100);
+            offset = alloc->mem - pool->mem;
+        }
+        ok = (alloc != NULL && pool->mem[0] == 'p' && mem_pool_close(pool) == ALLOC_OK);
+
+        ok = (write(to_parent[1], &offset, sizeof(offset)) == sizeof(offset)) && ok;
+        _exit(ok ? 0 : 1);
+    }
+
+    pool_pt pool = mem_pool_open_shared(name, POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+    assert_null(mem_pool_open_shared(name, 0, FIRST_FIT));   // already mapped in this process
+    alloc_pt alloc = mem_new_alloc(pool, 100);
+    assert_non_null(alloc);
+    memset(alloc->mem, 'p', 100);
+
+    assert_int_equal(write(to_child[1], "g", 1), 1);
+
+    size_t offset = 0;
+    int status = 0;
+    assert_int_equal(read(to_parent[0], &offset, sizeof(offset)), sizeof(offset));
+    assert_int_equal(waitpid(pid, &status, 0), pid);
+    assert_true(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    close(to_child[0]); close(to_child[1]);
+    close(to_parent[0]); close(to_parent[1]);
+
+    assert_int_equal(offset, 100);
+    assert_int_equal(pool->num_allocs, 2);
+    alloc_pt child_alloc = mem_find_alloc(pool, pool->mem + offset);
+    assert_non_null(child_alloc);
+    assert_int_equal(child_alloc->size, 100);
+    assert_true(child_alloc->mem[0] == 'c' && child_alloc->mem[99] == 'c');
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_NOT_FREED);   // the last one out must leave it empty
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, child_alloc), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_true(shm_open(name, O_RDWR, 0) < 0);
+
+    const unsigned num_small = POOL_SIZE / 16;
+    alloc_pt *small = calloc(num_small, sizeof(alloc_pt));
+    assert_non_null(small);
+    pool = mem_pool_open_shared(name, POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+    for (unsigned i=0; i<num_small; ++i) {
+        small[i] = mem_new_alloc(pool, 16);
+        assert_non_null(small[i]);
+    }
+    for (unsigned i=0; i<num_small; i+=2) {
+        assert_int_equal(mem_del_alloc(pool, small[i]), ALLOC_OK);
+    }
+    for (unsigned i=1; i<num_small; i+=2) {
+        assert_int_equal(mem_del_alloc(pool, small[i]), ALLOC_OK);
+    }
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    free(small);
+
+    assert_int_equal(pipe(to_child), 0);
+    pid = fork();   // before the pool is mapped here, as it would be in the child too
+    assert_true(pid >= 0);
+    if (pid == 0) {
+        char go;
+        pool_pt child_pool = (read(to_child[0], &go, 1) == 1) ? mem_pool_open_shared(name, 0, FIRST_FIT) : NULL;
+        if (child_pool != NULL) {
+            mem_pool_compact(child_pool, die_in_move);
+        }
+        _exit(1);
+    }
+
+    pool = mem_pool_open_shared(name, POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool);
+    alloc = mem_new_alloc(pool, 100);
+    alloc_pt moved = mem_new_alloc(pool, 100);
+    assert_non_null(alloc);
+    assert_non_null(moved);
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+
+    assert_int_equal(write(to_child[1], "g", 1), 1);
+    assert_int_equal(waitpid(pid, &status, 0), pid);
+    close(to_child[0]); close(to_child[1]);
+    assert_true(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    assert_ptr_equal(moved->mem, pool->mem);   // moved before the child died
+    alloc = mem_new_alloc(pool, 100);           // does not wait for the dead child
+    assert_non_null(alloc);
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, moved), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    int fd = shm_open(name, O_RDWR, 0);
+    assert_true(fd >= 0);
+    close(fd);
+    assert_int_equal(shm_unlink(name), 0);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+static void test_pool_numa(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * NUMA placement (node 0 exists everywhere, bound or not):
+     *
+     * 1. Open a pool on node 0, use it, close it; node -1 is refused.
+     * 2. Open a pool per node, allocate through the set, deallocate
+     *    through the set, close.
+     * 3. Fill a pool with 16-byte allocations and free every other one
+     *    first: the node heap and gap index, which cannot leave the
+     *    mapping, still fit.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    assert_null(mem_pool_open_numa(POOL_SIZE, FIRST_FIT, POOL_DEFAULT, -1));
+
+    pool_pt pool = mem_pool_open_numa(POOL_SIZE, BEST_FIT, POOL_DEFAULT, 0);
+    assert_non_null(pool);
+    assert_int_equal(pool->total_size, POOL_SIZE);
+    assert_int_equal((uintptr_t) pool->mem % 4096, 0);
+    alloc_pt alloc = mem_new_alloc(pool, 100);
+    assert_non_null(alloc);
+    memset(alloc->mem, 0xab, 100);
+    assert_int_equal(mem_pool_close(pool), ALLOC_NOT_FREED);
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool_set_t set;
+    assert_int_equal(mem_pool_set_open_numa(&set, POOL_SIZE, FIRST_FIT, POOL_DEFAULT), ALLOC_OK);
+    assert_true(set.num_pools >= 1);
+
+    alloc_pt allocs[10];
+    for (int i=0; i<10; ++i) {
+        allocs[i] = mem_pool_set_alloc(&set, 1000);
+        assert_non_null(allocs[i]);
+    }
+    assert_null(mem_pool_set_alloc(&set, 2 * POOL_SIZE));
+    assert_int_equal(mem_pool_set_close(&set), ALLOC_NOT_FREED);
+    for (int i=0; i<10; ++i) {
+        assert_int_equal(mem_pool_set_del_alloc(&set, allocs[i]), ALLOC_OK);
+    }
+    assert_int_equal(mem_pool_set_close(&set), ALLOC_OK);
+
+    const unsigned num_small = POOL_SIZE / 16;
+    alloc_pt *small = calloc(num_small, sizeof(alloc_pt));
+    assert_non_null(small);
+    pool = mem_pool_open_numa(POOL_SIZE, FIRST_FIT, POOL_DEFAULT, 0);
+    assert_non_null(pool);
+    for (unsigned i=0; i<num_small; ++i) {
+        small[i] = mem_new_alloc(pool, 16);
+        assert_non_null(small[i]);
+    }
+    for (unsigned i=0; i<num_small; i+=2) {
+        assert_int_equal(mem_del_alloc(pool, small[i]), ALLOC_OK);
+    }
+    assert_int_equal(pool->num_gaps, (num_small + 1) / 2 + (POOL_SIZE % 16 != 0));
+    for (unsigned i=1; i<num_small; i+=2) {
+        assert_int_equal(mem_del_alloc(pool, small[i]), ALLOC_OK);
+    }
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    free(small);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+static void test_pool_guards(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * Debug guards (16-byte redzones on either side):
+     *
+     * 1. A 100-byte allocation takes a 132-byte segment, and its bytes
+     *    start 16 bytes in.
+     * 2. Freed blocks are held back: the next allocation goes after
+     *    them, until nothing else fits and the quarantine is emptied.
+     * 3. Overrunning an allocation is reported on check and on free.
+     * 4. Writing to a freed block is reported on check; close still
+     *    succeeds.
+     */
+
+    pool_segment_t segs[4];
+    unsigned num_segs;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pool = mem_pool_open_ex(300, FIRST_FIT, POOL_DEBUG_GUARDS);
+    assert_non_null(pool);
+    assert_int_equal(mem_pool_check_guards(NULL), ALLOC_FAIL);
+
+    alloc_pt a = mem_new_alloc(pool, 100);
+    assert_non_null(a);
+    assert_int_equal(a->size, 100);
+    assert_int_equal(a->mem - pool->mem, 16);
+    assert_int_equal(pool->alloc_size, 132);
+    assert_int_equal((unsigned char) a->mem[0], 0xcd);
+    memset(a->mem, 0xab, 100);
+    assert_int_equal(mem_pool_check_guards(pool), ALLOC_OK);
+    assert_int_equal(mem_inspect_pool_into(pool, segs, 4, &num_segs), ALLOC_OK);
+    assert_int_equal(num_segs, 2);
+    assert_int_equal(segs[0].size, 132);
+    assert_int_equal(segs[0].allocated, 1);
+    assert_int_equal(segs[1].size, 168);
+
+    assert_int_equal(mem_del_alloc(pool, a), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, a), ALLOC_FAIL);
+    assert_int_equal(pool->num_allocs, 0);
+    assert_int_equal(pool->alloc_size, 0);
+    alloc_pt b = mem_new_alloc(pool, 100);
+    assert_non_null(b);
+    assert_int_equal(b->mem - pool->mem, 132 + 16);
+    assert_int_equal(mem_del_alloc(pool, b), ALLOC_OK);
+    alloc_pt c = mem_new_alloc(pool, 100);
+    assert_non_null(c);
+    assert_int_equal(c->mem - pool->mem, 16);
+
+    c->mem[100] = 0;
+    assert_int_equal(mem_pool_check_guards(pool), ALLOC_CORRUPTED);
+    assert_int_equal(mem_del_alloc(pool, c), ALLOC_CORRUPTED);
+    assert_int_equal(pool->num_allocs, 0);
+
+    alloc_pt d = mem_new_alloc(pool, 50);
+    assert_non_null(d);
+    assert_int_equal(d->mem - pool->mem, 132 + 16);
+    char *stale = d->mem;
+    assert_int_equal(mem_del_alloc(pool, d), ALLOC_OK);
+    assert_int_equal(mem_pool_check_guards(pool), ALLOC_OK);
+    stale[10] = 1;
+    assert_int_equal(mem_pool_check_guards(pool), ALLOC_CORRUPTED);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+
+static void test_pool_sanitizer_marks(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * Under AddressSanitizer only (skipped otherwise):
+     *
+     * 1. An allocation is addressable, the gap right after it is not.
+     * 2. A freed allocation is no longer addressable.
+     * 3. After compaction, a moved allocation is addressable at its new
+     *    place and the space it left behind is not.
+     */
+
+#ifdef TEST_ASAN
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pool = mem_pool_open(1000, FIRST_FIT);
+    assert_non_null(pool);
+    char *mem = pool->mem;
+
+    alloc_pt a = mem_new_alloc(pool, 100);
+    assert_non_null(a);
+    assert_false(__asan_address_is_poisoned(a->mem));
+    assert_false(__asan_address_is_poisoned(a->mem + 99));
+    assert_true(__asan_address_is_poisoned(a->mem + 100));
+
+    alloc_pt b = mem_new_alloc(pool, 200);
+    assert_non_null(b);
+    memset(b->mem, 0xab, 200);
+    assert_int_equal(mem_del_alloc(pool, a), ALLOC_OK);
+    assert_true(__asan_address_is_poisoned(mem));
+
+    assert_int_equal(mem_pool_compact(pool, NULL), ALLOC_OK);
+    assert_ptr_equal(b->mem, mem);
+    assert_false(__asan_address_is_poisoned(b->mem + 199));
+    assert_true(__asan_address_is_poisoned(b->mem + 200));
+    assert_true(__asan_address_is_poisoned(mem + 299));
+
+    assert_int_equal(mem_del_alloc(pool, b), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+#else
+    skip();
+#endif
+}
+
+
+static void test_pool_leak_report(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * Leak reports (allocations tracked with POOL_LEAK_TRACKING):
+     *
+     * 1. An empty pool reports nothing.
+     * 2. A report lists each live allocation with size, offset, age and
+     *    call site.
+     * 3. With a report fd set, a refused close and a refused mem_free
+     *    write the report by themselves.
+     */
+
+    char report[4096];
+    FILE *file = tmpfile();
+    assert_non_null(file);
+    int fd = fileno(file);
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pool = mem_pool_open_ex(1000, FIRST_FIT, POOL_LEAK_TRACKING);
+    assert_non_null(pool);
+    assert_int_equal(mem_pool_leak_report(pool, fd), ALLOC_OK);
+    assert_int_equal(mem_pool_leak_report(NULL, fd), ALLOC_FAIL);
+    assert_int_equal(lseek(fd, 0, SEEK_END), 0);
+
+    alloc_pt a = mem_new_alloc(pool, 100);
+    alloc_pt b = mem_new_alloc(pool, 200);
+    assert_non_null(a);
+    assert_non_null(b);
+    assert_int_equal(mem_del_alloc(pool, a), ALLOC_OK);
+    assert_int_equal(mem_pool_leak_report(pool, fd), ALLOC_OK);
+
+    ssize_t len = pread(fd, report, sizeof(report) - 1, 0);
+    assert_true(len > 0);
+    report[len] = '\0';
+    assert_non_null(strstr(report, "1 allocations (200 bytes) not freed"));
+    assert_non_null(strstr(report, "200 bytes at offset 100, 0."));
+    assert_non_null(strstr(report, "s old, allocated at "));
+    assert_null(strstr(report, "at offset 0"));
+
+    assert_int_equal(ftruncate(fd, 0), 0);
+    assert_int_equal(lseek(fd, 0, SEEK_SET), 0);
+    assert_int_equal(mem_set_leak_report_fd(fd), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_NOT_FREED);
+    assert_int_equal(mem_free(), ALLOC_FAIL);
+    len = pread(fd, report, sizeof(report) - 1, 0);
+    assert_true(len > 0);
+    report[len] = '\0';
+    char *second = strstr(report, "not freed");
+    assert_non_null(second);
+    assert_non_null(strstr(second + 1, "not freed"));
+    assert_int_equal(mem_set_leak_report_fd(-1), ALLOC_OK);
+
+    assert_int_equal(mem_del_alloc(pool, b), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+    fclose(file);
+}
+
+
+static void test_pool_profile(void **state) {
+    (void) state; /* unused */
 
+    /*
+     * Heap profiler, sampling (practically) every allocation:
+     *
+     * 1. Allocations from one call site share a stack; freeing one
+     *    takes it off the live counts but not off the totals.
+     * 2. After stopping, nothing more is sampled, but frees still count.
+     * 3. The dump is a heap_v2 profile, followed by the mappings.
+     */
 
-    check_metadata(pool, BEST_FIT, POOL_SIZE, 0, 0, 1);
+    char profile[1 << 16];
+    alloc_pt allocs[3];
+    FILE *file = tmpfile();
+    assert_non_null(file);
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_pt pool = mem_pool_open(1000, FIRST_FIT);
+    assert_non_null(pool);
+    assert_int_equal(mem_profile_start(0), ALLOC_FAIL);
+    assert_int_equal(mem_profile_start(1), ALLOC_OK);
+
+    for (int i=0; i<3; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100);
+        assert_non_null(allocs[i]);
+    }
+    assert_int_equal(mem_del_alloc(pool, allocs[0]), ALLOC_OK);
+
+    assert_int_equal(mem_profile_stop(), ALLOC_OK);
+    assert_int_equal(mem_profile_stop(), ALLOC_CALLED_AGAIN);
+    alloc_pt unsampled = mem_new_alloc(pool, 50);
+    assert_non_null(unsampled);
+    assert_int_equal(mem_del_alloc(pool, unsampled), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, allocs[1]), ALLOC_OK);
+
+    assert_int_equal(mem_profile_dump(fileno(file)), ALLOC_OK);
+    ssize_t len = pread(fileno(file), profile, sizeof(profile) - 1, 0);
+    assert_true(len > 0);
+    profile[len] = '\0';
+    assert_non_null(strstr(profile, "heap profile: 1: 100 [3: 300] @ heap_v2/"));
+    assert_non_null(strstr(profile, "\n1: 100 [3: 300] @ 0x"));
+    assert_non_null(strstr(profile, "\nMAPPED_LIBRARIES:\n"));
+    fclose(file);
+
+    assert_int_equal(mem_del_alloc(pool, allocs[2]), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
 }
 
 
@@ -2316,110 +3459,472 @@ static void test_pool_scenario19(void **state) {
 }
 
 /*******************************************/
-/***          5. STRESS TEST             ***/
-/***                                     ***/
-/***         [non-functional]            ***/
-/***         [see NOTE below]            ***/
+/***      5. DEFERRED COALESCING         ***/
 /*******************************************/
 
-void test_pool_stresstest(void **state) {
-    (void) state; /* unused */
+static int pool_deferred_setup(void **state) {
+    alloc_status status;
+    pool_pt pool = NULL;
+
+    status = mem_init();
+    assert_int_equal(status, ALLOC_OK);
+
+    INFO("Allocating pool of %lu bytes with policy %s and deferred coalescing\n",
+         (long) POOL_SIZE, "FIRST_FIT");
+    pool = mem_pool_open_ex(POOL_SIZE, FIRST_FIT, POOL_DEFERRED_COALESCING);
+    assert_non_null(pool);
+
+    *state = pool;
+
+    return 0;
+}
+
+static int pool_deferred_teardown(void **state) {
+    pool_pt pool = *state;
+    alloc_status status;
+
+    INFO("Closing pool\n");
+    status = mem_pool_close(pool);
+    assert_int_equal(status, ALLOC_OK);
+
+    status = mem_free();
+    assert_int_equal(status, ALLOC_OK);
+
+    return 0;
+}
+
+static void test_pool_deferred_quick_list(void **state) {
+    pool_pt pool = *state;
+
+    /*
+     * Deferred scenario 1:
+     *
+     * 1. Pool starts out as a single gap.
+     * 2. Allocate 3 x 100.
+     * 3. Deallocate the middle one. It is not merged.
+     * 4. Allocate 100. It reuses the parked block.
+     * 5. Deallocate all three. Nothing is merged.
+     * 6. Consolidate. The pool is a single gap again.
+     */
+
+    pool_segment_t exp0[1] =
+            {
+                    {pool->total_size, 0},
+            };
+    check_pool(pool, exp0);
+
+
+    alloc_pt allocs[3];
+    for (int i=0; i<3; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100);
+        assert_non_null(allocs[i]);
+    }
+
+    assert_int_equal(mem_del_alloc(pool, allocs[1]), ALLOC_OK);
+    pool_segment_t exp1[4] =
+            {
+                    {100, 1},
+                    {100, 0},
+                    {100, 1},
+                    {pool->total_size - 300, 0},
+            };
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 200, 2, 2);
+    check_pool(pool, exp1);
+
+
+    alloc_pt alloc0 = mem_new_alloc(pool, 100);
+    assert_true(alloc0 == allocs[1]);
+    allocs[1] = alloc0;
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 300, 3, 1);
+
+
+    for (int i=0; i<3; ++i)
+        assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    pool_segment_t exp2[4] =
+            {
+                    {100, 0},
+                    {100, 0},
+                    {100, 0},
+                    {pool->total_size - 300, 0},
+            };
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 0, 0, 4);
+    check_pool(pool, exp2);
+
+
+    assert_int_equal(mem_pool_consolidate(pool), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 0, 0, 1);
+    check_pool(pool, exp0);
+}
+
+static void test_pool_deferred_lazy_coalesce(void **state) {
+    pool_pt pool = *state;
+
+    /*
+     * Deferred scenario 2:
+     *
+     * 1. Pool starts out as a single gap.
+     * 2. Allocate 3 x 100 and the rest of the pool.
+     * 3. Deallocate the 3 x 100.
+     * 4. Allocate 300. Only fits after the parked blocks are merged.
+     * 5. Clean up. Closing the pool merges what is still parked.
+     */
+
+    alloc_pt allocs[3];
+    for (int i=0; i<3; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100);
+        assert_non_null(allocs[i]);
+    }
+    alloc_pt rest = mem_new_alloc(pool, pool->total_size - 300);
+    assert_non_null(rest);
+
+    for (int i=0; i<3; ++i)
+        assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, POOL_SIZE - 300, 1, 3);
+
+
+    alloc_pt alloc0 = mem_new_alloc(pool, 300);
+    assert_non_null(alloc0);
+    pool_segment_t exp0[2] =
+            {
+                    {300, 1},
+                    {pool->total_size - 300, 1},
+            };
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, POOL_SIZE, 2, 0);
+    check_pool(pool, exp0);
+
+
+    // clean up
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, rest), ALLOC_OK);
+}
+
+/*******************************************/
+/***            6. COMPACTION            ***/
+/*******************************************/
+
+// updated on the compactor thread, checked on the test's: no asserts in here
+static atomic_uint num_moves;
+static atomic_uint num_bad_moves; // anything but a move down
+
+static void count_move(pool_pt pool, alloc_pt alloc, char *old_mem) {
+    if (pool == NULL || alloc->mem >= old_mem) {
+        atomic_fetch_add(&num_bad_moves, 1);
+    }
+    atomic_fetch_add(&num_moves, 1);
+}
+
+static void test_pool_compact(void **state) {
+    pool_pt pool = *state;
+
+    /*
+     * Compaction scenario:
+     *
+     * 1. Pool starts out as a single gap.
+     * 2. Allocate 10 x 100 and tag each allocation's bytes.
+     * 3. Deallocate (2, 1, 3), (6, 5), 8 and the head 0.
+     * 4. Compact. The three live allocations move to the front,
+     *    keep their contents, and the gaps merge into one at the end.
+     * 5. Clean up.
+     */
+
+    const unsigned NUM_ALLOCS = 10;
+
+    alloc_pt *allocs = (alloc_pt *) calloc(NUM_ALLOCS, sizeof(alloc_pt));
+    assert_non_null(allocs);
+
+    for (int i=0; i<NUM_ALLOCS; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100);
+        assert_non_null(allocs[i]);
+        memset(allocs[i]->mem, 'a' + i, 100);
+    }
+    assert_int_equal(mem_del_alloc(pool, allocs[2]), ALLOC_OK); allocs[2]=0;
+    assert_int_equal(mem_del_alloc(pool, allocs[1]), ALLOC_OK); allocs[1]=0;
+    assert_int_equal(mem_del_alloc(pool, allocs[3]), ALLOC_OK); allocs[3]=0;
+    assert_int_equal(mem_del_alloc(pool, allocs[6]), ALLOC_OK); allocs[6]=0;
+    assert_int_equal(mem_del_alloc(pool, allocs[5]), ALLOC_OK); allocs[5]=0;
+    assert_int_equal(mem_del_alloc(pool, allocs[8]), ALLOC_OK); allocs[8]=0;
+    assert_int_equal(mem_del_alloc(pool, allocs[0]), ALLOC_OK); allocs[0]=0;
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 300, 3, 4);
+
+
+    atomic_store(&num_moves, 0);
+    atomic_store(&num_bad_moves, 0);
+    assert_int_equal(mem_pool_compact(pool, count_move), ALLOC_OK);
+    assert_int_equal(atomic_load(&num_moves), 3);
+    assert_int_equal(atomic_load(&num_bad_moves), 0);
+
+    pool_segment_t exp0[4] =
+            {
+                    {100, 1},
+                    {100, 1},
+                    {100, 1},
+                    {pool->total_size - 300, 0},
+            };
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 300, 3, 1);
+    check_pool(pool, exp0);
+
+    const int live[3] = {4, 7, 9};
+    for (int i=0; i<3; ++i) {
+        alloc_pt alloc = allocs[live[i]];
+        assert_true(alloc->mem == pool->mem + i * 100);
+        assert_int_equal(alloc->mem[0], 'a' + live[i]);
+        assert_int_equal(alloc->mem[99], 'a' + live[i]);
+    }
+
+    // compacting a compact pool moves nothing
+    atomic_store(&num_moves, 0);
+    atomic_store(&num_bad_moves, 0);
+    assert_int_equal(mem_pool_compact(pool, count_move), ALLOC_OK);
+    assert_int_equal(atomic_load(&num_moves), 0);
+    assert_int_equal(atomic_load(&num_bad_moves), 0);
+    check_pool(pool, exp0);
+
 
-    const unsigned num_pools = 200;
-    const unsigned num_allocations = 1000;
-    const unsigned min_alloc_size = 10;
-    const unsigned pool_size =
-            (num_allocations / 2) *
-            (2 * min_alloc_size + (num_allocations - 1) * min_alloc_size);
-    assert_int_equal(pool_size, 5005000);
+    // clean up
+    for (int i=0; i<NUM_ALLOCS; ++i) {
+        if (allocs[i])
+            assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+    free(allocs);
 
+    pool_segment_t exp1[1] =
+            {
+                    {pool->total_size, 0},
+            };
+    check_pool(pool, exp1);
+}
 
-    pool_pt pools[num_pools];
-    alloc_pt allocations[num_pools][num_allocations];
+static void test_pool_background_compactor(void **state) {
+    pool_pt pool = *state;
 
     /*
-     * NOTE: This will work iff the address of the allocation
-     * in the pool is returned to the user instead of the
-     * address of the allocation record. Since allocation records
-     * are a part of the nodes, when the node heap is reallocated
-     * the node addresses shift with it, and so do the allocation
-     * record addresses. The allocation addresses on the pool
-     * remain the same, however, so they can be returned to the
-     * user and gotten from the user upon request for deletion.
+     * Background compaction scenario:
+     *
+     * 1. Pool starts out as a single gap.
+     * 2. Allocate 10 x 100.
+     * 3. Deallocate (2, 1, 3), (6, 5), 8 and pin 7.
+     * 4. Start the compactor, 2 segments per step. Everything but the
+     *    pinned allocation is eventually moved down.
+     * 5. Stop the compactor, unpin and compact the rest in one go.
+     * 6. Clean up.
      */
 
+    const unsigned NUM_ALLOCS = 10;
+
+    alloc_pt *allocs = (alloc_pt *) calloc(NUM_ALLOCS, sizeof(alloc_pt));
+    assert_non_null(allocs);
+
+    for (int i=0; i<NUM_ALLOCS; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100);
+        assert_non_null(allocs[i]);
+    }
+    assert_int_equal(mem_del_alloc(pool, allocs[2]), ALLOC_OK); allocs[2]=0;
+    assert_int_equal(mem_del_alloc(pool, allocs[1]), ALLOC_OK); allocs[1]=0;
+    assert_int_equal(mem_del_alloc(pool, allocs[3]), ALLOC_OK); allocs[3]=0;
+    assert_int_equal(mem_del_alloc(pool, allocs[6]), ALLOC_OK); allocs[6]=0;
+    assert_int_equal(mem_del_alloc(pool, allocs[5]), ALLOC_OK); allocs[5]=0;
+    assert_int_equal(mem_del_alloc(pool, allocs[8]), ALLOC_OK); allocs[8]=0;
+    assert_int_equal(mem_pin_alloc(pool, allocs[7]), ALLOC_OK);
+
+
+    atomic_store(&num_moves, 0);
+    atomic_store(&num_bad_moves, 0);
+    assert_int_equal(mem_pool_start_compactor(pool, 2, 100, count_move), ALLOC_OK);
+
+    // wait (up to a second) for the compactor to settle
+    const struct timespec pause = {0, 1000000};
+    for (int i=0; i<1000 && atomic_load(&num_moves) < 2; ++i)
+        nanosleep(&pause, NULL);
+
+    assert_int_equal(mem_pool_stop_compactor(pool), ALLOC_OK);
+    assert_int_equal(atomic_load(&num_moves), 2);
+    assert_int_equal(atomic_load(&num_bad_moves), 0);
+
+    pool_segment_t exp0[6] =
+            {
+                    {100, 1},
+                    {100, 1},
+                    {500, 0},
+                    {100, 1},
+                    {100, 1},
+                    {pool->total_size - 900, 0},
+            };
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 400, 4, 2);
+    check_pool(pool, exp0);
+
+
+    assert_int_equal(mem_unpin_alloc(pool, allocs[7]), ALLOC_OK);
+    assert_int_equal(mem_pool_compact(pool, count_move), ALLOC_OK);
+    assert_int_equal(atomic_load(&num_moves), 4);
+    assert_int_equal(atomic_load(&num_bad_moves), 0);
+
+    pool_segment_t exp1[5] =
+            {
+                    {100, 1},
+                    {100, 1},
+                    {100, 1},
+                    {100, 1},
+                    {pool->total_size - 400, 0},
+            };
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 400, 4, 1);
+    check_pool(pool, exp1);
+
+
+    // clean up
+    for (int i=0; i<NUM_ALLOCS; ++i) {
+        if (allocs[i])
+            assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+    free(allocs);
+}
+
+/*******************************************/
+/***          7. STRESS TEST             ***/
+/*******************************************/
+
+static unsigned long long elapsed_ms(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - since->tv_sec) * 1000ULL + (now.tv_nsec - since->tv_nsec) / 1000000 + 1;
+}
+
+static void check_budget(const char *phase, const struct timespec *since, unsigned long long budget_ms) {
+    unsigned long long ms = elapsed_ms(since);
+
+    INFO("stress %-5s %6llu ms (budget %llu ms)\n", phase, ms, budget_ms);
+    if (ms > budget_ms) {
+        INFO("ASSERT WILL FAIL: %s phase over budget\n", phase);
+    }
+    assert_true(ms <= budget_ms);
+}
+
+static void test_pool_stresstest(void **state) {
+    (void) state; /* unused */
+
+    const unsigned num_pools = STRESS_NUM_POOLS;
+    const unsigned num_allocations = STRESS_NUM_ALLOCATIONS;
+    const unsigned min_alloc_size = STRESS_MIN_ALLOC_SIZE;
+    const size_t pool_size =
+            (size_t) min_alloc_size * num_allocations * (num_allocations + 1) / 2;
+
+    pool_pt *pools = calloc(num_pools, sizeof(pool_pt));
+    alloc_pt *allocations = calloc((size_t) num_pools * num_allocations, sizeof(alloc_pt));
+    assert_non_null(pools);
+    assert_non_null(allocations);
+
     /*
      * Testing dynamic reallocation of pool structures:
      *
-     * 1. 200 pools of 5005000 each (many pools)
-     * 2. In each pool 1000 allocations of different sizes (many allocations)
-     * 3. In each pool 500 deallocations (many gaps)
+     * 1. STRESS_NUM_POOLS pools, each exactly big enough (many pools)
+     * 2. In each pool STRESS_NUM_ALLOCATIONS allocations of
+     *    different sizes, filling it up (many allocations)
+     * 3. In each pool every other allocation deallocated (many gaps)
+     * 4. The rest deallocated, and the pools closed
+     *
+     * The node heaps grow by chunks that stay put, so allocation
+     * handles survive the growth. Each phase has to finish within
+     * its budget (see test_suite.h), which catches any operation
+     * turning quadratic in the number of segments.
      */
 
     // initialize store
     assert_int_equal(mem_init(), ALLOC_OK);
 
-    // allocate pools
+    struct timespec phase_start;
+
+    // open pools
+    clock_gettime(CLOCK_MONOTONIC, &phase_start);
     for (unsigned pix=0; pix < num_pools; ++pix) {
-        // open pool
         pools[pix] =
                 mem_pool_open(pool_size, (pix % 2) ? FIRST_FIT : BEST_FIT);
         assert_non_null(pools[pix]);
-        // allocate pool
-        unsigned allocated = 0;
+    }
+    check_budget("open", &phase_start, STRESS_BUDGET_OPEN_MS);
+
+    // fill pools
+    clock_gettime(CLOCK_MONOTONIC, &phase_start);
+    for (unsigned pix=0; pix < num_pools; ++pix) {
+        alloc_pt *pool_allocs = &allocations[(size_t) pix * num_allocations];
+        size_t allocated = 0;
         for (unsigned aix=0; aix < num_allocations; ++aix) {
-            allocations[pix][aix] =
+            pool_allocs[aix] =
                     mem_new_alloc(pools[pix], (aix + 1) * min_alloc_size);
             allocated += (aix + 1) * min_alloc_size;
-            if (!allocations[pix][aix]) {
-                INFO("ASSERT WILL FAIL at pix = %u, aix = %u, allocated = %u\n", pix, aix, allocated);
-            }
-            assert_non_null(allocations[pix][aix]);
-        }
-        // delete every other allocation
-        for (unsigned aix=0; aix < num_allocations; ++aix) {
-            if (aix % 2) {
-                assert_int_equal(
-                        mem_del_alloc(pools[pix], allocations[pix][aix]),
-                        ALLOC_OK);
-                allocations[pix][aix] = NULL;
+            if (!pool_allocs[aix]) {
+                INFO("ASSERT WILL FAIL at pix = %u, aix = %u, allocated = %lu\n", pix, aix, (unsigned long) allocated);
             }
+            assert_non_null(pool_allocs[aix]);
         }
+        assert_int_equal(pools[pix]->num_allocs, num_allocations);
+        assert_int_equal(pools[pix]->alloc_size, pool_size);
     }
+    check_budget("alloc", &phase_start, STRESS_BUDGET_ALLOC_MS);
 
-    // delete pools
+    // delete every other allocation, then the rest
+    clock_gettime(CLOCK_MONOTONIC, &phase_start);
     for (unsigned pix=0; pix < num_pools; ++pix) {
-        // delete pool's allocations
-        for (unsigned aix=0; aix < num_allocations; ++aix) {
-            if (allocations[pix][aix]) {
-                // delete allocation
-                assert_int_equal(
-                    mem_del_alloc(pools[pix], allocations[pix][aix]),
-                    ALLOC_OK);
-            }
+        alloc_pt *pool_allocs = &allocations[(size_t) pix * num_allocations];
+        for (unsigned aix=1; aix < num_allocations; aix += 2) {
+            assert_int_equal(mem_del_alloc(pools[pix], pool_allocs[aix]), ALLOC_OK);
+            pool_allocs[aix] = NULL;
+        }
+        assert_int_equal(pools[pix]->num_gaps, num_allocations / 2);
+    }
+    for (unsigned pix=0; pix < num_pools; ++pix) {
+        alloc_pt *pool_allocs = &allocations[(size_t) pix * num_allocations];
+        for (unsigned aix=0; aix < num_allocations; aix += 2) {
+            assert_int_equal(mem_del_alloc(pools[pix], pool_allocs[aix]), ALLOC_OK);
         }
-        // close pool
+        assert_int_equal(pools[pix]->num_gaps, 1);
+    }
+    check_budget("free", &phase_start, STRESS_BUDGET_FREE_MS);
+
+    // close pools
+    clock_gettime(CLOCK_MONOTONIC, &phase_start);
+    for (unsigned pix=0; pix < num_pools; ++pix) {
         assert_int_equal(mem_pool_close(pools[pix]), ALLOC_OK);
     }
+    check_budget("close", &phase_start, STRESS_BUDGET_CLOSE_MS);
 
     // free store
     assert_int_equal(mem_free(), ALLOC_OK);
+
+    free(allocations);
+    free(pools);
 }
 
 
 /*******************************************/
-/***         6. DRIVER ROUTINE           ***/
+/***         8. DRIVER ROUTINE           ***/
 /*******************************************/
 
 int run_test_suite() {
     const struct CMUnitTest tests[] = {
             cmocka_unit_test(test_pool_store_smoketest),
+            cmocka_unit_test(test_pool_store_reuse),
+            cmocka_unit_test(test_pool_cache),
+            cmocka_unit_test(test_pool_single_block),
+            cmocka_unit_test(test_pool_open_in),
             cmocka_unit_test(test_pool_smoketest),
 
             cmocka_unit_test(test_pool_nonempty),
 
             cmocka_unit_test_setup_teardown(test_pool_ff_metadata, pool_ff_setup, pool_ff_teardown),
             cmocka_unit_test_setup_teardown(test_pool_bf_metadata, pool_bf_setup, pool_bf_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_stats, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_inspect_into, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_inspect_packed, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_snapshot, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_metrics, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test(test_pool_trace),
+            cmocka_unit_test(test_pool_file),
+            cmocka_unit_test(test_pool_shared),
+            cmocka_unit_test(test_pool_numa),
+            cmocka_unit_test(test_pool_guards),
+            cmocka_unit_test(test_pool_sanitizer_marks),
+            cmocka_unit_test(test_pool_leak_report),
+            cmocka_unit_test(test_pool_profile),
 
             cmocka_unit_test_setup_teardown(test_pool_scenario00, pool_ff_setup, pool_ff_teardown),
             cmocka_unit_test_setup_teardown(test_pool_scenario01, pool_ff_setup, pool_ff_teardown),
@@ -2443,14 +3948,18 @@ int run_test_suite() {
             cmocka_unit_test_setup_teardown(test_pool_scenario18, pool_bf_setup, pool_bf_teardown),
             cmocka_unit_test_setup_teardown(test_pool_scenario19, pool_bf_setup, pool_bf_teardown),
 
-            // do not uncomment until the project is changed to return the allocation address
-//            cmocka_unit_test(test_pool_stresstest),
+            cmocka_unit_test_setup_teardown(test_pool_deferred_quick_list, pool_deferred_setup, pool_deferred_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_deferred_lazy_coalesce, pool_deferred_setup, pool_deferred_teardown),
+
+            cmocka_unit_test_setup_teardown(test_pool_compact, pool_ff_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_background_compactor, pool_ff_setup, pool_ff_teardown),
+
+            cmocka_unit_test(test_pool_stresstest),
     };
 
     return cmocka_run_group_tests_name("pool_test_suite", tests, NULL, NULL);
 }
 
 /* future editions */
-// TODO stress test: many pools, many allocations, many gaps (requires project refactoring, see NOTE in test body)
 // TODO test memory leaks: any way to do it w/o having to rewrite the source file?
 // TODO fix the final PASSED line of std::cerr output to the end of the file (?)
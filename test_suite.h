@@ -8,6 +8,31 @@
 #define NUM_ITERATIONS 6
 #define INSPECT_POOL // define if you want to see pool inspections in the output
 
+// stress test scale, override with -D to scale it up or down
+#ifndef STRESS_NUM_POOLS
+#define STRESS_NUM_POOLS 200
+#endif
+#ifndef STRESS_NUM_ALLOCATIONS
+#define STRESS_NUM_ALLOCATIONS 1000
+#endif
+#ifndef STRESS_MIN_ALLOC_SIZE
+#define STRESS_MIN_ALLOC_SIZE 10 // allocation n is n times this size
+#endif
+
+// stress test time budgets per phase, in milliseconds, for all pools together
+#ifndef STRESS_BUDGET_OPEN_MS
+#define STRESS_BUDGET_OPEN_MS 1000
+#endif
+#ifndef STRESS_BUDGET_ALLOC_MS
+#define STRESS_BUDGET_ALLOC_MS 10000
+#endif
+#ifndef STRESS_BUDGET_FREE_MS
+#define STRESS_BUDGET_FREE_MS 10000
+#endif
+#ifndef STRESS_BUDGET_CLOSE_MS
+#define STRESS_BUDGET_CLOSE_MS 1000
+#endif
+
 int run_test_suite();
 
 #endif //DENVER_OS_PA_C_TEST_SUITE_H